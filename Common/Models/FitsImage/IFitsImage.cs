@@ -36,6 +36,8 @@ namespace FitsRatingTool.Common.Models.FitsImage
 
         bool AlwaysUnloadImageData { get; set; }
 
+        PhotometryPSFParameters PSFParameters { get; set; }
+
         new IReadOnlyDictionary<string, FitsImageHeaderRecord> Header { get; }
 
         FitsImageDim InDim { get; }
@@ -60,6 +62,16 @@ namespace FitsRatingTool.Common.Models.FitsImage
 
         bool ProcessImage(bool computeStretch, FitsImageLoaderParameters parameters, out IFitsImageData? data);
 
+        bool ProcessImageInto(bool computeStretch, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch);
+
+        bool ProcessImagePreview(int maxSize, FitsImageLoaderParameters parameters, out IFitsImageData? data, out FitsImageDim dim);
+
+        bool ProcessCachedImageInto(FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch);
+
+        bool PrefetchFrame(FitsImageLoaderParameters parameters);
+
+        void CancelProcessing();
+
         IDisposable Ref();
     }
 }
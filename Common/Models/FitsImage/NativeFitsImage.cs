@@ -18,6 +18,7 @@
 
 using FitsRatingTool.FitsLoader.Models;
 using FitsRatingTool.FitsLoader.Native;
+using System.Runtime.InteropServices;
 using System.Text;
 
 namespace FitsRatingTool.Common.Models.FitsImage
@@ -49,6 +50,8 @@ namespace FitsRatingTool.Common.Models.FitsImage
             }
         }
 
+        private static readonly object groupLock = new();
+
         private int refCount = 0;
 
         private readonly INativeFitsLoader loader;
@@ -58,6 +61,14 @@ namespace FitsRatingTool.Common.Models.FitsImage
         private FitsStatisticsHandle statisticsHandle;
         private FitsImageHandle imgHandle;
 
+        // Polled by the native renderer, hence pinned. Written
+        // without the lock so that a running render can be stopped.
+        private readonly int[] cancelFlag = new int[1];
+        private GCHandle cancelFlagHandle;
+
+        private IntPtr previewData;
+        private ulong previewDataSize;
+
         private volatile bool disposed = false;
 
         public bool IsFileClosed { get; private set; }
@@ -86,6 +97,8 @@ namespace FitsRatingTool.Common.Models.FitsImage
             }
         }
 
+        public PhotometryPSFParameters PSFParameters { get; set; } = PhotometryPSFParameters.Default;
+
         public string File { get; }
 
         public string FileName => Path.GetFileName(File);
@@ -117,6 +130,7 @@ namespace FitsRatingTool.Common.Models.FitsImage
             this.loader = loader;
             File = file;
             this.fitsHandle = fitsHandle;
+            cancelFlagHandle = GCHandle.Alloc(cancelFlag, GCHandleType.Pinned);
 
             for (int i = 0; i < fitsHandle.HeaderRecords; ++i)
             {
@@ -190,14 +204,16 @@ namespace FitsRatingTool.Common.Models.FitsImage
                     throw new Exception("Already disposed");
                 }
 
+                uint[] newHistogram = new uint[Histogram.Length];
                 if (dataHandle.ImagePtr.ToInt64() != 0)
                 {
-                    loader.FreeImageData(dataHandle);
-                    dataHandle = default;
+                    // Reuses the already allocated native buffers
+                    dataHandle = loader.ReloadImageData(fitsHandle, dataHandle, parameters, newHistogram, (uint)newHistogram.Length);
+                }
+                else
+                {
+                    dataHandle = loader.LoadImageData(fitsHandle, parameters, newHistogram, (uint)newHistogram.Length);
                 }
-
-                uint[] newHistogram = new uint[Histogram.Length];
-                dataHandle = loader.LoadImageData(fitsHandle, parameters, newHistogram, (uint)newHistogram.Length);
 
                 IsFileClosed = false;
 
@@ -259,7 +275,7 @@ namespace FitsRatingTool.Common.Models.FitsImage
                     statisticsHandle = default;
                 }
 
-                handle = statisticsHandle = loader.ComputeStatistics(fitsHandle, dataHandle, callback != null ? (phase, nobj, iobj, nstars) => callback(phase, nobj, iobj, nstars, false, null) : null);
+                handle = statisticsHandle = loader.ComputeStatistics(fitsHandle, dataHandle, PSFParameters, callback != null ? (phase, nobj, iobj, nstars) => callback(phase, nobj, iobj, nstars, false, null) : null);
 
                 IsFileClosed = false;
 
@@ -366,6 +382,69 @@ namespace FitsRatingTool.Common.Models.FitsImage
             }
         }
 
+        // Computes stretch parameters shared by all images from their merged histograms.
+        // Images whose data is not loaded are loaded one at a time by the native loader
+        // and unloaded again once their histograms are merged, so at most one of them
+        // is resident at a time.
+        internal static bool ComputeGroupStretch(INativeFitsLoader loader, IReadOnlyList<NativeFitsImage> images, out ImageStretchParameters parameters)
+        {
+            // Only one group is locked at a time so that two groups with
+            // images in different order cannot deadlock
+            lock (groupLock)
+            {
+                var locked = new List<NativeFitsImage>();
+                try
+                {
+                    var fitsHandles = new List<FitsHandle>();
+                    var dataHandles = new List<FitsImageDataHandle>();
+
+                    foreach (var image in images)
+                    {
+                        Monitor.Enter(image);
+                        locked.Add(image);
+
+                        if (!image.disposed && image.fitsHandle.Info.ToInt64() != 0 && image.dataHandle.ImagePtr.ToInt64() != 0)
+                        {
+                            fitsHandles.Add(image.fitsHandle);
+                            dataHandles.Add(image.dataHandle);
+                        }
+                    }
+
+                    if (fitsHandles.Count == 0)
+                    {
+                        parameters = default;
+                        return false;
+                    }
+
+                    parameters = loader.ComputeGroupStretch(fitsHandles.ToArray(), dataHandles.ToArray(), (uint)fitsHandles.Count);
+
+                    foreach (var image in locked)
+                    {
+                        if (!image.disposed)
+                        {
+                            image.IsFileClosed = false;
+
+                            image.UpdateImageDataValid();
+                            if (image.AlwaysUnloadImageData)
+                            {
+                                image.UnloadImageData();
+                                image.CloseFile();
+                            }
+                        }
+                    }
+
+                    return true;
+                }
+                finally
+                {
+                    foreach (var image in locked)
+                    {
+                        Monitor.Exit(image);
+                    }
+                }
+            }
+        }
+
         bool IFitsImage.ProcessImage(bool computeStretch, FitsImageLoaderParameters parameters, out IFitsImageData? data)
         {
             lock (this)
@@ -389,12 +468,39 @@ namespace FitsRatingTool.Common.Models.FitsImage
         }
 
         public bool ProcessImage(bool computeStretch, FitsImageLoaderParameters parameters, out NativeFitsImageData data)
+        {
+            lock (this)
+            {
+                // The native image buffer is reused if it was already allocated
+                if (ProcessImage((histogram, cancel) =>
+                {
+                    imgHandle = loader.ProcessImage(fitsHandle, dataHandle, imgHandle, computeStretch, parameters, histogram, (uint)histogram.Length, cancel);
+                    return imgHandle.Data.ToInt64() != 0;
+                }))
+                {
+                    data = new NativeFitsImageData(imgHandle.Data);
+                    return true;
+                }
+            }
+
+            data = default;
+
+            return false;
+        }
+
+        // Renders directly into data, e.g. the locked buffer of a bitmap, whose
+        // rows are rowPitch bytes apart. 0 means that rows are not padded.
+        public bool ProcessImageInto(bool computeStretch, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch)
+        {
+            return ProcessImage((histogram, cancel) => loader.ProcessImageInto(fitsHandle, dataHandle, data, dataSize, rowPitch, computeStretch, parameters, histogram, (uint)histogram.Length, cancel));
+        }
+
+        private bool ProcessImage(Func<uint[], IntPtr, bool> process)
         {
             lock (this)
             {
                 if (disposed)
                 {
-                    data = default;
                     return false;
                 }
 
@@ -407,21 +513,21 @@ namespace FitsRatingTool.Common.Models.FitsImage
 
                 if (dataHandle.ImagePtr.ToInt64() == 0)
                 {
-                    data = default;
                     return false;
                 }
 
-                if (imgHandle.Data.ToInt64() != 0)
-                {
-                    loader.FreeImage(imgHandle);
-                    imgHandle = default;
-                }
+                Volatile.Write(ref cancelFlag[0], 0);
 
                 uint[] newHistogram = new uint[StretchedHistogram.Length];
-                imgHandle = loader.ProcessImage(fitsHandle, dataHandle, imgHandle, computeStretch, parameters, newHistogram, (uint)newHistogram.Length);
+                bool success = process(newHistogram, cancelFlagHandle.AddrOfPinnedObject());
 
                 IsFileClosed = false;
 
+                if (Volatile.Read(ref cancelFlag[0]) != 0)
+                {
+                    return false;
+                }
+
                 UpdateImageDataValid();
                 if (AlwaysUnloadImageData)
                 {
@@ -429,21 +535,176 @@ namespace FitsRatingTool.Common.Models.FitsImage
                     CloseFile();
                 }
 
-                if (!IsImageDataValid)
+                if (!success || !IsImageDataValid)
                 {
-                    data = default;
                     return false;
                 }
 
                 IsImageValid = true;
 
                 StretchedHistogram = newHistogram;
+            }
+            return true;
+        }
+
+        // Copies the image rendered with the fixed stretch in parameters from the native
+        // frame cache, which renders and caches it first if needed. Meant for frames that
+        // are shown over and over, e.g. when blinking through a group.
+        public bool ProcessCachedImageInto(FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch)
+        {
+            return ProcessCachedImage(() => loader.ProcessCachedImageInto(fitsHandle, dataHandle, data, dataSize, rowPitch, parameters));
+        }
+
+        // Renders the image into the native frame cache ahead of time,
+        // so that ProcessCachedImageInto only needs to copy it
+        public bool PrefetchFrame(FitsImageLoaderParameters parameters)
+        {
+            return ProcessCachedImage(() => loader.PrefetchFrame(fitsHandle, dataHandle, parameters));
+        }
 
-                data = new NativeFitsImageData(imgHandle.Data);
+        private bool ProcessCachedImage(Func<bool> process)
+        {
+            lock (this)
+            {
+                if (disposed)
+                {
+                    return false;
+                }
+
+                if (fitsHandle.Info.ToInt64() == 0)
+                {
+                    throw new ObjectDisposedException(nameof(NativeFitsImage));
+                }
+
+                if (dataHandle.ImagePtr.ToInt64() == 0)
+                {
+                    return false;
+                }
+
+                // Frames that aren't cached yet are rendered
+                // from the image data, which may be reloaded
+                bool success = process();
+
+                UpdateImageDataValid();
+                if (AlwaysUnloadImageData && IsImageDataValid)
+                {
+                    UnloadImageData();
+                    CloseFile();
+                }
+
+                return success;
+            }
+        }
+
+        bool IFitsImage.ProcessImagePreview(int maxSize, FitsImageLoaderParameters parameters, out IFitsImageData? data, out FitsImageDim dim)
+        {
+            if (ProcessImagePreview(maxSize, parameters, out var nativeData, out dim))
+            {
+                data = nativeData;
+                return true;
+            }
+
+            data = null;
+
+            return false;
+        }
+
+        // Renders a downsampled copy of the loaded image data, no side larger than maxSize,
+        // to be shown while the full resolution image is processed. The downsampled data
+        // is kept until the image data is reloaded. The returned data is only valid until
+        // the next call.
+        public bool ProcessImagePreview(int maxSize, FitsImageLoaderParameters parameters, out NativeFitsImageData data, out FitsImageDim dim)
+        {
+            lock (this)
+            {
+                if (disposed || dataHandle.ImagePtr.ToInt64() == 0)
+                {
+                    data = default;
+                    dim = default;
+                    return false;
+                }
+
+                // The first call only determines the size of the preview
+                loader.ProcessImagePreviewInto(fitsHandle, dataHandle, IntPtr.Zero, 0, 0, maxSize, parameters, out dim);
+
+                ulong size = (ulong)dim.Width * (ulong)dim.Height * 4;
+                if (size == 0)
+                {
+                    data = default;
+                    return false;
+                }
+
+                if (previewDataSize < size)
+                {
+                    previewData = previewData.ToInt64() == 0 ? Marshal.AllocHGlobal((IntPtr)size) : Marshal.ReAllocHGlobal(previewData, (IntPtr)size);
+                    previewDataSize = size;
+                }
+
+                if (!loader.ProcessImagePreviewInto(fitsHandle, dataHandle, previewData, previewDataSize, 0, maxSize, parameters, out dim))
+                {
+                    data = default;
+                    return false;
+                }
+
+                data = new NativeFitsImageData(previewData);
             }
             return true;
         }
 
+        // Renders a thumbnail, no side larger than maxSize, straight from the file by
+        // reading only every k-th row and column. Neither the image data nor the
+        // stretch parameters need to be loaded for this. If data is zero only the
+        // dimensions of the thumbnail are determined.
+        public bool ReadThumbnailInto(int maxSize, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch, out FitsImageDim dim)
+        {
+            lock (this)
+            {
+                if (disposed || fitsHandle.Info.ToInt64() == 0)
+                {
+                    dim = default;
+                    return false;
+                }
+
+                bool wasFileClosed = IsFileClosed;
+
+                bool success = loader.ReadThumbnail(fitsHandle, data, dataSize, rowPitch, maxSize, parameters, out dim);
+
+                IsFileClosed = false;
+
+                // The thumbnail is read straight from the file, which is
+                // closed again unless it was already open before
+                if (wasFileClosed || AlwaysUnloadImageData)
+                {
+                    CloseFile();
+                }
+
+                return success;
+            }
+        }
+
+        // Stores a rendered preview of this file, e.g. a thumbnail, and its histogram
+        // in the cache directory. The entry is keyed by the file's size and modification
+        // time and by maxSize and parameters, which should be those it was rendered with.
+        public bool StorePreview(string cacheDirectory, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, FitsImageDim dim, ulong rowPitch, uint[]? histogram)
+        {
+            return loader.StorePreview(cacheDirectory, File, maxSize, parameters, data, dim, rowPitch, histogram, (uint)(histogram?.Length ?? 0));
+        }
+
+        // Loads a preview stored by StorePreview. Returns false if there is none for
+        // maxSize and parameters or if the file has changed since. If data is zero only
+        // the dimensions of the preview are determined.
+        public bool LoadCachedPreview(string cacheDirectory, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch, uint[]? histogram, out FitsImageDim dim)
+        {
+            return loader.LoadPreview(cacheDirectory, File, maxSize, parameters, data, dataSize, rowPitch, histogram, (uint)(histogram?.Length ?? 0), out dim);
+        }
+
+        // Stops a running ProcessImage, which then returns false.
+        // Can be called from any thread.
+        public void CancelProcessing()
+        {
+            Volatile.Write(ref cancelFlag[0], 1);
+        }
+
         public void Dispose()
         {
             Dispose(true);
@@ -477,10 +738,19 @@ namespace FitsRatingTool.Common.Models.FitsImage
                         dataHandle = default;
                     }
 
+                    if (previewData.ToInt64() != 0)
+                    {
+                        Marshal.FreeHGlobal(previewData);
+                        previewData = default;
+                        previewDataSize = 0;
+                    }
+
                     loader.CloseFitFile(fitsHandle);
                     loader.FreeFit(fitsHandle);
                     fitsHandle = default;
 
+                    cancelFlagHandle.Free();
+
                     disposed = true;
                 }
             }
@@ -17,11 +17,18 @@
 */
 
 using FitsRatingTool.Common.Models.FitsImage;
+using FitsRatingTool.FitsLoader.Models;
 
 namespace FitsRatingTool.Common.Services
 {
     public interface IFitsImageLoader
     {
         IFitsImage? LoadFit(string file, long maxInputSize, int maxWidth, int maxHeight);
+
+        bool ComputeGroupStretch(IEnumerable<IFitsImage> images, out ImageStretchParameters parameters);
+
+        void SetFrameCacheBudget(long bytes);
+
+        Task PrefetchFrames(IReadOnlyList<IFitsImage> frames, int playhead, int count, FitsImageLoaderParameters parameters, CancellationToken cancellationToken = default);
     }
 }
@@ -17,6 +17,7 @@
 */
 
 using FitsRatingTool.Common.Models.FitsImage;
+using FitsRatingTool.FitsLoader.Models;
 using FitsRatingTool.FitsLoader.Native;
 
 namespace FitsRatingTool.Common.Services.Impl
@@ -41,5 +42,45 @@ namespace FitsRatingTool.Common.Services.Impl
 
             return null;
         }
+
+        public bool ComputeGroupStretch(IEnumerable<IFitsImage> images, out ImageStretchParameters parameters)
+        {
+            return NativeFitsImage.ComputeGroupStretch(loader, images.OfType<NativeFitsImage>().ToList(), out parameters);
+        }
+
+        public void SetFrameCacheBudget(long bytes)
+        {
+            loader.SetFrameCacheBudget((ulong)Math.Max(0, bytes));
+        }
+
+        // Renders the count frames after the playhead into the frame cache on a background
+        // thread, nearest first. The sequence wraps around like a blink loop does. Cancel
+        // when the playhead moves so that frames that are no longer needed are skipped.
+        public Task PrefetchFrames(IReadOnlyList<IFitsImage> frames, int playhead, int count, FitsImageLoaderParameters parameters, CancellationToken cancellationToken = default)
+        {
+            if (frames.Count == 0)
+            {
+                return Task.CompletedTask;
+            }
+
+            var upcoming = new List<IFitsImage>();
+            for (int i = 1; i <= Math.Min(count, frames.Count - 1); ++i)
+            {
+                upcoming.Add(frames[(playhead + i) % frames.Count]);
+            }
+
+            return Task.Run(() =>
+            {
+                foreach (var frame in upcoming)
+                {
+                    if (cancellationToken.IsCancellationRequested)
+                    {
+                        break;
+                    }
+
+                    frame.PrefetchFrame(parameters);
+                }
+            }, cancellationToken);
+        }
     }
 }
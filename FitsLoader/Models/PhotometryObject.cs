@@ -37,6 +37,7 @@ namespace FitsRatingTool.FitsLoader.Models
             public readonly double fwhm_y;
             public readonly double fwhm;
             public readonly double eccentricity;
+            public readonly PhotometryPSFMethod method;
         };
 
         public readonly int catalog_index;
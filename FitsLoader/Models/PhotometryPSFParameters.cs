@@ -0,0 +1,48 @@
+﻿/*
+    FITS Rating Tool
+    Copyright (C) 2022 TheCyberBrick
+    
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+using System.Runtime.InteropServices;
+
+namespace FitsRatingTool.FitsLoader.Models
+{
+    [StructLayout(LayoutKind.Sequential)]
+    public struct PhotometryPSFParameters
+    {
+        public double fastOutlierSigma;
+        public double subsampleTolerance;
+        public int subsampleGrid;
+        public int subsampleMinStars;
+        public int subsampleStep;
+        [MarshalAs(UnmanagedType.U1)]
+        public bool fast;
+        [MarshalAs(UnmanagedType.U1)]
+        public bool subsample;
+
+        // Same as the defaults of the native photometry parameters
+        public static PhotometryPSFParameters Default => new()
+        {
+            fastOutlierSigma = 3,
+            subsampleTolerance = 0.02,
+            subsampleGrid = 8,
+            subsampleMinStars = 200,
+            subsampleStep = 50,
+            fast = false,
+            subsample = false
+        };
+    }
+}
@@ -55,5 +55,8 @@ namespace FitsRatingTool.FitsLoader.Models
         public double residual_mean;
         public double residual_median;
         public double residual_mad;
+
+        public int stars_used;
+        public int stars_available;
     };
 }
@@ -35,6 +35,8 @@ namespace FitsRatingTool.FitsLoader.Native
 
         FitsImageDataHandle LoadImageData(FitsHandle handle, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize);
 
+        FitsImageDataHandle ReloadImageData(FitsHandle handle, FitsImageDataHandle dataHandle, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize);
+
         bool UnloadImageData(FitsImageDataHandle handle);
 
         bool IsImageDataLoaded(FitsImageDataHandle handle);
@@ -43,7 +45,7 @@ namespace FitsRatingTool.FitsLoader.Native
 
 
 
-        FitsStatisticsHandle ComputeStatistics(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, StatisticsProgressCallback? callback);
+        FitsStatisticsHandle ComputeStatistics(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, PhotometryPSFParameters psfParameters, StatisticsProgressCallback? callback);
 
         bool GetPhotometry(FitsStatisticsHandle handle, int src_start, int src_n, int dst_start, PhotometryObject[] photometry);
 
@@ -53,9 +55,29 @@ namespace FitsRatingTool.FitsLoader.Native
 
         ImageStretchParameters ComputeStretch(FitsHandle fitsHandle, FitsImageDataHandle dataHandle);
 
+        ImageStretchParameters ComputeGroupStretch(FitsHandle[] fitsHandles, FitsImageDataHandle[] dataHandles, uint numHandles);
+
+
+
+        FitsImageHandle ProcessImage(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageHandle imgHandle, bool computeStrechParams, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize, IntPtr cancel);
+
+        bool ProcessImageInto(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, bool computeStrechParams, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize, IntPtr cancel);
+
+        bool ProcessImagePreviewInto(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, int maxSize, FitsImageLoaderParameters parameters, out FitsImageDim previewDim);
+
+        bool ReadThumbnail(FitsHandle fitsHandle, IntPtr data, ulong dataSize, ulong rowPitch, int maxSize, FitsImageLoaderParameters parameters, out FitsImageDim thumbnailDim);
+
+        void SetFrameCacheBudget(ulong budget);
+
+        void ClearFrameCache();
+
+        bool PrefetchFrame(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageLoaderParameters parameters);
+
+        bool ProcessCachedImageInto(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, FitsImageLoaderParameters parameters);
 
+        bool StorePreview(string cacheDirectory, string file, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, FitsImageDim dim, ulong rowPitch, uint[]? histogram, uint histogramSize);
 
-        FitsImageHandle ProcessImage(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageHandle imgHandle, bool computeStrechParams, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize);
+        bool LoadPreview(string cacheDirectory, string file, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch, uint[]? histogram, uint histogramSize, out FitsImageDim previewDim);
 
         void FreeImage(FitsImageHandle imgHandle);
 
@@ -46,6 +46,22 @@ namespace FitsRatingTool.GuiApp.Services
         int MaxThumbnailHeight { get; set; }
         #endregion
 
+        #region Photometry
+        bool PhotometryFastPSF { get; set; }
+
+        float PhotometryFastPSFOutlierSigma { get; set; }
+
+        bool PhotometrySubsample { get; set; }
+
+        int PhotometrySubsampleGrid { get; set; }
+
+        int PhotometrySubsampleMinStars { get; set; }
+
+        int PhotometrySubsampleStep { get; set; }
+
+        float PhotometrySubsampleTolerance { get; set; }
+        #endregion
+
         #region Evaluation
         string DefaultEvaluationFormulaPath { get; set; }
 
@@ -18,6 +18,7 @@
 
 using FitsRatingTool.Common.Services;
 using FitsRatingTool.GuiApp.Models;
+using System.Globalization;
 
 namespace FitsRatingTool.GuiApp.Services.Impl
 {
@@ -95,6 +96,50 @@ namespace FitsRatingTool.GuiApp.Services.Impl
         }
         #endregion
 
+        #region Photometry
+        public bool PhotometryFastPSF
+        {
+            get => bool.TryParse(manager.Get("PhotometryFastPSF"), out bool value) ? value : false;
+            set => manager.Set("PhotometryFastPSF", value.ToString());
+        }
+
+        public float PhotometryFastPSFOutlierSigma
+        {
+            get => float.TryParse(manager.Get("PhotometryFastPSFOutlierSigma"), NumberStyles.Float, CultureInfo.InvariantCulture, out float value) ? value : 3.0f;
+            set => manager.Set("PhotometryFastPSFOutlierSigma", value.ToString(CultureInfo.InvariantCulture));
+        }
+
+        public bool PhotometrySubsample
+        {
+            get => bool.TryParse(manager.Get("PhotometrySubsample"), out bool value) ? value : false;
+            set => manager.Set("PhotometrySubsample", value.ToString());
+        }
+
+        public int PhotometrySubsampleGrid
+        {
+            get => int.TryParse(manager.Get("PhotometrySubsampleGrid"), out int value) ? value : 8;
+            set => manager.Set("PhotometrySubsampleGrid", value.ToString());
+        }
+
+        public int PhotometrySubsampleMinStars
+        {
+            get => int.TryParse(manager.Get("PhotometrySubsampleMinStars"), out int value) ? value : 200;
+            set => manager.Set("PhotometrySubsampleMinStars", value.ToString());
+        }
+
+        public int PhotometrySubsampleStep
+        {
+            get => int.TryParse(manager.Get("PhotometrySubsampleStep"), out int value) ? value : 50;
+            set => manager.Set("PhotometrySubsampleStep", value.ToString());
+        }
+
+        public float PhotometrySubsampleTolerance
+        {
+            get => float.TryParse(manager.Get("PhotometrySubsampleTolerance"), NumberStyles.Float, CultureInfo.InvariantCulture, out float value) ? value : 0.02f;
+            set => manager.Set("PhotometrySubsampleTolerance", value.ToString(CultureInfo.InvariantCulture));
+        }
+        #endregion
+
         #region Evaluation
         public string DefaultEvaluationFormulaPath
         {
@@ -19,6 +19,10 @@
 using FitsRatingTool.Common.Models.FitsImage;
 using FitsRatingTool.Common.Services;
 using FitsRatingTool.Common.Services.Impl;
+using FitsRatingTool.FitsLoader.Models;
+using System.Collections.Generic;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace FitsRatingTool.GuiApp.Services.Impl
 {
@@ -40,9 +44,34 @@ namespace FitsRatingTool.GuiApp.Services.Impl
             if (image != null)
             {
                 image.AlwaysUnloadImageData = !appConfig.KeepImageDataLoaded;
+                image.PSFParameters = new PhotometryPSFParameters
+                {
+                    fastOutlierSigma = appConfig.PhotometryFastPSFOutlierSigma,
+                    subsampleTolerance = appConfig.PhotometrySubsampleTolerance,
+                    subsampleGrid = appConfig.PhotometrySubsampleGrid,
+                    subsampleMinStars = appConfig.PhotometrySubsampleMinStars,
+                    subsampleStep = appConfig.PhotometrySubsampleStep,
+                    fast = appConfig.PhotometryFastPSF,
+                    subsample = appConfig.PhotometrySubsample
+                };
             }
 
             return image;
         }
+
+        public bool ComputeGroupStretch(IEnumerable<IFitsImage> images, out ImageStretchParameters parameters)
+        {
+            return defaultLoader.ComputeGroupStretch(images, out parameters);
+        }
+
+        public void SetFrameCacheBudget(long bytes)
+        {
+            defaultLoader.SetFrameCacheBudget(bytes);
+        }
+
+        public Task PrefetchFrames(IReadOnlyList<IFitsImage> frames, int playhead, int count, FitsImageLoaderParameters parameters, CancellationToken cancellationToken = default)
+        {
+            return defaultLoader.PrefetchFrames(frames, playhead, count, parameters, cancellationToken);
+        }
     }
 }
@@ -94,6 +94,7 @@ namespace FitsRatingTool.GuiApp.UI.AppConfig.ViewModels
 
             Categories.Add(CreateGeneralCategory());
             Categories.Add(CreateImagesCategory());
+            Categories.Add(CreatePhotometryCategory());
             Categories.Add(CreateEvaluationCategory());
             Categories.Add(CreateVoyagerCategory());
 
@@ -175,6 +176,43 @@ namespace FitsRatingTool.GuiApp.UI.AppConfig.ViewModels
             return category;
         }
 
+        private IAppConfigCategoryViewModel CreatePhotometryCategory()
+        {
+            var category = appConfigCategoryFactory.Create("Photometry");
+
+            category.Settings.Add(new BoolSettingViewModel("Fast PSF Estimation", () => appConfig.PhotometryFastPSF, v => appConfig.PhotometryFastPSF = v)
+            {
+                Description = "Whether the PSFs should be estimated from the moments of the stars, and only be fitted for stars whose estimate is an outlier. This is considerably faster, but the FWHM and eccentricity may differ slightly from the fitted ones."
+            });
+            category.Settings.Add(new FloatSettingViewModel("Fast PSF Outlier Threshold", () => appConfig.PhotometryFastPSFOutlierSigma, v => appConfig.PhotometryFastPSFOutlierSigma = v, 0.5f, 100.0f, 0.5f)
+            {
+                Description = "Number of standard deviations by which the residual or eccentricity of an estimated PSF must exceed the median for the PSF to be fitted instead. Only used with fast PSF estimation."
+            });
+            category.Settings.Add(SettingSeparatorViewModel.Instance);
+            category.Settings.Add(new BoolSettingViewModel("PSF Subsampling", () => appConfig.PhotometrySubsample, v => appConfig.PhotometrySubsample = v)
+            {
+                Description = "Whether the PSFs should only be determined for a subsample of the stars, spread evenly over the image, until the FWHM, HFR and eccentricity medians have settled. All stars are still used for the SNR, HFR and star count."
+            });
+            category.Settings.Add(new IntegerSettingViewModel("PSF Subsample Grid Size", () => appConfig.PhotometrySubsampleGrid, v => appConfig.PhotometrySubsampleGrid = v, 1, 64, 1)
+            {
+                Description = "Number of grid cells along each axis of the image. The brightest stars of each cell are sampled first, one cell after another."
+            });
+            category.Settings.Add(new IntegerSettingViewModel("PSF Subsample Min. Stars", () => appConfig.PhotometrySubsampleMinStars, v => appConfig.PhotometrySubsampleMinStars = v, 1, int.MaxValue, 10)
+            {
+                Description = "Minimum number of sampled stars before the statistics are checked."
+            });
+            category.Settings.Add(new IntegerSettingViewModel("PSF Subsample Step", () => appConfig.PhotometrySubsampleStep, v => appConfig.PhotometrySubsampleStep = v, 1, int.MaxValue, 10)
+            {
+                Description = "Number of stars that are sampled between two checks of the statistics."
+            });
+            category.Settings.Add(new FloatSettingViewModel("PSF Subsample Tolerance", () => appConfig.PhotometrySubsampleTolerance, v => appConfig.PhotometrySubsampleTolerance = v, 0.001f, 1.0f, 0.005f)
+            {
+                Description = "Sampling stops once the 95% confidence intervals of the FWHM and HFR medians are narrower than this fraction of the median on either side, and that of the eccentricity median narrower than this value."
+            });
+
+            return category;
+        }
+
         private IAppConfigCategoryViewModel CreateEvaluationCategory()
         {
             var category = appConfigCategoryFactory.Create("Evaluation");
@@ -33,14 +33,23 @@ namespace FitsRatingTool.GuiApp.UI.AppConfig.ViewModels
 
         public bool HasMax => Max < float.MaxValue;
 
-        public FloatSettingViewModel(string name, Func<float> getter, Action<float> setter, float min, float max) : base(name)
+        public float Step { get; }
+
+        public bool HasStep => Step > 0;
+
+        public FloatSettingViewModel(string name, Func<float> getter, Action<float> setter, float min, float max, float step) : base(name)
         {
             Setting = new ConfigSetting<float>(getter, setter);
             Min = min;
             Max = max;
+            Step = step;
+        }
+
+        public FloatSettingViewModel(string name, Func<float> getter, Action<float> setter, float min, float max) : this(name, getter, setter, min, max, 0)
+        {
         }
 
-        public FloatSettingViewModel(string name, Func<float> getter, Action<float> setter) : this(name, getter, setter, float.MinValue, float.MaxValue)
+        public FloatSettingViewModel(string name, Func<float> getter, Action<float> setter) : this(name, getter, setter, float.MinValue, float.MaxValue, 0)
         {
         }
     }
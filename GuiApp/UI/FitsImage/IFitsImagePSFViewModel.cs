@@ -62,5 +62,9 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage
         double FWHM4 { get; }
 
         double Eccentricity { get; }
+
+        PhotometryPSFMethod Method { get; }
+
+        bool IsSampled { get; }
     }
 }
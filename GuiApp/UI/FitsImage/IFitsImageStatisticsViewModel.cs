@@ -37,6 +37,9 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage
         // interface the data grid is bound to...
         new int Stars { get; }
 
+        int StarsUsed { get; }
+        int StarsAvailable { get; }
+
         new double Median { get; }
         new double MedianMAD { get; }
 
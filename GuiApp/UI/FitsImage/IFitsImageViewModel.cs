@@ -56,6 +56,8 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage
         #region +++ Image +++
         Bitmap? Bitmap { get; }
 
+        Bitmap? PreviewBitmap { get; }
+
         bool HasImage { get; }
 
         bool IsImageDataValid { get; }
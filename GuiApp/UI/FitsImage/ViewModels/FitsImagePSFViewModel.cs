@@ -72,5 +72,9 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
         public double FWHM4 { get => psf.fwhm * 4; }
 
         public double Eccentricity { get => psf.eccentricity; }
+
+        public PhotometryPSFMethod Method { get => psf.method; }
+
+        public bool IsSampled { get => psf.method != PhotometryPSFMethod.Unsampled; }
     }
 }
@@ -84,7 +84,10 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
                 residual_mean = other.ResidualMean,
                 residual_median = other.ResidualMedian,
                 residual_min = other.ResidualMin,
-                residual_mad = other.ResidualMAD
+                residual_mad = other.ResidualMAD,
+
+                stars_used = other.StarsUsed,
+                stars_available = other.StarsAvailable
             };
             Stars = stars;
         }
@@ -230,6 +233,9 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
 
         public int Stars { get; }
 
+        public int StarsUsed { get => statistics.stars_used; }
+        public int StarsAvailable { get => statistics.stars_available; }
+
         public double Median { get => statistics.median; }
         public double MedianMAD { get => statistics.median_mad; }
 
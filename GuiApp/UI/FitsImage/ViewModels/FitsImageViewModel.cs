@@ -122,6 +122,13 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
             private set => this.RaiseAndSetIfChanged(ref _bitmap, value);
         }
 
+        private Bitmap? _previewBitmap;
+        public Bitmap? PreviewBitmap
+        {
+            get => _previewBitmap;
+            private set => this.RaiseAndSetIfChanged(ref _previewBitmap, value);
+        }
+
         public bool HasImage
         {
             get => IsImageValid && Bitmap != null;
@@ -261,6 +268,15 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
 
         private ImageStretchParameters computedStretch;
 
+        // Longest side of the preview shown while the image is re-rendered
+        private const int PreviewSize = 1024;
+
+        private int renderGeneration;
+
+        // Incremented by every call of UpdateOrCreateBitmapAsync. Only the
+        // latest call shows its preview and clears the busy flag.
+        private int updateGeneration;
+
 
 
         private readonly IFitsImageHeaderRecordViewModel.IFactory fitsImageHeaderRecordFactory;
@@ -410,6 +426,12 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
                 this.RaisePropertyChanged(nameof(HasImage));
             });
 
+            // A render with the old stretch is of no use anymore, so it
+            // is stopped right away instead of delaying the new one
+            this.WhenAnyValue(x => x.Shadows, x => x.Midtones, x => x.Highlights, x => x.PreserveColorBalance)
+                .Skip(1)
+                .Subscribe(x => CancelRender());
+
             foreach (var record in fitsImage.Header.Values)
             {
                 _header.Add(fitsImageHeaderRecordFactory.Create(record));
@@ -516,16 +538,8 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
                 }
                 FitsImageLoaderParameters loaderParameters = this.loaderParameters;
                 loaderParameters.stretchParameters = GetStretchParameters();
-                if (fitsImage.ProcessImage(false, loaderParameters, out var data) && data is NativeFitsImageData nativeData && fitsImage.IsImageValid)
-                {
-                    Bitmap = new Bitmap(Avalonia.Platform.PixelFormat.Bgra8888, Avalonia.Platform.AlphaFormat.Unpremul, nativeData.Ptr, new Avalonia.PixelSize(fitsImage.OutDim.Width, fitsImage.OutDim.Height), new Avalonia.Vector(96, 96), fitsImage.OutDim.Width * 4);
-                    IsImageValid = true;
-                }
-                else
-                {
-                    Bitmap = null;
-                    IsImageValid = false;
-                }
+                Bitmap = RenderBitmap(loaderParameters);
+                IsImageValid = Bitmap != null;
                 this.RaisePropertyChanged(nameof(HasImage));
                 StretchedHistogram = null;
                 StretchedHistogram = fitsImage.StretchedHistogram;
@@ -541,10 +555,54 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
             return Bitmap;
         }
 
+        private void CancelRender()
+        {
+            Interlocked.Increment(ref renderGeneration);
+            fitsImage.CancelProcessing();
+        }
+
+        // Renders the image straight into the buffer of a new bitmap
+        private Bitmap? RenderBitmap(FitsImageLoaderParameters loaderParameters)
+        {
+            var dim = fitsImage.OutDim;
+            if (dim.Width <= 0 || dim.Height <= 0)
+            {
+                return null;
+            }
+
+            var bitmap = new WriteableBitmap(new Avalonia.PixelSize(dim.Width, dim.Height), new Avalonia.Vector(96, 96), Avalonia.Platform.PixelFormat.Bgra8888, Avalonia.Platform.AlphaFormat.Unpremul);
+
+            bool success;
+            using (var buffer = bitmap.Lock())
+            {
+                success = fitsImage.ProcessImageInto(false, loaderParameters, buffer.Address, (ulong)buffer.RowBytes * (ulong)buffer.Size.Height, (ulong)buffer.RowBytes);
+            }
+
+            if (!success || !fitsImage.IsImageValid)
+            {
+                bitmap.Dispose();
+                return null;
+            }
+
+            return bitmap;
+        }
+
+        private Bitmap? CreatePreviewBitmap(FitsImageLoaderParameters loaderParameters)
+        {
+            if (fitsImage.ProcessImagePreview(PreviewSize, loaderParameters, out var data, out var dim) && data is NativeFitsImageData nativeData)
+            {
+                return new Bitmap(Avalonia.Platform.PixelFormat.Bgra8888, Avalonia.Platform.AlphaFormat.Unpremul, nativeData.Ptr, new Avalonia.PixelSize(dim.Width, dim.Height), new Avalonia.Vector(96, 96), dim.Width * 4);
+            }
+            return null;
+        }
+
         public async Task<Bitmap?> UpdateOrCreateBitmapAsync(bool disposeBeforeSwap = true, CancellationToken ct = default)
         {
             ct.ThrowIfCancellationRequested();
             IsUpdating = true;
+            int generation = Volatile.Read(ref renderGeneration);
+            int update = Interlocked.Increment(ref updateGeneration);
+            using var cancelRegistration = ct.Register(fitsImage.CancelProcessing);
             try
             {
                 var oldBitmap = Bitmap;
@@ -559,21 +617,42 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
                 }
                 FitsImageLoaderParameters loaderParameters = this.loaderParameters;
                 loaderParameters.stretchParameters = GetStretchParameters();
+                if (!disposeBeforeSwap && oldBitmap != null)
+                {
+                    // Show a quickly rendered low resolution image until
+                    // the full resolution image is done
+                    var previewBitmap = await Task.Run(() => CreatePreviewBitmap(loaderParameters));
+                    if (update == Volatile.Read(ref updateGeneration))
+                    {
+                        var oldPreviewBitmap = PreviewBitmap;
+                        PreviewBitmap = previewBitmap;
+                        oldPreviewBitmap?.Dispose();
+                    }
+                    else
+                    {
+                        // Superseded by a newer update before it was shown
+                        previewBitmap?.Dispose();
+                    }
+                }
                 var task = Task.Run(() =>
                 {
                     ct.ThrowIfCancellationRequested();
-                    if (fitsImage.ProcessImage(false, loaderParameters, out var data))
+                    var bitmap = RenderBitmap(loaderParameters);
+                    if (ct.IsCancellationRequested)
                     {
+                        bitmap?.Dispose();
                         ct.ThrowIfCancellationRequested();
-                        if (data is NativeFitsImageData nativeData && fitsImage.IsImageValid)
-                        {
-                            return new Bitmap(Avalonia.Platform.PixelFormat.Bgra8888, Avalonia.Platform.AlphaFormat.Unpremul, nativeData.Ptr, new Avalonia.PixelSize(fitsImage.OutDim.Width, fitsImage.OutDim.Height), new Avalonia.Vector(96, 96), fitsImage.OutDim.Width * 4);
-                        }
                     }
-                    ct.ThrowIfCancellationRequested();
-                    return null;
+                    return bitmap;
                 });
-                Bitmap = await task;
+                var bitmap = await task;
+                if ((bitmap == null && !disposeBeforeSwap && generation != Volatile.Read(ref renderGeneration)) || update != Volatile.Read(ref updateGeneration))
+                {
+                    // Superseded by a newer render, which replaces the current bitmap
+                    bitmap?.Dispose();
+                    return Bitmap;
+                }
+                Bitmap = bitmap;
                 IsImageValid = fitsImage.IsImageValid && Bitmap != null;
                 this.RaisePropertyChanged(nameof(HasImage));
                 StretchedHistogram = null;
@@ -585,7 +664,15 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
             }
             finally
             {
-                IsUpdating = false;
+                // A newer update owns the shown preview and the busy flag
+                // and may still be rendering, so they are left to it
+                if (update == Volatile.Read(ref updateGeneration))
+                {
+                    var previewBitmap = PreviewBitmap;
+                    PreviewBitmap = null;
+                    previewBitmap?.Dispose();
+                    IsUpdating = false;
+                }
             }
             return Bitmap;
         }
@@ -601,6 +688,10 @@ namespace FitsRatingTool.GuiApp.UI.FitsImage.ViewModels
             Bitmap = null;
             bitmap?.Dispose();
 
+            var previewBitmap = PreviewBitmap;
+            PreviewBitmap = null;
+            previewBitmap?.Dispose();
+
             fitsImageRef?.Dispose();
 
             StretchedHistogram = null;
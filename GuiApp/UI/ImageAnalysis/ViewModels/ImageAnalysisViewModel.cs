@@ -18,6 +18,7 @@
 
 using Avalonia.Utilities;
 using FitsRatingTool.Common.Models.FitsImage;
+using FitsRatingTool.FitsLoader.Models;
 using FitsRatingTool.GuiApp.Models;
 using FitsRatingTool.GuiApp.Services;
 using FitsRatingTool.GuiApp.UI.FitsImage;
@@ -25,6 +26,7 @@ using ReactiveUI;
 using System;
 using System.Collections.Generic;
 using System.IO;
+using System.Linq;
 using System.Reactive;
 using System.Reactive.Linq;
 using System.Threading.Tasks;
@@ -325,6 +327,12 @@ namespace FitsRatingTool.GuiApp.UI.ImageAnalysis.ViewModels
 
             if (metadata != null && photometry != null && IsValidDataKeyIndex(DataKeyIndex))
             {
+                // Stars outside of the PSF subsample have no PSF measurements
+                if (DataKeyIndex != 0)
+                {
+                    photometry = photometry.Where(p => p.PSF.Method != PhotometryPSFMethod.Unsampled);
+                }
+
                 UpdateData(DataKeyIndex, metadata, new List<IFitsImagePhotometryViewModel>(photometry));
             }
             else
@@ -0,0 +1,470 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Fits synthetic Moffat stars with lmder through the scalar and the AVX residuals
+// of moffat.h and through a std::pow reference, and compares the fitted parameters
+// with each other and with the truth. Exits with 1 if the scalar and AVX fits are
+// not identical or if either drifts from the reference.
+
+#include <cstdio>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <cminpack.h>
+
+#include "moffat.h"
+
+using namespace Photometry;
+
+namespace
+{
+
+	enum class ResidualPath
+	{
+		Reference,
+		Scalar,
+		AVX
+	};
+
+	char const* const path_names[] = { "std::pow", "scalar", "AVX" };
+
+	int const stars_per_beta = 200;
+	double const tolerance = 1.0e-08;
+
+	// Largest relative FWHM difference from the reference that is still accepted
+	double const reference_fwhm_tolerance = 1.0e-06;
+
+	struct Star
+	{
+		std::vector<double> data;
+		int w = 0, h = 0;
+		double truth[MoffatParameters::count]{};
+		double initial[MoffatParameters::count]{};
+	};
+
+	struct Fit
+	{
+		double parameters[MoffatParameters::count]{};
+		bool converged = false;
+	};
+
+	double ReferenceProfile(double d, double beta)
+	{
+		return std::pow(d, -beta);
+	}
+
+	// Same as Extractor::FitMoffat, except for the choice of residuals
+	template<int beta_x2, ResidualPath path>
+	int FitMoffat(void* p, int m, int n, const double* parameters, double* fvec, double* fjac, int ldfjac, int iflag)
+	{
+		if (MoffatParameters::_S0(parameters) < 0 || MoffatParameters::_S1(parameters) < 0)
+		{
+			if (iflag == 1)
+			{
+				std::fill_n(fvec, m, std::numeric_limits<double>::max());
+			}
+			else
+			{
+				for (int j = 0; j < n; ++j)
+				{
+					std::fill_n(fjac + j * ldfjac, m, 0.0);
+				}
+			}
+			return 0;
+		}
+
+		Star const* star = reinterpret_cast<Star const*>(p);
+
+		double S0 = MoffatParameters::_S0(parameters);
+		double S1 = MoffatParameters::_S1(parameters);
+
+		double x0 = (star->w >> 1) + MoffatParameters::_x0(parameters);
+		double y0 = (star->h >> 1) + MoffatParameters::_y0(parameters);
+
+		double alpha_x = MoffatParameters::_alpha_x(parameters);
+		double alpha_y = MoffatParameters::_alpha_y(parameters);
+
+		double s = std::sin(MoffatParameters::_theta(parameters));
+		double c = std::cos(MoffatParameters::_theta(parameters));
+
+		double sx = s / alpha_x;
+		double cx = c / alpha_x;
+		double sy = s / alpha_y;
+		double cy = c / alpha_y;
+
+		double ix2 = 1.0 / (alpha_x * alpha_x);
+		double iy2 = 1.0 / (alpha_y * alpha_y);
+
+		double A = cx * cx + sy * sy;
+		double B = sx * sx + cy * cy;
+		double C = 2 * s * c * (ix2 - iy2);
+
+		double beta = beta_x2 * 0.5;
+
+		const double* data_ptr = star->data.data();
+
+		if (iflag == 1)
+		{
+			MoffatShape const shape{ S0, S1, x0, A, B, C };
+			for (int y = 0; y < star->h; ++y)
+			{
+				double const* row = data_ptr + y * star->w;
+				double* residuals = fvec + y * star->w;
+
+				switch (path)
+				{
+				case ResidualPath::Reference:
+				{
+					double dy = y - y0;
+					for (int x = 0; x < star->w; ++x)
+					{
+						double dx = x - x0;
+						residuals[x] = row[x] - S0 - S1 * ReferenceProfile(1.0 + A * dx * dx + B * dy * dy + C * dx * dy, beta);
+					}
+					break;
+				}
+#ifdef PHOTOMETRY_AVX
+				case ResidualPath::AVX:
+					ComputeMoffatResidualsAVX<beta_x2>(row, star->w, y - y0, shape, residuals);
+					break;
+#endif
+				default:
+					ComputeMoffatResidualsScalar<beta_x2>(row, star->w, 0, y - y0, shape, residuals);
+					break;
+				}
+			}
+			return 0;
+		}
+
+		double dax = -2.0 * ix2 / alpha_x;
+		double day = -2.0 * iy2 / alpha_y;
+		double dtheta = 2.0 * (ix2 - iy2);
+
+		double* jac_S0 = fjac;
+		double* jac_S1 = fjac + ldfjac;
+		double* jac_x0 = fjac + 2 * ldfjac;
+		double* jac_y0 = fjac + 3 * ldfjac;
+		double* jac_alpha_x = fjac + 4 * ldfjac;
+		double* jac_alpha_y = fjac + 5 * ldfjac;
+		double* jac_theta = fjac + 6 * ldfjac;
+
+		int i = 0;
+		for (int y = 0; y < star->h; ++y)
+		{
+			double dy = y - y0;
+
+			for (int x = 0; x < star->w; ++x, ++i)
+			{
+				double dx = x - x0;
+				double d = 1.0 + A * dx * dx + B * dy * dy + C * dx * dy;
+				double z = path == ResidualPath::Reference ? ReferenceProfile(d, beta) : MoffatProfile<beta_x2>(d);
+
+				double g = beta * S1 * z / d;
+
+				double u = c * dx + s * dy;
+				double v = s * dx - c * dy;
+
+				jac_S0[i] = -1.0;
+				jac_S1[i] = -z;
+				jac_x0[i] = -g * (2.0 * A * dx + C * dy);
+				jac_y0[i] = -g * (2.0 * B * dy + C * dx);
+				jac_alpha_x[i] = g * dax * u * u;
+				jac_alpha_y[i] = g * day * v * v;
+				jac_theta[i] = g * dtheta * (s * c * (dy * dy - dx * dx) + (c * c - s * s) * dx * dy);
+			}
+		}
+
+		return 0;
+	}
+
+	// Elliptical Moffat stars with background, random widths, angles and
+	// sub-pixel offsets and Gaussian noise, rendered with the reference profile
+	std::vector<Star> GenerateStars(int beta_x2, int count, std::mt19937& rng)
+	{
+		std::uniform_real_distribution<double> uniform(0.0, 1.0);
+		std::normal_distribution<double> noise(0.0, 3.0);
+
+		double beta = beta_x2 * 0.5;
+
+		std::vector<Star> stars(count);
+		for (Star& star : stars)
+		{
+			star.w = 15 + static_cast<int>(rng() % 8);
+			star.h = 15 + static_cast<int>(rng() % 8);
+
+			double alpha_x = 2.0 + 2.0 * uniform(rng);
+			double alpha_y = alpha_x * (0.7 + 0.3 * uniform(rng));
+
+			double* truth = star.truth;
+			truth[0] = 100.0 + 50.0 * uniform(rng);
+			truth[1] = 500.0 + 2000.0 * uniform(rng);
+			truth[2] = uniform(rng) - 0.5;
+			truth[3] = uniform(rng) - 0.5;
+			truth[4] = alpha_x;
+			truth[5] = alpha_y;
+			truth[6] = 3.0 * uniform(rng);
+
+			double s = std::sin(truth[6]);
+			double c = std::cos(truth[6]);
+			double ix2 = 1.0 / (alpha_x * alpha_x);
+			double iy2 = 1.0 / (alpha_y * alpha_y);
+			double A = c * c * ix2 + s * s * iy2;
+			double B = s * s * ix2 + c * c * iy2;
+			double C = 2 * s * c * (ix2 - iy2);
+
+			double x0 = (star.w >> 1) + truth[2];
+			double y0 = (star.h >> 1) + truth[3];
+
+			star.data.resize(static_cast<size_t>(star.w) * star.h);
+			double peak = -std::numeric_limits<double>::infinity();
+			for (int y = 0; y < star.h; ++y)
+			{
+				for (int x = 0; x < star.w; ++x)
+				{
+					double dx = x - x0;
+					double dy = y - y0;
+					double value = truth[0] + truth[1] * ReferenceProfile(1.0 + A * dx * dx + B * dy * dy + C * dx * dy, beta) + noise(rng);
+					star.data[y * star.w + x] = value;
+					peak = std::max(peak, value);
+				}
+			}
+
+			// Rough initial estimate like the one from the crop moments
+			double size = 0.15 * 0.5 * (star.w + star.h);
+			star.initial[0] = truth[0] + 5.0;
+			star.initial[1] = peak - truth[0];
+			star.initial[2] = truth[2] + 0.3;
+			star.initial[3] = truth[3] - 0.2;
+			star.initial[4] = size;
+			star.initial[5] = size;
+			star.initial[6] = 0.0;
+		}
+		return stars;
+	}
+
+	template<int beta_x2, ResidualPath path>
+	std::vector<Fit> FitStars(std::vector<Star>& stars, double* milliseconds)
+	{
+		std::vector<Fit> fits(stars.size());
+
+		auto start = std::chrono::steady_clock::now();
+		for (size_t k = 0; k < stars.size(); ++k)
+		{
+			Star& star = stars[k];
+			Fit& fit = fits[k];
+
+			int const m = star.w * star.h;
+			int const n = MoffatParameters::count;
+
+			std::copy_n(star.initial, n, fit.parameters);
+
+			std::vector<double> fvec(m);
+			std::vector<double> fjac(static_cast<size_t>(m) * n);
+			std::vector<int> iwa(n);
+			std::vector<double> wa(5 * n + m);
+
+			int status = lmder1(FitMoffat<beta_x2, path>, &star, m, n, fit.parameters, &fvec[0], &fjac[0], m, tolerance, &iwa[0], &wa[0], static_cast<int>(wa.size()));
+			fit.converged = status == 1 || status == 2 || status == 3;
+		}
+		*milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+		return fits;
+	}
+
+	// Major axis FWHM, so that fits with swapped axes compare equal
+	double MajorFWHM(double const* parameters, double beta)
+	{
+		double alpha = std::max(std::abs(parameters[4]), std::abs(parameters[5]));
+		return MoffatParameters::FWHM(alpha, beta);
+	}
+
+	// Largest absolute difference of the residuals at the true parameters, relative to the amplitude
+	template<int beta_x2>
+	double CompareResiduals(std::vector<Star>& stars, ResidualPath a, ResidualPath b)
+	{
+		double worst = 0.0;
+		for (Star& star : stars)
+		{
+			int const m = star.w * star.h;
+			std::vector<double> ra(m), rb(m);
+
+			auto evaluate = [&](ResidualPath path, double* residuals)
+			{
+				switch (path)
+				{
+				case ResidualPath::Reference:
+					FitMoffat<beta_x2, ResidualPath::Reference>(&star, m, MoffatParameters::count, star.truth, residuals, nullptr, m, 1);
+					break;
+				case ResidualPath::AVX:
+					FitMoffat<beta_x2, ResidualPath::AVX>(&star, m, MoffatParameters::count, star.truth, residuals, nullptr, m, 1);
+					break;
+				default:
+					FitMoffat<beta_x2, ResidualPath::Scalar>(&star, m, MoffatParameters::count, star.truth, residuals, nullptr, m, 1);
+					break;
+				}
+			};
+
+			evaluate(a, ra.data());
+			evaluate(b, rb.data());
+
+			for (int i = 0; i < m; ++i)
+			{
+				worst = std::max(worst, std::abs(ra[i] - rb[i]) / star.truth[1]);
+			}
+		}
+		return worst;
+	}
+
+	struct Comparison
+	{
+		int mismatched = 0;
+		double worst_fwhm = 0.0;
+		double worst_center = 0.0;
+	};
+
+	Comparison CompareFits(std::vector<Fit> const& a, std::vector<Fit> const& b, double beta)
+	{
+		Comparison comparison;
+		for (size_t k = 0; k < a.size(); ++k)
+		{
+			if (a[k].converged != b[k].converged)
+			{
+				++comparison.mismatched;
+				continue;
+			}
+			if (!a[k].converged)
+			{
+				continue;
+			}
+
+			double fwhm_a = MajorFWHM(a[k].parameters, beta);
+			double fwhm_b = MajorFWHM(b[k].parameters, beta);
+			comparison.worst_fwhm = std::max(comparison.worst_fwhm, std::abs(fwhm_a - fwhm_b) / fwhm_b);
+			comparison.worst_center = std::max(comparison.worst_center, std::max(std::abs(a[k].parameters[2] - b[k].parameters[2]), std::abs(a[k].parameters[3] - b[k].parameters[3])));
+		}
+		return comparison;
+	}
+
+	bool Identical(std::vector<Fit> const& a, std::vector<Fit> const& b)
+	{
+		for (size_t k = 0; k < a.size(); ++k)
+		{
+			if (a[k].converged != b[k].converged || !std::equal(a[k].parameters, a[k].parameters + MoffatParameters::count, b[k].parameters))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	template<int beta_x2>
+	bool Compare(std::mt19937& rng, bool avx)
+	{
+		double const beta = beta_x2 * 0.5;
+
+		std::vector<Star> stars = GenerateStars(beta_x2, stars_per_beta, rng);
+
+		double time[3]{};
+		std::vector<Fit> fits[3];
+		fits[0] = FitStars<beta_x2, ResidualPath::Reference>(stars, &time[0]);
+		fits[1] = FitStars<beta_x2, ResidualPath::Scalar>(stars, &time[1]);
+		if (avx)
+		{
+			fits[2] = FitStars<beta_x2, ResidualPath::AVX>(stars, &time[2]);
+		}
+
+		int const paths = avx ? 3 : 2;
+
+		std::printf("beta %.1f\n", beta);
+
+		for (int p = 0; p < paths; ++p)
+		{
+			int converged = 0;
+			double worst_fwhm = 0.0;
+			for (size_t k = 0; k < stars.size(); ++k)
+			{
+				if (!fits[p][k].converged)
+				{
+					continue;
+				}
+				++converged;
+				double truth = MajorFWHM(stars[k].truth, beta);
+				worst_fwhm = std::max(worst_fwhm, std::abs(MajorFWHM(fits[p][k].parameters, beta) - truth) / truth);
+			}
+			std::printf("  %-8s  %8.2f ms  converged %d/%d  worst FWHM error vs truth %.2e\n", path_names[p], time[p], converged, static_cast<int>(stars.size()), worst_fwhm);
+		}
+
+		bool passed = true;
+
+		double residuals = CompareResiduals<beta_x2>(stars, ResidualPath::Scalar, ResidualPath::Reference);
+		Comparison reference = CompareFits(fits[1], fits[0], beta);
+		std::printf("  scalar vs std::pow: residuals %.2e, FWHM %.2e, center %.2e, convergence mismatches %d\n", residuals, reference.worst_fwhm, reference.worst_center, reference.mismatched);
+		if (reference.mismatched > 0 || reference.worst_fwhm > reference_fwhm_tolerance)
+		{
+			passed = false;
+		}
+
+		if (avx)
+		{
+			residuals = CompareResiduals<beta_x2>(stars, ResidualPath::AVX, ResidualPath::Scalar);
+			bool identical = Identical(fits[2], fits[1]);
+			std::printf("  AVX vs scalar: residuals %.2e, fits %s\n", residuals, identical ? "identical" : "differ");
+			if (residuals != 0.0 || !identical)
+			{
+				passed = false;
+			}
+		}
+
+		return passed;
+	}
+
+	template<int... beta_x2>
+	bool CompareAll(std::mt19937& rng, bool avx, std::integer_sequence<int, beta_x2...>)
+	{
+		bool results[] = { Compare<beta_x2>(rng, avx)... };
+		return std::all_of(std::begin(results), std::end(results), [](bool passed) { return passed; });
+	}
+
+}
+
+int main()
+{
+#ifdef PHOTOMETRY_AVX
+	bool const avx = IsAVXSupported();
+#else
+	bool const avx = false;
+#endif
+	if (!avx)
+	{
+		std::printf("AVX is not available, only comparing the scalar residuals with std::pow\n");
+	}
+
+	// Fixed seed so that every run fits the same stars
+	std::mt19937 rng(20221);
+
+	// The beta values that Extractor instantiates
+	bool passed = CompareAll(rng, avx, std::integer_sequence<int, 3, 4, 5, 6, 7, 8, 9, 10>());
+
+	std::printf(passed ? "PASSED\n" : "FAILED\n");
+	return passed ? 0 : 1;
+}
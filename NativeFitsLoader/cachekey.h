@@ -0,0 +1,69 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "fitsloader.h"
+
+namespace Cache
+{
+
+	// 64-bit FNV-1a
+	class KeyHash
+	{
+	public:
+		void Add(void const* data, size_t size)
+		{
+			unsigned char const* bytes = static_cast<unsigned char const*>(data);
+			for (size_t i = 0; i < size; ++i)
+			{
+				m_hash = (m_hash ^ bytes[i]) * 0x100000001b3ull;
+			}
+		}
+
+		template<typename T>
+		void Add(T const& value)
+		{
+			Add(&value, sizeof(T));
+		}
+
+		// the fields are hashed one by one, padding bytes may be garbage
+		void Add(Loader::FITSImageLoaderParameters const& props)
+		{
+			Add(props.mono_color_outline);
+			Add(props.saturation);
+			for (int c = 0; c < 3; ++c)
+			{
+				Processing::ChannelStretchParameters const& params = props.stretch_params[c];
+				Add(params.max_input);
+				Add(params.shadows);
+				Add(params.highlights);
+				Add(params.midtones);
+			}
+		}
+
+		uint64_t value() const { return m_hash; }
+
+	private:
+		uint64_t m_hash = 0xcbf29ce484222325ull;
+	};
+
+}
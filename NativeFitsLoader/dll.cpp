@@ -18,10 +18,17 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+#include <cstring>
 
 #include "fitsloader.h"
+#include "fitsimagedata.h"
 #include "stretch.h"
+#include "groupstretch.h"
 #include "photometry.h"
+#include "previewcache.h"
+#include "framecache.h"
+#include "cachekey.h"
 
 struct FITSHandle
 {
@@ -39,7 +46,7 @@ struct FITSHandle
 struct FITSImageDataHandle
 {
 	bool valid;
-	std::valarray<float>** image_ptr;
+	Loader::FITSImageData** image_ptr;
 	Loader::FITSImageLoaderParameters parameters;
 };
 
@@ -57,6 +64,9 @@ struct FITSStatisticsHandle
 	Photometry::Statistics statistics;
 };
 
+// Rendered frames of all images, e.g. for blinking through a group
+static Cache::FrameCache frame_cache;
+
 extern "C"
 {
 	__declspec(dllexport) FITSHandle LoadFit(const char* file_cstr, uint64_t max_input_size, uint32_t max_input_width, uint32_t max_input_height)
@@ -124,6 +134,18 @@ extern "C"
 		return handle.info->ReadImage(data, props);
 	}
 
+	// Whether data_size bytes hold a BGRA image of dim whose rows are row_pitch
+	// bytes apart. A row_pitch of 0 is replaced by the size of a row.
+	bool IsOutputLargeEnough(Loader::FITSImageDim const& dim, size_t data_size, size_t* row_pitch)
+	{
+		size_t const row_size = static_cast<size_t>(dim.nx) * 4;
+		if (*row_pitch == 0)
+		{
+			*row_pitch = row_size;
+		}
+		return *row_pitch >= row_size && (dim.ny == 0 || data_size >= *row_pitch * (dim.ny - 1) + row_size);
+	}
+
 	bool LoadImageDataForHandle(FITSHandle fits_handle, FITSImageDataHandle* data_handle, uint32_t* histogram, size_t histogram_size)
 	{
 		if (fits_handle.info && data_handle->image_ptr)
@@ -133,17 +155,24 @@ extern "C"
 				return false;
 			}
 
-			if (*data_handle->image_ptr)
+			// reuse already loaded image data and its
+			// buffers instead of allocating them again
+			if (!*data_handle->image_ptr)
 			{
-				delete* data_handle->image_ptr;
-				*data_handle->image_ptr = nullptr;
+				*data_handle->image_ptr = new Loader::FITSImageData();
 			}
 
-			*data_handle->image_ptr = new std::valarray<float>(fits_handle.info->attributes().data.out_dim.n);
+			Loader::FITSImageData* image = *data_handle->image_ptr;
+
+			image->ResetPreview();
+
+			// keep 8/16-bit sources in uint16_t instead of widening to float
+			image->type = Loader::GetFITSPixelType(fits_handle.info->attributes().data.in_memory_datatype);
+			image->resize(fits_handle.info->attributes().data.out_dim.n);
 
-			bool success = fits_handle.info->ReadImageUnprocessed<float>(**data_handle->image_ptr, data_handle->parameters, histogram, histogram_size);
+			bool success = image->Visit([&](auto& data) { return fits_handle.info->ReadImageUnprocessed(data, data_handle->parameters, histogram, histogram_size, &image->statistics); });
 
-			if (!success || (*data_handle->image_ptr)->size() == 0)
+			if (!success || image->size() == 0)
 			{
 				delete* data_handle->image_ptr;
 				*data_handle->image_ptr = nullptr;
@@ -160,7 +189,7 @@ extern "C"
 		FITSImageDataHandle data_handle{ false, nullptr, props };
 		if (fits_handle.info)
 		{
-			data_handle.image_ptr = new std::valarray<float>*;
+			data_handle.image_ptr = new Loader::FITSImageData*;
 			*data_handle.image_ptr = nullptr;
 
 			data_handle.valid = LoadImageDataForHandle(fits_handle, &data_handle, histogram, histogram_size);
@@ -174,6 +203,23 @@ extern "C"
 		return data_handle;
 	}
 
+	__declspec(dllexport) FITSImageDataHandle ReloadImageData(FITSHandle fits_handle, FITSImageDataHandle data_handle, Loader::FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size)
+	{
+		// The image data only depends on the file, so frames rendered from it stay
+		// valid. Those of other parameters are of no more use once they change.
+		Cache::KeyHash old_params, new_params;
+		old_params.Add(data_handle.parameters);
+		new_params.Add(props);
+		if (old_params.value() != new_params.value())
+		{
+			frame_cache.Invalidate(data_handle.image_ptr);
+		}
+
+		data_handle.parameters = props;
+		data_handle.valid = LoadImageDataForHandle(fits_handle, &data_handle, histogram, histogram_size);
+		return data_handle;
+	}
+
 	__declspec(dllexport) bool UnloadImageData(FITSImageDataHandle handle)
 	{
 		if (handle.image_ptr && *handle.image_ptr)
@@ -194,6 +240,8 @@ extern "C"
 	{
 		if (handle.image_ptr)
 		{
+			frame_cache.Invalidate(handle.image_ptr);
+
 			if (*handle.image_ptr)
 			{
 				delete* handle.image_ptr;
@@ -203,7 +251,7 @@ extern "C"
 		}
 	}
 
-	__declspec(dllexport) FITSStatisticsHandle ComputeStatistics(FITSHandle fits_handle, FITSImageDataHandle data_handle, Photometry::Callback callback)
+	__declspec(dllexport) FITSStatisticsHandle ComputeStatistics(FITSHandle fits_handle, FITSImageDataHandle data_handle, Photometry::PSFParameters psf_params, Photometry::Callback callback)
 	{
 		FITSStatisticsHandle handle{ false, nullptr, 0, { } };
 
@@ -225,9 +273,17 @@ extern "C"
 		Photometry::Catalog* catalog;
 
 		Photometry::Parameters params{};
+		params.psf_fast = psf_params.fast;
+		params.psf_fast_outlier_sigma = psf_params.fast_outlier_sigma;
+		params.psf_subsample = psf_params.subsample;
+		params.psf_subsample_grid = psf_params.subsample_grid;
+		params.psf_subsample_min_stars = psf_params.subsample_min_stars;
+		params.psf_subsample_step = psf_params.subsample_step;
+		params.psf_subsample_tolerance = psf_params.subsample_tolerance;
 		Photometry::Extractor extractor{ params };
 		int status = 0;
-		if (!extractor.Extract(*fits_handle.info, **data_handle.image_ptr, &catalog, &status, callback))
+		Loader::FITSImageData* image_data = *data_handle.image_ptr;
+		if (!image_data->Visit([&](auto& image) { return extractor.Extract(*fits_handle.info, image, &image_data->statistics, &catalog, &status, callback); }))
 		{
 			char err_msg[61];
 			err_msg[0] = '\0';
@@ -288,34 +344,265 @@ extern "C"
 			return params;
 		}
 
-		Processing::ComputeImageStretch<float>(**data_handle.image_ptr, fits_handle.info->attributes().data.out_dim, &params);
+		Loader::FITSImageData* image = *data_handle.image_ptr;
+		image->Visit([&](auto& image_data) { Processing::ComputeImageStretch(image_data, fits_handle.info->attributes().data.out_dim, &params, &image->statistics); });
 
 		return params;
 	}
 
-	__declspec(dllexport) FITSImageHandle ProcessImage(FITSHandle fits_handle, FITSImageDataHandle data_handle, FITSImageHandle image_handle, bool compute_stretch_params, Loader::FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size)
+	// Computes one set of stretch parameters for all num_handles images from
+	// their merged histograms. Images whose data is not loaded are loaded one
+	// at a time and unloaded again as soon as their histograms are merged.
+	__declspec(dllexport) Processing::ImageStretchParameters ComputeGroupStretch(FITSHandle* fits_handles, FITSImageDataHandle* data_handles, size_t num_handles)
 	{
-		if (!fits_handle.info)
+		Processing::ImageStretchParameters params;
+
+		Processing::GroupStretchAccumulator accumulator;
+		for (size_t i = 0; i < num_handles; ++i)
 		{
-			return image_handle;
+			FITSHandle& fits_handle = fits_handles[i];
+			FITSImageDataHandle& data_handle = data_handles[i];
+
+			if (!fits_handle.info || !data_handle.image_ptr)
+			{
+				continue;
+			}
+
+			bool const loaded = *data_handle.image_ptr != nullptr;
+			if (!loaded && !LoadImageDataForHandle(fits_handle, &data_handle, nullptr, 0))
+			{
+				continue;
+			}
+
+			accumulator.Add(**data_handle.image_ptr, fits_handle.info->attributes().data.out_dim);
+
+			if (!loaded)
+			{
+				UnloadImageData(data_handle);
+			}
+		}
+
+		accumulator.Compute(&params);
+
+		return params;
+	}
+
+	// Rows of data are row_pitch bytes apart, 0 for rows without padding.
+	// cancel is optional, setting it to non-zero while the image is
+	// processed makes this return false with incomplete output
+	__declspec(dllexport) bool ProcessImageInto(FITSHandle fits_handle, FITSImageDataHandle data_handle, unsigned char* data, size_t data_size, size_t row_pitch, bool compute_stretch_params, Loader::FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, Processing::CancellationFlag cancel)
+	{
+		if (!fits_handle.info || !data)
+		{
+			return false;
+		}
+
+		if (!IsOutputLargeEnough(fits_handle.info->attributes().data.out_dim, data_size, &row_pitch))
+		{
+			return false;
 		}
 
 		if (data_handle.image_ptr && !*data_handle.image_ptr && !LoadImageDataForHandle(fits_handle, &data_handle, nullptr, 0))
 		{
-			return image_handle;
+			return false;
+		}
+
+		if (!data_handle.image_ptr || !*data_handle.image_ptr)
+		{
+			return false;
+		}
+
+		Loader::FITSImageData* image = *data_handle.image_ptr;
+		return image->Visit([&](auto& image_data) { return fits_handle.info->ProcessImage(image_data, data, row_pitch, compute_stretch_params, props, histogram, histogram_size, &image->statistics, cancel); });
+	}
+
+	// Gets the frame rendered with props from the frame cache, or renders it and
+	// adds it to the cache. Frames stay cached while the image data is unloaded
+	// and are dropped when it is reloaded with other parameters or freed.
+	bool GetCachedFrame(FITSHandle fits_handle, FITSImageDataHandle data_handle, Loader::FITSImageLoaderParameters const& props, std::shared_ptr<Cache::Frame const>* frame)
+	{
+		if (!fits_handle.info || !data_handle.image_ptr)
+		{
+			return false;
+		}
+
+		Cache::KeyHash hash;
+		hash.Add(props);
+		uint64_t const params = hash.value();
+
+		*frame = frame_cache.Get(data_handle.image_ptr, params);
+		if (*frame)
+		{
+			return true;
+		}
+
+		Loader::FITSImageDim const& out_dim = fits_handle.info->attributes().data.out_dim;
+
+		auto rendered = std::make_shared<Cache::Frame>();
+		rendered->dim = out_dim;
+		rendered->pixels.resize(static_cast<size_t>(out_dim.nx) * out_dim.ny * 4);
+
+		if (!ProcessImageInto(fits_handle, data_handle, rendered->pixels.data(), rendered->pixels.size(), 0, false, props, nullptr, 0, nullptr))
+		{
+			return false;
+		}
+
+		frame_cache.Put(data_handle.image_ptr, params, rendered);
+		*frame = std::move(rendered);
+
+		return true;
+	}
+
+	// Maximum number of bytes of rendered frames that are kept in memory,
+	// 0 disables the frame cache
+	__declspec(dllexport) void SetFrameCacheBudget(uint64_t budget)
+	{
+		frame_cache.SetBudget(static_cast<size_t>(budget));
+	}
+
+	__declspec(dllexport) void ClearFrameCache()
+	{
+		frame_cache.Clear();
+	}
+
+	// Renders the image with the stretch in props into the frame cache ahead of
+	// time, e.g. the next few frames of a blink sequence on a background thread.
+	// Does nothing if the frame is already cached.
+	__declspec(dllexport) bool PrefetchFrame(FITSHandle fits_handle, FITSImageDataHandle data_handle, Loader::FITSImageLoaderParameters props)
+	{
+		std::shared_ptr<Cache::Frame const> frame;
+		return GetCachedFrame(fits_handle, data_handle, props, &frame);
+	}
+
+	// Same as ProcessImageInto with fixed stretch parameters, but the frame is
+	// copied from the frame cache if it has been rendered before
+	__declspec(dllexport) bool ProcessCachedImageInto(FITSHandle fits_handle, FITSImageDataHandle data_handle, unsigned char* data, size_t data_size, size_t row_pitch, Loader::FITSImageLoaderParameters props)
+	{
+		if (!fits_handle.info || !data)
+		{
+			return false;
 		}
 
+		if (!IsOutputLargeEnough(fits_handle.info->attributes().data.out_dim, data_size, &row_pitch))
+		{
+			return false;
+		}
+
+		std::shared_ptr<Cache::Frame const> frame;
+		if (!GetCachedFrame(fits_handle, data_handle, props, &frame))
+		{
+			return false;
+		}
+
+		size_t const row_size = static_cast<size_t>(frame->dim.nx) * 4;
+		for (int y = 0; y < frame->dim.ny; ++y)
+		{
+			memcpy(data + y * row_pitch, frame->pixels.data() + y * row_size, row_size);
+		}
+
+		return true;
+	}
+
+	// Renders a shrunk copy of the loaded image that fits into max_size with the
+	// stretch in props. The copy is kept with the image data so that repeated
+	// calls, e.g. while stretch parameters are changed, only stretch the small
+	// copy. The preview dimensions are always written to preview_dim, so a call
+	// with no data can be used to size the buffer. Rows of data are row_pitch
+	// bytes apart, 0 for rows without padding.
+	__declspec(dllexport) bool ProcessImagePreviewInto(FITSHandle fits_handle, FITSImageDataHandle data_handle, unsigned char* data, size_t data_size, size_t row_pitch, int max_size, Loader::FITSImageLoaderParameters props, Loader::FITSImageDim* preview_dim)
+	{
+		if (!fits_handle.info || !preview_dim)
+		{
+			return false;
+		}
+
+		// previews are meant to be quick, so the image is not loaded here
 		if (!data_handle.image_ptr || !*data_handle.image_ptr)
+		{
+			return false;
+		}
+
+		Loader::FITSImageData* image = *data_handle.image_ptr;
+		Loader::FITSImageData& preview = image->GetPreview(fits_handle.info->attributes().data.out_dim, max_size, preview_dim);
+
+		if (!data || !IsOutputLargeEnough(*preview_dim, data_size, &row_pitch))
+		{
+			return false;
+		}
+
+		return preview.Visit([&](auto& preview_data) { return fits_handle.info->RenderImage(preview_data, *preview_dim, data, row_pitch, props); });
+	}
+
+	// Renders a thumbnail of at most max_size pixels per side straight from
+	// the file by reading only every k-th row and column, without loading the
+	// image. The thumbnail dimensions are always written to thumbnail_dim, so a
+	// call with no data can be used to size the buffer. Rows of data are
+	// row_pitch bytes apart, 0 for rows without padding.
+	__declspec(dllexport) bool ReadThumbnail(FITSHandle fits_handle, unsigned char* data, size_t data_size, size_t row_pitch, int max_size, Loader::FITSImageLoaderParameters props, Loader::FITSImageDim* thumbnail_dim)
+	{
+		if (!fits_handle.info || !thumbnail_dim)
+		{
+			return false;
+		}
+
+		*thumbnail_dim = fits_handle.info->GetThumbnailDim(max_size);
+
+		if (!data || !IsOutputLargeEnough(*thumbnail_dim, data_size, &row_pitch))
+		{
+			return false;
+		}
+
+		return fits_handle.info->ReadThumbnail(data, row_pitch, max_size, props);
+	}
+
+	// Stores an already stretched preview of a file and its histogram in the
+	// cache directory, keyed by the file's identity and the parameters it was
+	// rendered with. Rows of data are row_pitch bytes apart, 0 for rows without
+	// padding.
+	__declspec(dllexport) bool StorePreview(const char* cache_dir_cstr, const char* file_cstr, int max_size, Loader::FITSImageLoaderParameters props, unsigned char const* data, Loader::FITSImageDim dim, size_t row_pitch, uint32_t const* histogram, size_t histogram_size)
+	{
+		if (!cache_dir_cstr || !file_cstr)
+		{
+			return false;
+		}
+
+		return Cache::StorePreview(cache_dir_cstr, file_cstr, max_size, props, data, dim, row_pitch, histogram, histogram_size);
+	}
+
+	// Loads a preview stored by StorePreview, false if there is none or the
+	// file has changed since. The preview dimensions are written to preview_dim
+	// whenever there is an entry, so a call with no data can be used to size
+	// the buffer.
+	__declspec(dllexport) bool LoadPreview(const char* cache_dir_cstr, const char* file_cstr, int max_size, Loader::FITSImageLoaderParameters props, unsigned char* data, size_t data_size, size_t row_pitch, uint32_t* histogram, size_t histogram_size, Loader::FITSImageDim* preview_dim)
+	{
+		if (!cache_dir_cstr || !file_cstr)
+		{
+			return false;
+		}
+
+		return Cache::LoadPreview(cache_dir_cstr, file_cstr, max_size, props, data, data_size, row_pitch, histogram, histogram_size, preview_dim);
+	}
+
+	__declspec(dllexport) FITSImageHandle ProcessImage(FITSHandle fits_handle, FITSImageDataHandle data_handle, FITSImageHandle image_handle, bool compute_stretch_params, Loader::FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, Processing::CancellationFlag cancel)
+	{
+		if (!fits_handle.info)
 		{
 			return image_handle;
 		}
 
+		// the output buffer of a previous call is reused
+		bool allocated = false;
 		if (image_handle.data_ptr == nullptr)
 		{
 			image_handle.data_ptr = new unsigned char[fits_handle.info->attributes().data.out_dim.nx * fits_handle.info->attributes().data.out_dim.ny * 4];
+			allocated = true;
 		}
 
-		fits_handle.info->ProcessImage<float>(**data_handle.image_ptr, image_handle.data_ptr, compute_stretch_params, props, histogram, histogram_size);
+		if (!ProcessImageInto(fits_handle, data_handle, image_handle.data_ptr, static_cast<size_t>(fits_handle.info->attributes().data.out_dim.nx) * fits_handle.info->attributes().data.out_dim.ny * 4, 0, compute_stretch_params, props, histogram, histogram_size, cancel) && allocated)
+		{
+			delete[] image_handle.data_ptr;
+			image_handle.data_ptr = nullptr;
+		}
 
 		return image_handle;
 	}
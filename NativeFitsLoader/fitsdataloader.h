@@ -18,7 +18,12 @@
 
 #pragma once
 
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
 #include "fitsio.h"
+#include "imagestatistics.h"
 
 namespace Loader
 {
@@ -34,7 +39,8 @@ namespace Loader
 		// (1 + 2 * size) x (1 + 2 * size) row major matrix
 		float* weights = nullptr;
 
-		// offset to be added to each pixel
+		// offset that is added to each pixel once the input turns out
+		// to contain negative values, i.e. to be actually signed
 		T_OUT offset{};
 
 		// whether the input image is RGB
@@ -51,6 +57,9 @@ namespace Loader
 	{
 		bool* negative = nullptr;
 		T_OUT* out_data_ptr = nullptr;
+
+		// optional, accumulated while the output is written
+		ImageStatistics* statistics = nullptr;
 	};
 
 	template<typename T_IN, typename T_OUT>
@@ -91,6 +100,9 @@ namespace Loader
 
 		// current output y coordinate
 		int out_data_y = 0;
+
+		// whether a negative value was found and the offset is applied
+		bool negative = false;
 	};
 
 	template<typename T_IN, typename T_OUT>
@@ -133,6 +145,7 @@ namespace Loader
 				m_state.input_row_counter = 0;
 				m_state.input_plane_counter = 0;
 				m_state.out_data_y = 0;
+				m_state.negative = false;
 			}
 
 			T_OUT* out_data_ptr = m_output.out_data_ptr;
@@ -142,7 +155,7 @@ namespace Loader
 			int in_data_index = 1;
 
 			bool finished = false;
-			bool negative = false;
+			bool negative = m_state.negative;
 
 			int const num_planes = (m_kernel.rgb && !m_kernel.cfa) ? 3 : 1;
 
@@ -193,7 +206,11 @@ namespace Loader
 										vsum += m_kernel.weights[kernel_y * m_state.kernel_dim + kernel_x - kernel_start] * v;
 									}
 								}
-								out_data_ptr[m_state.out_data_y * m_state.output_width + out_x] = static_cast<T_OUT>(vsum + m_kernel.offset);
+								if (negative && !m_state.negative)
+								{
+									ApplyOffset(out_x);
+								}
+								Store(&out_data_ptr[m_state.out_data_y * m_state.output_width + out_x], m_state.input_plane_counter, vsum);
 							}
 						}
 						else
@@ -226,10 +243,14 @@ namespace Loader
 										bsum += tlw * cfa[8] + trw * cfa[9] + blw * cfa[10] + brw * cfa[11];
 									}
 								}
+								if (negative && !m_state.negative)
+								{
+									ApplyOffset(out_x);
+								}
 								int const pixels_per_channel = m_state.output_width * m_state.output_height;
-								out_data_ptr[m_state.out_data_y * m_state.output_width + out_x + 0 * pixels_per_channel] = static_cast<T_OUT>(rsum + m_kernel.offset);
-								out_data_ptr[m_state.out_data_y * m_state.output_width + out_x + 1 * pixels_per_channel] = static_cast<T_OUT>(gsum + m_kernel.offset);
-								out_data_ptr[m_state.out_data_y * m_state.output_width + out_x + 2 * pixels_per_channel] = static_cast<T_OUT>(bsum + m_kernel.offset);
+								Store(&out_data_ptr[m_state.out_data_y * m_state.output_width + out_x + 0 * pixels_per_channel], 0, rsum);
+								Store(&out_data_ptr[m_state.out_data_y * m_state.output_width + out_x + 1 * pixels_per_channel], 1, gsum);
+								Store(&out_data_ptr[m_state.out_data_y * m_state.output_width + out_x + 2 * pixels_per_channel], 2, bsum);
 							}
 						}
 
@@ -263,9 +284,11 @@ namespace Loader
 				}
 			}
 
-			if (m_output.negative)
+			// only set, never cleared, since negative
+			// values may be in any of the chunks
+			if (m_output.negative && m_state.negative)
 			{
-				*m_output.negative = negative;
+				*m_output.negative = true;
 			}
 
 			if (finished)
@@ -277,6 +300,86 @@ namespace Loader
 		}
 
 	private:
+		// Integer outputs are rounded and clamped to their range, since the
+		// kernel sum may be slightly off or outside of it from float error
+		static inline T_OUT ToOutput(float value, std::true_type)
+		{
+			float const rounded = std::floor(value + 0.5f);
+			if (!(rounded > 0.0f))
+			{
+				return 0;
+			}
+			if (rounded >= static_cast<float>(std::numeric_limits<T_OUT>::max()))
+			{
+				return std::numeric_limits<T_OUT>::max();
+			}
+			return static_cast<T_OUT>(rounded);
+		}
+
+		static inline T_OUT ToOutput(float value, std::false_type)
+		{
+			return static_cast<T_OUT>(value);
+		}
+
+		// Called at the first negative value, before the pixel at out_x of the
+		// current output row is stored. Adds the offset to all pixels stored so
+		// far, which were stored without it, and to their statistics. Input that
+		// is stored as signed but has no negative values, which is most likely
+		// unsigned data, never needs the offset and so never this pass.
+		void ApplyOffset(int out_x)
+		{
+			m_state.negative = true;
+
+			if (m_kernel.offset == T_OUT(0))
+			{
+				return;
+			}
+
+			T_OUT* const out_data_ptr = m_output.out_data_ptr;
+			size_t const pixels_per_channel = static_cast<size_t>(m_state.output_width) * m_state.output_height;
+
+			if (m_kernel.cfa)
+			{
+				// the channels are written row by row in parallel
+				size_t const stored = static_cast<size_t>(m_state.out_data_y) * m_state.output_width + out_x;
+				for (size_t c = 0; c < 3; ++c)
+				{
+					T_OUT* const channel_ptr = out_data_ptr + c * pixels_per_channel;
+					for (size_t i = 0; i < stored; ++i)
+					{
+						channel_ptr[i] = static_cast<T_OUT>(channel_ptr[i] + m_kernel.offset);
+					}
+				}
+			}
+			else
+			{
+				// the channels are written one after another
+				size_t const stored = static_cast<size_t>(m_state.out_data_y) * m_state.output_width + out_x;
+				for (size_t i = 0; i < stored; ++i)
+				{
+					out_data_ptr[i] = static_cast<T_OUT>(out_data_ptr[i] + m_kernel.offset);
+				}
+			}
+
+			if (m_output.statistics)
+			{
+				for (int c = 0; c < m_output.statistics->nc; ++c)
+				{
+					m_output.statistics->channels[c].Shift(static_cast<double>(m_kernel.offset));
+				}
+			}
+		}
+
+		inline void Store(T_OUT* out, int channel, float sum)
+		{
+			T_OUT const value = ToOutput(m_state.negative ? sum + m_kernel.offset : sum, std::integral_constant<bool, std::is_integral<T_OUT>::value>{});
+			*out = value;
+			if (m_output.statistics)
+			{
+				m_output.statistics->channels[channel].Add(value);
+			}
+		}
+
 		DataKernel<T_IN, T_OUT> m_kernel;
 		DataOutput<T_IN, T_OUT> m_output;
 		DataIteratorState<T_IN, T_OUT> m_state;
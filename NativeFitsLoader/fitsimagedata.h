@@ -0,0 +1,138 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <valarray>
+#include <memory>
+#include <cstdint>
+
+#include "fitsio.h"
+#include "fitsdatatype.h"
+#include "fitsattributes.h"
+#include "imagestatistics.h"
+#include "pyramid.h"
+
+namespace Loader
+{
+
+	enum class FITSPixelType
+	{
+		Float = 0,
+		UInt16 = 1
+	};
+
+	// Integer sources with up to 16 bits fit into uint16_t
+	// (signed data is shifted by the signed to unsigned offset),
+	// everything else is widened to float
+	inline FITSPixelType GetFITSPixelType(FITSDatatype const& datatype)
+	{
+		if (datatype.fits_datatype != TFLOAT && datatype.fits_datatype != TDOUBLE && datatype.fits_bit_depth <= 16)
+		{
+			return FITSPixelType::UInt16;
+		}
+		return FITSPixelType::Float;
+	}
+
+	struct FITSImageData
+	{
+		FITSPixelType type = FITSPixelType::Float;
+
+		// only the array matching type holds data
+		std::valarray<float> data_float;
+		std::valarray<uint16_t> data_uint16;
+
+		// collected while the data was decoded
+		ImageStatistics statistics;
+
+		// shrunk copy for quick previews, see GetPreview
+		std::unique_ptr<FITSImageData> preview;
+		int preview_factor = 0;
+		FITSImageDim preview_dim;
+
+		size_t size() const
+		{
+			return type == FITSPixelType::UInt16 ? data_uint16.size() : data_float.size();
+		}
+
+		void resize(size_t n)
+		{
+			// valarray::resize always reallocates, so
+			// only resize if the size actually changes
+			if (type == FITSPixelType::UInt16)
+			{
+				if (data_uint16.size() != n)
+				{
+					data_uint16.resize(n);
+				}
+				data_float.resize(0);
+			}
+			else
+			{
+				if (data_float.size() != n)
+				{
+					data_float.resize(n);
+				}
+				data_uint16.resize(0);
+			}
+		}
+
+		// Returns a copy of this image of dimensions dim shrunk so that
+		// it fits into max_size. The copy is built on the first call and
+		// then kept until the preview is reset.
+		FITSImageData& GetPreview(FITSImageDim const& dim, int max_size, FITSImageDim* out_dim)
+		{
+			int const factor = Processing::GetPyramidFactor(dim, max_size);
+			if (!preview || preview_factor != factor || preview->type != type)
+			{
+				if (!preview)
+				{
+					preview.reset(new FITSImageData());
+				}
+				preview->type = type;
+				preview_dim = Visit([&](auto& data) { return Processing::DownsampleImage(data, dim, factor, GetData(*preview, data)); });
+				preview_factor = factor;
+			}
+			*out_dim = preview_dim;
+			return *preview;
+		}
+
+		void ResetPreview()
+		{
+			preview.reset();
+			preview_factor = 0;
+		}
+
+		// Calls fn with the valarray of the active pixel type
+		template<typename Fn>
+		auto Visit(Fn&& fn) -> decltype(fn(data_float))
+		{
+			if (type == FITSPixelType::UInt16)
+			{
+				return fn(data_uint16);
+			}
+			return fn(data_float);
+		}
+
+	private:
+		// valarray of image that has the same type as data
+		static std::valarray<float>& GetData(FITSImageData& image, std::valarray<float>&) { return image.data_float; }
+		static std::valarray<uint16_t>& GetData(FITSImageData& image, std::valarray<uint16_t>&) { return image.data_uint16; }
+	};
+
+}
@@ -23,10 +23,12 @@
 #include <limits>
 #include <algorithm>
 #include <cctype>
+#include <cmath>
 
 #include "fitsloader.h"
 #include "fitsdataloader.h"
-#include "hsv.h"
+#include "histogram.h"
+#include "render.h"
 
 namespace Loader
 {
@@ -470,7 +472,7 @@ namespace Loader
 
 
 	template<typename T_OUT>
-	bool FITSInfo::ReadImageUnprocessed(std::valarray<T_OUT>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size)
+	bool FITSInfo::ReadImageUnprocessed(std::valarray<T_OUT>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics)
 	{
 		Loader::FITSDatatype in_memory_datatype = m_attributes.data.in_memory_datatype;
 
@@ -479,92 +481,127 @@ namespace Loader
 			return false;
 		}
 
-		bool is_input_float_type = false;
-		T_OUT min_value = 0;
+		ImageStatistics local_statistics;
+		if (statistics == nullptr)
+		{
+			statistics = &local_statistics;
+		}
 
 		bool success;
 
 		if (in_memory_datatype.fits_datatype == TFLOAT || in_memory_datatype.fits_datatype == TDOUBLE)
 		{
-			success = ReadImage<float, T_OUT>(in_memory_datatype.fits_datatype, false, data, props);
-			is_input_float_type = true;
+			success = ReadImage<float, T_OUT>(in_memory_datatype.fits_datatype, false, data, props, statistics);
 		}
 		else if (in_memory_datatype.size == 1)
 		{
 			if (in_memory_datatype.is_signed)
 			{
-				success = ReadImage<int8_t, T_OUT>(in_memory_datatype.fits_datatype, true, data, props);
-				min_value = static_cast<T_OUT>(std::numeric_limits<int8_t>::min());
+				success = ReadImage<int8_t, T_OUT>(in_memory_datatype.fits_datatype, true, data, props, statistics);
 			}
 			else
 			{
-				success = ReadImage<uint8_t, T_OUT>(in_memory_datatype.fits_datatype, false, data, props);
-				min_value = static_cast<T_OUT>(std::numeric_limits<uint8_t>::min());
+				success = ReadImage<uint8_t, T_OUT>(in_memory_datatype.fits_datatype, false, data, props, statistics);
 			}
 		}
 		else if (in_memory_datatype.size == 2)
 		{
 			if (in_memory_datatype.is_signed)
 			{
-				success = ReadImage<int16_t, T_OUT>(in_memory_datatype.fits_datatype, true, data, props);
-				min_value = static_cast<T_OUT>(std::numeric_limits<int16_t>::min());
+				success = ReadImage<int16_t, T_OUT>(in_memory_datatype.fits_datatype, true, data, props, statistics);
 			}
 			else
 			{
-				success = ReadImage<uint16_t, T_OUT>(in_memory_datatype.fits_datatype, false, data, props);
-				min_value = static_cast<T_OUT>(std::numeric_limits<uint16_t>::min());
+				success = ReadImage<uint16_t, T_OUT>(in_memory_datatype.fits_datatype, false, data, props, statistics);
 			}
 		}
 		else if (in_memory_datatype.size >= 4)
 		{
 			if (in_memory_datatype.is_signed)
 			{
-				success = ReadImage<int32_t, T_OUT>(in_memory_datatype.fits_datatype, true, data, props);
-				min_value = static_cast<T_OUT>(std::numeric_limits<int32_t>::min());
+				success = ReadImage<int32_t, T_OUT>(in_memory_datatype.fits_datatype, true, data, props, statistics);
 			}
 			else
 			{
-				success = ReadImage<uint32_t, T_OUT>(in_memory_datatype.fits_datatype, false, data, props);
-				min_value = static_cast<T_OUT>(std::numeric_limits<uint32_t>::min());
+				success = ReadImage<uint32_t, T_OUT>(in_memory_datatype.fits_datatype, false, data, props, statistics);
 			}
 		}
 		else
 		{
-			success = ReadImage<float, T_OUT>(in_memory_datatype.fits_datatype, false, data, props);
-			is_input_float_type = true;
+			success = ReadImage<float, T_OUT>(in_memory_datatype.fits_datatype, false, data, props, statistics);
 		}
 
 		if (success && histogram != nullptr)
 		{
-			T_OUT max_value;
-			if (is_input_float_type)
+			// the decoder already counted every value
+			for (int c = 0; c < statistics->nc; ++c)
 			{
-				min_value = data.min();
-				max_value = data.max();
+				ChannelStatistics const& channel = statistics->channels[c];
+				std::vector<uint32_t> const& bins = channel.histogram;
+
+				if (channel.exact)
+				{
+					// the histogram spans [0, 2^bits) of the source
+					for (size_t v = 0; v < bins.size(); ++v)
+					{
+						histogram[v * histogram_size / bins.size()] += bins[v];
+					}
+				}
+				else
+				{
+					// the coarse bins are spread over [min, max] of all channels by their centers
+					double const min_value = statistics->min();
+					double const range = statistics->max() - min_value;
+					double const scale = range > 0 ? (histogram_size - 1) / range : 0.0;
+					for (size_t b = 0; b < bins.size(); ++b)
+					{
+						if (bins[b] != 0)
+						{
+							double const center = channel.histogram_offset + (b + 0.5) / channel.histogram_scale;
+							double const bin = std::min(static_cast<double>(histogram_size - 1), std::max(0.0, (center - min_value) * scale));
+							histogram[static_cast<size_t>(bin)] += bins[b];
+						}
+					}
+				}
 			}
-			else
+		}
+
+		return success;
+	}
+
+	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint64_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics);
+	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint32_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics);
+	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint16_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics);
+	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint8_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics);
+	template bool FITSInfo::ReadImageUnprocessed(std::valarray<float>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics);
+
+	std::array<float, 12> FITSInfo::GetBayerMatrix() const
+	{
+		std::array<float, 12> cfa = m_attributes.instrument.cfa.values();
+
+		if (abs(m_attributes.instrument.bayer_offset_x) % 2 != 0)
+		{
+			// flip cfa along X axis
+			for (int i = 0; i < 3; i++)
 			{
-				max_value = min_value + static_cast<T_OUT>(in_memory_datatype.size >= 4 ? (uint32_t(1) << 31) : (1 << (8 * in_memory_datatype.size)));
+				std::swap(cfa[0 + i * 4], cfa[1 + i * 4]);
+				std::swap(cfa[2 + i * 4], cfa[3 + i * 4]);
 			}
+		}
 
-			T_OUT range = max_value - min_value;
-
-			for (int i = 0; i < data.size(); ++i)
+		if (abs(m_attributes.instrument.bayer_offset_y) % 2 != 0)
+		{
+			// flip cfa along Y axis
+			for (int i = 0; i < 3; i++)
 			{
-				size_t bucket = static_cast<size_t>(static_cast<double>(data[i] - min_value) * (histogram_size - 1) / range);
-				++histogram[std::min(std::max(bucket, size_t(0)), histogram_size - 1)];
+				std::swap(cfa[0 + i * 4], cfa[2 + i * 4]);
+				std::swap(cfa[1 + i * 4], cfa[3 + i * 4]);
 			}
 		}
 
-		return success;
+		return cfa;
 	}
 
-	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint64_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint32_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint16_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template bool FITSInfo::ReadImageUnprocessed(std::valarray<uint8_t>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template bool FITSInfo::ReadImageUnprocessed(std::valarray<float>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-
 	template<typename T>
 	T GetSignedToUnsignedConversionOffset(std::true_type)
 	{
@@ -584,22 +621,20 @@ namespace Loader
 	template<typename T_IN, typename T_OUT>
 	bool FITSInfo::ReadImage(int fits_datatype, bool issigned, unsigned char* data, FITSImageLoaderParameters props)
 	{
-		std::valarray<T_OUT> imgData(m_attributes.data.out_dim.n);
+		std::valarray<T_OUT>& imgData = m_scratch.Get<T_OUT>(Processing::ScratchSlot::Decoded, m_attributes.data.out_dim.n);
 
 		if (!ReadImage<T_IN, T_OUT>(fits_datatype, issigned, imgData, props))
 		{
 			return false;
 		}
 
-		ProcessImage<T_OUT>(imgData, nullptr, 0);
-
-		StoreImageBGRA32<T_OUT>(imgData, data, props);
+		ProcessImage<T_OUT>(imgData, data, 0, true, props, nullptr, 0);
 
 		return true;
 	}
 
 	template<typename T_IN, typename T_OUT>
-	bool FITSInfo::ReadImage(int fits_datatype, bool issigned, std::valarray<T_OUT>& data, FITSImageLoaderParameters props)
+	bool FITSInfo::ReadImage(int fits_datatype, bool issigned, std::valarray<T_OUT>& data, FITSImageLoaderParameters props, ImageStatistics* statistics)
 	{
 		if (m_fits_file == nullptr)
 		{
@@ -644,35 +679,37 @@ namespace Loader
 		}
 
 		std::array<float, 12> cfa;
-		if (!m_attributes.instrument.cfa.identity())
+		if (m_debayer)
 		{
-			cfa = m_attributes.instrument.cfa.values();
+			cfa = GetBayerMatrix();
+		}
 
-			if (abs(m_attributes.instrument.bayer_offset_x) % 2 != 0)
+		// whether the data contains negative values
+		bool negative = false;
+
+		if (statistics)
+		{
+			if (std::is_integral<T_IN>::value && sizeof(T_IN) <= 2)
 			{
-				// flip cfa along X axis
-				for (int i = 0; i < 3; i++)
-				{
-					std::swap(cfa[0 + i * 4], cfa[1 + i * 4]);
-					std::swap(cfa[2 + i * 4], cfa[3 + i * 4]);
-				}
+				// integer sources of up to 16 bits get one histogram bin per value
+				statistics->Reset(m_attributes.data.out_dim.nc, true, size_t(1) << (8 * sizeof(T_IN)));
 			}
-
-			if (abs(m_attributes.instrument.bayer_offset_y) % 2 != 0)
+			else
 			{
-				// flip cfa along Y axis
-				for (int i = 0; i < 3; i++)
+				// the coarse histogram starts at the range given in the
+				// header, if any, and otherwise at that of normalized data
+				int status = 0;
+				float data_min, data_max;
+				if (ReadFloatKeyword("DATAMIN", &data_min, &status) != 0 || ReadFloatKeyword("DATAMAX", &data_max, &status) != 0 || !(data_max > data_min))
 				{
-					std::swap(cfa[0 + i * 4], cfa[2 + i * 4]);
-					std::swap(cfa[1 + i * 4], cfa[3 + i * 4]);
+					data_min = 0.0f;
+					data_max = 1.0f;
 				}
+				statistics->Reset(m_attributes.data.out_dim.nc, false, coarse_histogram_size, data_min, data_max);
 			}
 		}
 
-		// whether the data contains negative values
-		bool negative = false;
-
-		Loader::DataOutput<T_IN, T_OUT> output{ &negative, &data[0] };
+		Loader::DataOutput<T_IN, T_OUT> output{ &negative, &data[0], statistics };
 		Loader::DataKernel<T_IN, T_OUT> kernel;
 
 		kernel.size = full_kernel_size;
@@ -688,200 +725,162 @@ namespace Loader
 			return false;
 		}
 
-		// if the storage type is signed but no
-		// negative values have been found then
-		// it's likely that the data was originally
-		// unsigned and so the offset is removed again
-		if (issigned && !negative && kernel.offset != 0)
+		// the offset has only been applied if negative values were found,
+		// otherwise the data was likely unsigned in the first place
+		if (statistics)
 		{
-			data -= kernel.offset;
+			statistics->negative = negative;
+			statistics->valid = true;
 		}
 
 		return true;
 	};
 
 
-	template<typename T_OUT>
-	void FITSInfo::ProcessImage(std::valarray<T_OUT>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size)
+	Processing::RenderParameters GetRenderParameters(FITSImageLoaderParameters const& props, FITSFilterType filter_type, FITSImageDim const& size)
 	{
-		std::valarray<T_OUT> data_copy(data);
-		if (computeStrechParams)
+		Processing::RenderParameters render_params;
+		render_params.saturation = props.saturation;
+
+		if (size.nc == 1 && props.mono_color_outline && filter_type != FITSFilterType::Other)
 		{
-			ProcessImage<T_OUT>(data_copy, histogram, histogram_size);
+			render_params.outline_border = std::max(2, std::min(size.nx / 50, size.ny / 50));
+
+			// BGR index of the filter's colour, the other channels are dimmed
+			int const color_index = filter_type == FITSFilterType::R ? 2 : filter_type == FITSFilterType::G ? 1 : filter_type == FITSFilterType::B ? 0 : -1;
+
+			for (int i = 0; i < 3; ++i)
+			{
+				bool const bright = color_index < 0 || i == color_index;
+				render_params.outline_scale[i] = bright ? 0.0f : 0.2f;
+				render_params.outline_offset[i] = bright ? 200.0f : 0.0f;
+			}
 		}
-		else
+
+		return render_params;
+	}
+
+	template<typename T_OUT>
+	bool FITSInfo::ProcessImage(std::valarray<T_OUT>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics, Processing::CancellationFlag cancel)
+	{
+		Processing::ImageStretchParameters params = props.stretch_params;
+		if (computeStrechParams)
 		{
-			Processing::StretchImage(data_copy, m_attributes.data.out_dim, props.stretch_params, histogram, nullptr, nullptr, histogram_size);
+			Processing::ComputeImageStretch(data, m_attributes.data.out_dim, &params, statistics);
 		}
-		StoreImageBGRA32<T_OUT>(data_copy, outData, props);
+		return Processing::RenderImageBGRA32(data, m_attributes.data.out_dim, params, GetRenderParameters(props, m_attributes.shot.filter_type, m_attributes.data.out_dim), histogram, histogram_size, statistics, outData, outPitch, cancel);
 	}
 
-	template void FITSInfo::ProcessImage(std::valarray<uint64_t>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template void FITSInfo::ProcessImage(std::valarray<uint32_t>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template void FITSInfo::ProcessImage(std::valarray<uint16_t>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template void FITSInfo::ProcessImage(std::valarray<uint8_t>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
-	template void FITSInfo::ProcessImage(std::valarray<float>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
+	template bool FITSInfo::ProcessImage(std::valarray<uint64_t>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics, Processing::CancellationFlag cancel);
+	template bool FITSInfo::ProcessImage(std::valarray<uint32_t>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics, Processing::CancellationFlag cancel);
+	template bool FITSInfo::ProcessImage(std::valarray<uint16_t>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics, Processing::CancellationFlag cancel);
+	template bool FITSInfo::ProcessImage(std::valarray<uint8_t>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics, Processing::CancellationFlag cancel);
+	template bool FITSInfo::ProcessImage(std::valarray<float>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics, Processing::CancellationFlag cancel);
 
 	template<typename T>
-	void FITSInfo::ProcessImage(std::valarray<T>& data, uint32_t* histogram, size_t histogram_size)
+	bool FITSInfo::RenderImage(std::valarray<T> const& data, FITSImageDim const& dim, unsigned char* outData, size_t outPitch, FITSImageLoaderParameters props, Processing::CancellationFlag cancel)
 	{
-		Processing::ImageStretchParameters params;
-		Processing::ComputeImageStretch(data, m_attributes.data.out_dim, &params);
-		Processing::StretchImage(data, m_attributes.data.out_dim, params, histogram, nullptr, nullptr, histogram_size);
+		return Processing::RenderImageBGRA32(data, dim, props.stretch_params, GetRenderParameters(props, m_attributes.shot.filter_type, dim), nullptr, 0, nullptr, outData, outPitch, cancel);
 	}
 
-	template<typename T>
-	void FITSInfo::StoreImageBGRA32(std::valarray<T>& in_data, unsigned char* out_data, FITSImageLoaderParameters props)
+	template bool FITSInfo::RenderImage(std::valarray<uint16_t> const& data, FITSImageDim const& dim, unsigned char* outData, size_t outPitch, FITSImageLoaderParameters props, Processing::CancellationFlag cancel);
+	template bool FITSInfo::RenderImage(std::valarray<float> const& data, FITSImageDim const& dim, unsigned char* outData, size_t outPitch, FITSImageLoaderParameters props, Processing::CancellationFlag cancel);
+
+	FITSImageDim FITSInfo::GetThumbnailDim(int max_size, int* stride) const
 	{
-		auto& size = m_attributes.data.out_dim;
-		if (size.nc == 1)
+		// bayered data is sampled in whole 2x2 cells
+		int const cell = m_debayer ? 2 : 1;
+		int const width = std::max(1, m_attributes.data.in_dim.nx / cell);
+		int const height = std::max(1, m_attributes.data.in_dim.ny / cell);
+		int const size = std::max(width, height);
+
+		int const k = max_size > 0 && size > max_size ? (size + max_size - 1) / max_size : 1;
+		if (stride)
 		{
-			if (props.mono_color_outline && m_attributes.shot.filter_type != FITSFilterType::Other)
-			{
-				int const border = std::max(2, std::min(size.nx / 50, size.ny / 50));
+			*stride = k;
+		}
 
-				switch (m_attributes.shot.filter_type)
-				{
-				case FITSFilterType::L:
-					for (int y = 0; y < size.ny; y++)
-					{
-						for (int x = 0; x < size.nx; x++)
-						{
-							int i = (y * size.nx + x);
+		FITSImageDim dim;
+		dim.nx = (width + k - 1) / k;
+		dim.ny = (height + k - 1) / k;
+		dim.nc = m_attributes.data.out_dim.nc;
+		dim.n = static_cast<uint32_t>(dim.nx) * static_cast<uint32_t>(dim.ny) * static_cast<uint32_t>(dim.nc);
+		return dim;
+	}
 
-							unsigned char v = static_cast<unsigned char>(in_data[i]);
-							if (x <= border || x >= size.nx - 1 - border || y <= border || y >= size.ny - 1 - border)
-							{
-								out_data[i * 4 + 0] = 200;
-								out_data[i * 4 + 1] = 200;
-								out_data[i * 4 + 2] = 200;
-							}
-							else
-							{
-								out_data[i * 4 + 0] = v;
-								out_data[i * 4 + 1] = v;
-								out_data[i * 4 + 2] = v;
-							}
-							out_data[i * 4 + 3] = 255;
-						}
-					}
-					break;
-				case FITSFilterType::R:
-					for (int y = 0; y < size.ny; y++)
-					{
-						for (int x = 0; x < size.nx; x++)
-						{
-							int i = (y * size.nx + x);
+	bool FITSInfo::ReadThumbnail(unsigned char* outData, size_t outPitch, int max_size, FITSImageLoaderParameters props)
+	{
+		if (!m_valid || !OpenFile())
+		{
+			return false;
+		}
 
-							unsigned char v = static_cast<unsigned char>(in_data[i]);
-							if (x <= border || x >= size.nx - 1 - border || y <= border || y >= size.ny - 1 - border)
-							{
-								out_data[i * 4 + 0] = static_cast<unsigned char>(v * 0.2f);
-								out_data[i * 4 + 1] = static_cast<unsigned char>(v * 0.2f);
-								out_data[i * 4 + 2] = 200;
-							}
-							else
-							{
-								out_data[i * 4 + 0] = v;
-								out_data[i * 4 + 1] = v;
-								out_data[i * 4 + 2] = v;
-							}
-							out_data[i * 4 + 3] = 255;
-						}
-					}
-					break;
-				case FITSFilterType::G:
-					for (int y = 0; y < size.ny; y++)
-					{
-						for (int x = 0; x < size.nx; x++)
-						{
-							int i = (y * size.nx + x);
+		int k;
+		FITSImageDim const dim = GetThumbnailDim(max_size, &k);
+		size_t const pixels_per_channel = static_cast<size_t>(dim.nx) * dim.ny;
 
-							unsigned char v = static_cast<unsigned char>(in_data[i]);
-							if (x <= border || x >= size.nx - 1 - border || y <= border || y >= size.ny - 1 - border)
-							{
-								out_data[i * 4 + 0] = static_cast<unsigned char>(v * 0.2f);
-								out_data[i * 4 + 1] = 200;
-								out_data[i * 4 + 2] = static_cast<unsigned char>(v * 0.2f);
-							}
-							else
-							{
-								out_data[i * 4 + 0] = v;
-								out_data[i * 4 + 1] = v;
-								out_data[i * 4 + 2] = v;
-							}
-							out_data[i * 4 + 3] = 255;
-						}
-					}
-					break;
-				case FITSFilterType::B:
-					for (int y = 0; y < size.ny; y++)
-					{
-						for (int x = 0; x < size.nx; x++)
-						{
-							int i = (y * size.nx + x);
+		std::valarray<float> data(0.0f, dim.n);
 
-							unsigned char v = static_cast<unsigned char>(in_data[i]);
-							if (x <= border || x >= size.nx - border || y <= border || y >= size.ny - border)
-							{
-								out_data[i * 4 + 0] = 200;
-								out_data[i * 4 + 1] = static_cast<unsigned char>(v * 0.2f);
-								out_data[i * 4 + 2] = static_cast<unsigned char>(v * 0.2f);
-							}
-							else
-							{
-								out_data[i * 4 + 0] = v;
-								out_data[i * 4 + 1] = v;
-								out_data[i * 4 + 2] = v;
-							}
-							out_data[i * 4 + 3] = 255;
-						}
-					}
-					break;
-				}
-			}
-			else
+		float nulval(0);
+		int anynul(0);
+		int status(0);
+
+		if (m_debayer)
+		{
+			std::array<float, 12> const cfa = GetBayerMatrix();
+			std::valarray<float> samples(pixels_per_channel);
+
+			// one strided read per position within the 2x2 cell,
+			// weighted into the channels like the full loader does
+			for (int i = 0; i < 4; ++i)
 			{
-				for (int i = 0; i < size.ny * size.nx; i++)
+				int const cx = i % 2;
+				int const cy = i / 2;
+
+				long fpixel[3] = { 1 + cx, 1 + cy, 1 };
+				long lpixel[3] = { 1 + cx + 2L * k * (dim.nx - 1), 1 + cy + 2L * k * (dim.ny - 1), 1 };
+				long inc[3] = { 2L * k, 2L * k, 1 };
+
+				if (fits_read_subset(m_fits_file, TFLOAT, fpixel, lpixel, inc, &nulval, &samples[0], &anynul, &status))
+				{
+					return false;
+				}
+
+				for (int c = 0; c < 3; ++c)
 				{
-					unsigned char v = static_cast<unsigned char>(in_data[i]);
-					out_data[i * 4 + 0] = v;
-					out_data[i * 4 + 1] = v;
-					out_data[i * 4 + 2] = v;
-					out_data[i * 4 + 3] = 255;
+					float const weight = cfa[i + c * 4];
+					if (weight != 0.0f)
+					{
+						data[std::slice(c * pixels_per_channel, pixels_per_channel, 1)] += std::valarray<float>(samples * weight);
+					}
 				}
 			}
 		}
 		else
 		{
-			int stride = size.nx * size.ny;
+			// the planes are read in one go, already in planar layout
+			long fpixel[3] = { 1, 1, 1 };
+			long lpixel[3] = { 1 + static_cast<long>(k) * (dim.nx - 1), 1 + static_cast<long>(k) * (dim.ny - 1), m_attributes.data.in_dim.nc };
+			long inc[3] = { k, k, 1 };
 
-			for (int y = 0; y < size.ny; y++)
+			if (fits_read_subset(m_fits_file, TFLOAT, fpixel, lpixel, inc, &nulval, &data[0], &anynul, &status))
 			{
-				for (int x = 0; x < size.nx; x++)
-				{
-					int in_index = y * size.nx + x;
-					int out_index = in_index * 4;
-
-					Processing::RgbColor rgb{
-						static_cast<unsigned char>(in_data[in_index]),
-						static_cast<unsigned char>(in_data[in_index + stride]),
-						static_cast<unsigned char>(in_data[in_index + stride * 2])
-					};
-
-					Processing::HsvColor hsv = Processing::RgbToHsv(rgb);
+				return false;
+			}
+		}
 
-					hsv.s = std::min(static_cast<unsigned char>(props.saturation * hsv.s), static_cast<unsigned char>(255));
+		// same handling of signed integer data as the full loader,
+		// the offset is only applied if there are negative values
+		Loader::FITSDatatype const& in_memory_datatype = m_attributes.data.in_memory_datatype;
+		if (in_memory_datatype.is_signed && in_memory_datatype.fits_datatype != TFLOAT && in_memory_datatype.fits_datatype != TDOUBLE && data.min() < 0.0f)
+		{
+			data += std::ldexp(1.0f, 8 * std::min(static_cast<int>(in_memory_datatype.size), 4) - 1);
+		}
 
-					rgb = Processing::HsvToRgb(hsv);
+		Processing::ImageStretchParameters params;
+		Processing::ComputeImageStretch(data, dim, &params);
 
-					out_data[out_index + 2] = rgb.r;
-					out_data[out_index + 1] = rgb.g;
-					out_data[out_index + 0] = rgb.b;
-					out_data[out_index + 3] = 255;
-				}
-			}
-		}
+		return Processing::RenderImageBGRA32(data, dim, params, GetRenderParameters(props, m_attributes.shot.filter_type, dim), nullptr, 0, nullptr, outData, outPitch);
 	}
 
 	int FITSInfo::ReadStringKeyword(const char* key, std::string* str, int* status)
@@ -28,6 +28,8 @@
 #include "fitsdatatype.h"
 #include "fitsattributes.h"
 #include "stretch.h"
+#include "scratcharena.h"
+#include "imagestatistics.h"
 
 namespace Loader
 {
@@ -66,10 +68,24 @@ namespace Loader
 		bool ReadImage(unsigned char* data, FITSImageLoaderParameters props);
 
 		template<typename T_OUT>
-		bool ReadImageUnprocessed(std::valarray<T_OUT>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
+		bool ReadImageUnprocessed(std::valarray<T_OUT>& data, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics* statistics = nullptr);
 
+		// Returns false if the processing was cancelled
 		template<typename T_OUT>
-		void ProcessImage(std::valarray<T_OUT>& data, unsigned char* outData, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size);
+		bool ProcessImage(std::valarray<T_OUT>& data, unsigned char* outData, size_t outPitch, bool computeStrechParams, FITSImageLoaderParameters props, uint32_t* histogram, size_t histogram_size, ImageStatistics const* statistics = nullptr, Processing::CancellationFlag cancel = nullptr);
+
+		// Renders image data with the given dimensions, e.g. a preview, using the stretch in props
+		template<typename T>
+		bool RenderImage(std::valarray<T> const& data, FITSImageDim const& dim, unsigned char* outData, size_t outPitch, FITSImageLoaderParameters props, Processing::CancellationFlag cancel = nullptr);
+
+		// Size of the thumbnail that ReadThumbnail renders, stride is
+		// set to the number of rows and columns between two samples
+		FITSImageDim GetThumbnailDim(int max_size, int* stride = nullptr) const;
+
+		// Renders a thumbnail by reading only every k-th row and column
+		// of the data unit. There is no filtering and the stretch is always
+		// computed from the samples, so the image doesn't need to be loaded.
+		bool ReadThumbnail(unsigned char* outData, size_t outPitch, int max_size, FITSImageLoaderParameters props);
 	private:
 		std::string m_file;
 		fitsfile* m_fits_file;
@@ -82,21 +98,21 @@ namespace Loader
 		float m_kernel_size;
 		int m_kernel_stride;
 
+		// buffers for ReadImage directly to BGRA
+		Processing::ScratchArena m_scratch;
+
+		std::array<float, 12> GetBayerMatrix() const;
+
 		int ReadStringKeyword(const char* key, std::string* str, int* status);
 		int ReadIntKeyword(const char* key, int* value, int* status);
 		int ReadFloatKeyword(const char* key, float* value, int* status);
 		int ReadDateKeyword(const char* key, FITSDate* value, int* status);
 
 		template<typename T_IN, typename T_OUT>
-		bool ReadImage(int fits_datatype, bool issigned, std::valarray<T_OUT>& data, FITSImageLoaderParameters props);
+		bool ReadImage(int fits_datatype, bool issigned, std::valarray<T_OUT>& data, FITSImageLoaderParameters props, ImageStatistics* statistics = nullptr);
 
 		template<typename T_IN, typename T_OUT>
 		bool ReadImage(int fits_datatype, bool issigned, unsigned char* data, FITSImageLoaderParameters props);
 
-		template<typename T>
-		void ProcessImage(std::valarray<T>& data, uint32_t* histogram, size_t histogram_size);
-
-		template<typename T>
-		void StoreImageBGRA32(std::valarray<T>& inData, unsigned char* outData, FITSImageLoaderParameters props);
 	};
 }
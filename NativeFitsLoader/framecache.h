@@ -0,0 +1,181 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstdint>
+
+#include "fitsattributes.h"
+
+namespace Cache
+{
+
+	// Rendered BGRA32 frame without row padding
+	struct Frame
+	{
+		Loader::FITSImageDim dim;
+		std::vector<unsigned char> pixels;
+	};
+
+	// Rendered frames of several images kept in memory up to a budget, the least
+	// recently used frames are evicted first. A frame is identified by its owner,
+	// e.g. the image data it was rendered from, and a hash of the parameters it
+	// was rendered with. Frames are shared, so a frame that is evicted while it
+	// is being copied stays valid until the copy is done.
+	class FrameCache
+	{
+	public:
+		// Returns the frame, or nullptr if it is not in the cache
+		std::shared_ptr<Frame const> Get(void const* owner, uint64_t params)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			auto it = m_index.find(Key{ owner, params });
+			if (it == m_index.end())
+			{
+				return nullptr;
+			}
+
+			// move to the front, i.e. most recently used
+			m_entries.splice(m_entries.begin(), m_entries, it->second);
+
+			return it->second->frame;
+		}
+
+		// Adds a frame and evicts other frames as needed to stay within the budget.
+		// Frames larger than the whole budget are not added.
+		void Put(void const* owner, uint64_t params, std::shared_ptr<Frame const> frame)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			Key const key{ owner, params };
+
+			auto it = m_index.find(key);
+			if (it != m_index.end())
+			{
+				Remove(it->second);
+			}
+
+			if (frame->pixels.size() > m_budget)
+			{
+				return;
+			}
+
+			m_entries.push_front(Entry{ key, std::move(frame) });
+			m_index[key] = m_entries.begin();
+			m_size += m_entries.front().frame->pixels.size();
+
+			Evict();
+		}
+
+		// Removes all frames of an owner, e.g. because its data has changed
+		void Invalidate(void const* owner)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			for (auto it = m_entries.begin(); it != m_entries.end();)
+			{
+				auto next = std::next(it);
+				if (it->key.owner == owner)
+				{
+					Remove(it);
+				}
+				it = next;
+			}
+		}
+
+		void Clear()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			m_entries.clear();
+			m_index.clear();
+			m_size = 0;
+		}
+
+		// Maximum number of bytes of pixels kept, 0 disables the cache
+		void SetBudget(size_t budget)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			m_budget = budget;
+			Evict();
+		}
+
+		size_t budget()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_budget;
+		}
+
+	private:
+		struct Key
+		{
+			void const* owner;
+			uint64_t params;
+
+			bool operator==(Key const& other) const { return owner == other.owner && params == other.params; }
+		};
+
+		struct KeyHasher
+		{
+			size_t operator()(Key const& key) const
+			{
+				return std::hash<void const*>()(key.owner) ^ static_cast<size_t>(key.params);
+			}
+		};
+
+		struct Entry
+		{
+			Key key;
+			std::shared_ptr<Frame const> frame;
+		};
+
+		using EntryList = std::list<Entry>;
+
+		void Remove(EntryList::iterator it)
+		{
+			m_size -= it->frame->pixels.size();
+			m_index.erase(it->key);
+			m_entries.erase(it);
+		}
+
+		void Evict()
+		{
+			while (m_size > m_budget && !m_entries.empty())
+			{
+				Remove(std::prev(m_entries.end()));
+			}
+		}
+
+		std::mutex m_mutex;
+
+		// most recently used first
+		EntryList m_entries;
+		std::unordered_map<Key, EntryList::iterator, KeyHasher> m_index;
+
+		size_t m_budget = 0;
+		size_t m_size = 0;
+	};
+
+}
@@ -0,0 +1,112 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <array>
+
+#include "fitsattributes.h"
+#include "fitsimagedata.h"
+#include "median.h"
+#include "stretch.h"
+
+namespace Processing
+{
+
+	// Stretch parameters shared by all frames of a group, i.e. those of the
+	// auto-stretch of all frames' pixels together. The frames are added one at
+	// a time and only their histograms are merged per channel, so each frame
+	// can be unloaded again right after it was added. Frames whose decoder
+	// collected a histogram with one bin per value keep the result exact.
+	class GroupStretchAccumulator
+	{
+	public:
+		void Add(Loader::FITSImageData& image, Loader::FITSImageDim const& dim)
+		{
+			int const nc = std::min(dim.nc, 3);
+
+			if (image.statistics.valid)
+			{
+				for (int c = 0; c < nc; ++c)
+				{
+					m_channels[c].Merge(image.statistics.channels[c]);
+				}
+			}
+			else
+			{
+				// only frames not decoded by the loader lack the statistics
+				Loader::ImageStatistics statistics;
+				bool const exact = image.type == Loader::FITSPixelType::UInt16;
+				statistics.Reset(nc, exact, exact ? size_t(65536) : Loader::coarse_histogram_size);
+
+				size_t const pixels_per_channel = static_cast<size_t>(dim.nx) * dim.ny;
+				image.Visit([&](auto& data)
+					{
+						for (int c = 0; c < nc; ++c)
+						{
+							for (size_t i = pixels_per_channel * c; i < pixels_per_channel * (c + 1); ++i)
+							{
+								statistics.channels[c].Add(data[i]);
+							}
+						}
+					});
+
+				for (int c = 0; c < nc; ++c)
+				{
+					m_channels[c].Merge(statistics.channels[c]);
+				}
+			}
+
+			m_nc = std::max(m_nc, nc);
+		}
+
+		void Compute(ImageStretchParameters* image_params) const
+		{
+			for (int c = 0; c < m_nc; ++c)
+			{
+				Loader::ChannelStatistics const& channel = m_channels[c];
+				if (channel.count == 0)
+				{
+					continue;
+				}
+
+				MedianStatistics statistics = ComputeMedianStatistics(channel.histogram.data(), channel.histogram.size());
+				if (!channel.exact)
+				{
+					// the statistics are in bins and need to be mapped back to values
+					double const median = channel.histogram_offset + (statistics.median + 0.5) / channel.histogram_scale;
+					statistics.median = static_cast<float>(std::min(channel.max, std::max(channel.min, median)));
+					statistics.mad = static_cast<float>(statistics.mad / channel.histogram_scale);
+					statistics.min = static_cast<float>(channel.min);
+					statistics.max = static_cast<float>(channel.max);
+				}
+
+				ComputeChannelStretch(statistics, &(*image_params)[c]);
+			}
+		}
+
+	private:
+		int m_nc = 0;
+		std::array<Loader::ChannelStatistics, 3> m_channels;
+	};
+
+}
@@ -0,0 +1,225 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <ppl.h>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define PROCESSING_SSE2
+#endif
+
+namespace Processing
+{
+
+	// Number of values whose bins are computed in one go
+	size_t const histogram_batch_size = 256;
+
+	// Smallest number of values worth handing to a separate worker
+	size_t const histogram_min_block_size = 65536;
+
+	// Private histogram of a single worker. Small histograms are split
+	// into four interleaved sub-histograms so that consecutive values
+	// falling into the same bin, which is the norm for sky background,
+	// do not all increment the same counter back to back.
+	class HistogramAccumulator
+	{
+	public:
+		HistogramAccumulator(size_t histogram_size) :
+			m_size(histogram_size), m_interleave(histogram_size <= 4096 ? 4 : 1), m_bins(histogram_size * m_interleave)
+		{
+		}
+
+		void Add(int32_t const* bins, size_t count)
+		{
+			uint32_t* const bins_ptr = m_bins.data();
+
+			size_t i = 0;
+			if (m_interleave == 4)
+			{
+				uint32_t* const bins_ptr_1 = bins_ptr + m_size;
+				uint32_t* const bins_ptr_2 = bins_ptr + m_size * 2;
+				uint32_t* const bins_ptr_3 = bins_ptr + m_size * 3;
+
+				for (; i + 4 <= count; i += 4)
+				{
+					++bins_ptr[bins[i + 0]];
+					++bins_ptr_1[bins[i + 1]];
+					++bins_ptr_2[bins[i + 2]];
+					++bins_ptr_3[bins[i + 3]];
+				}
+			}
+			for (; i < count; ++i)
+			{
+				++bins_ptr[bins[i]];
+			}
+		}
+
+		void MergeInto(uint32_t* histogram) const
+		{
+			for (size_t j = 0; j < m_interleave; ++j)
+			{
+				uint32_t const* const bins_ptr = m_bins.data() + j * m_size;
+				for (size_t i = 0; i < m_size; ++i)
+				{
+					histogram[i] += bins_ptr[i];
+				}
+			}
+		}
+
+	private:
+		size_t m_size;
+		size_t m_interleave;
+		std::vector<uint32_t> m_bins;
+	};
+
+	// Number of blocks [0, n) is split into, at most one per worker
+	inline size_t GetBlockCount(size_t n)
+	{
+		size_t const workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+		return std::max<size_t>(1, std::min(workers, n / histogram_min_block_size));
+	}
+
+	// Splits [0, n) into num_blocks blocks and calls
+	// fn(block, start, end) for each block in parallel
+	template<typename Fn>
+	void ParallelForBlocks(size_t n, size_t num_blocks, Fn const& fn)
+	{
+		size_t const block_size = (n + num_blocks - 1) / num_blocks;
+
+		concurrency::parallel_for(size_t(0), num_blocks, [&](size_t block)
+			{
+				size_t const start = std::min(n, block * block_size);
+				size_t const end = std::min(n, start + block_size);
+				fn(block, start, end);
+			});
+	}
+
+	// Number of row tiles a width x height image is split into, at most one per worker
+	inline size_t GetRowTileCount(int width, int height)
+	{
+		return std::max<size_t>(1, std::min<size_t>(GetBlockCount(static_cast<size_t>(width) * height), static_cast<size_t>(height)));
+	}
+
+	// Calls fn(tile, row_start, row_end) for each of the num_tiles row tiles in parallel
+	template<typename Fn>
+	void ParallelForRowTiles(int height, size_t num_tiles, Fn const& fn)
+	{
+		ParallelForBlocks(static_cast<size_t>(height), num_tiles, fn);
+	}
+
+	// Splits [0, n) into one block per worker and calls
+	// fn(start, end, accumulator) for each block. The private
+	// histograms are added to histogram once all blocks are done.
+	template<typename Fn>
+	void ParallelHistogram(size_t n, uint32_t* histogram, size_t histogram_size, Fn const& fn)
+	{
+		size_t const num_blocks = GetBlockCount(n);
+
+		std::vector<HistogramAccumulator> accumulators(num_blocks, HistogramAccumulator(histogram_size));
+
+		ParallelForBlocks(n, num_blocks, [&](size_t block, size_t start, size_t end)
+			{
+				fn(start, end, accumulators[block]);
+			});
+
+		for (auto& accumulator : accumulators)
+		{
+			accumulator.MergeInto(histogram);
+		}
+	}
+
+	// bins[i] = clamp((data[i] - offset) * scale, 0, max_bin), NaN goes to bin 0
+	template<typename T>
+	inline void ComputeHistogramBins(T const* data, size_t count, float offset, float scale, float max_bin, int32_t* bins)
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			float const bin = (static_cast<float>(data[i]) - offset) * scale;
+			bins[i] = static_cast<int32_t>(std::min(max_bin, std::max(0.0f, bin)));
+		}
+	}
+
+#ifdef PROCESSING_SSE2
+	inline __m128i ComputeHistogramBins(__m128 values, __m128 offset, __m128 scale, __m128 max_bin)
+	{
+		// maxps returns the second operand if either is NaN
+		__m128 bin = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(values, offset), scale), _mm_setzero_ps());
+		return _mm_cvttps_epi32(_mm_min_ps(bin, max_bin));
+	}
+
+	inline void ComputeHistogramBins(float const* data, size_t count, float offset, float scale, float max_bin, int32_t* bins)
+	{
+		__m128 const offset_ps = _mm_set1_ps(offset);
+		__m128 const scale_ps = _mm_set1_ps(scale);
+		__m128 const max_bin_ps = _mm_set1_ps(max_bin);
+
+		size_t i = 0;
+		for (; i + 4 <= count; i += 4)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(bins + i), ComputeHistogramBins(_mm_loadu_ps(data + i), offset_ps, scale_ps, max_bin_ps));
+		}
+		ComputeHistogramBins<float>(data + i, count - i, offset, scale, max_bin, bins + i);
+	}
+
+	inline void ComputeHistogramBins(uint16_t const* data, size_t count, float offset, float scale, float max_bin, int32_t* bins)
+	{
+		__m128 const offset_ps = _mm_set1_ps(offset);
+		__m128 const scale_ps = _mm_set1_ps(scale);
+		__m128 const max_bin_ps = _mm_set1_ps(max_bin);
+		__m128i const zero = _mm_setzero_si128();
+
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+		{
+			__m128i const values = _mm_loadu_si128(reinterpret_cast<__m128i const*>(data + i));
+			__m128 const lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(values, zero));
+			__m128 const hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(values, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(bins + i), ComputeHistogramBins(lo, offset_ps, scale_ps, max_bin_ps));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(bins + i + 4), ComputeHistogramBins(hi, offset_ps, scale_ps, max_bin_ps));
+		}
+		ComputeHistogramBins<uint16_t>(data + i, count - i, offset, scale, max_bin, bins + i);
+	}
+#endif
+
+	// Adds the values of data to histogram where the bin
+	// of a value x is (x - offset) * scale, clamped to the
+	// histogram size
+	template<typename T>
+	void ComputeHistogram(T const* data, size_t n, float offset, float scale, uint32_t* histogram, size_t histogram_size)
+	{
+		float const max_bin = static_cast<float>(histogram_size - 1);
+
+		ParallelHistogram(n, histogram, histogram_size, [&](size_t start, size_t end, HistogramAccumulator& accumulator)
+			{
+				int32_t bins[histogram_batch_size];
+				for (size_t i = start; i < end; i += histogram_batch_size)
+				{
+					size_t const count = std::min(histogram_batch_size, end - i);
+					ComputeHistogramBins(data + i, count, offset, scale, max_bin, bins);
+					accumulator.Add(bins, count);
+				}
+			});
+	}
+
+}
@@ -0,0 +1,293 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <array>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <cstdint>
+
+namespace Loader
+{
+
+	// Number of bins of the coarse histogram of sources without a histogram with one bin per value
+	size_t const coarse_histogram_size = 65536;
+
+	struct ChannelStatistics
+	{
+		// of the finite values only
+		double min = std::numeric_limits<double>::max();
+		double max = std::numeric_limits<double>::lowest();
+		double sum = 0;
+		double sum_sq = 0;
+		uint64_t count = 0;
+
+		// Integer sources of up to 16 bits have one bin per value, i.e. the bin of v
+		// is v. All other sources have a coarse histogram where the bin of v is
+		// (v - histogram_offset) * histogram_scale. Its range starts at the one given
+		// to Reset and doubles, merging neighbouring bins, whenever a value falls
+		// outside of it, so it always covers all finite values that were added.
+		std::vector<uint32_t> histogram;
+		bool exact = false;
+		double histogram_offset = 0;
+		double histogram_scale = 1;
+
+		template<typename T>
+		inline void Add(T value)
+		{
+			double const v = static_cast<double>(value);
+			if (std::is_floating_point<T>::value && !std::isfinite(v))
+			{
+				return;
+			}
+
+			min = std::min(min, v);
+			max = std::max(max, v);
+			sum += v;
+			sum_sq += v * v;
+			++count;
+
+			if (exact)
+			{
+				size_t const bin = value <= T(0) ? 0 : std::min(static_cast<size_t>(value), histogram.size() - 1);
+				++histogram[bin];
+			}
+			else if (!histogram.empty())
+			{
+				AddToCoarseHistogram(v, 1);
+			}
+		}
+
+		// Adds all values that were added to other, e.g. those of another frame.
+		// Both histograms must be exact to stay so, otherwise the result is coarse
+		// and the bins of other are added by their centers.
+		void Merge(ChannelStatistics const& other)
+		{
+			if (other.count == 0)
+			{
+				return;
+			}
+
+			if (count == 0)
+			{
+				*this = other;
+				return;
+			}
+
+			if (exact && !other.exact)
+			{
+				// the values become the centers of the bins
+				// of a coarse histogram over their range
+				std::vector<uint32_t> values;
+				values.swap(histogram);
+				histogram.assign(coarse_histogram_size, 0);
+				exact = false;
+				histogram_offset = min;
+				histogram_scale = coarse_histogram_size / (max + 1.0 - min);
+				for (size_t v = 0; v < values.size(); ++v)
+				{
+					if (values[v] != 0)
+					{
+						AddToCoarseHistogram(static_cast<double>(v), values[v]);
+					}
+				}
+			}
+
+			min = std::min(min, other.min);
+			max = std::max(max, other.max);
+			sum += other.sum;
+			sum_sq += other.sum_sq;
+			count += other.count;
+
+			if (exact)
+			{
+				if (histogram.size() < other.histogram.size())
+				{
+					histogram.resize(other.histogram.size(), 0);
+				}
+				for (size_t v = 0; v < other.histogram.size(); ++v)
+				{
+					histogram[v] += other.histogram[v];
+				}
+			}
+			else
+			{
+				for (size_t b = 0; b < other.histogram.size(); ++b)
+				{
+					if (other.histogram[b] != 0)
+					{
+						double const center = other.exact ? static_cast<double>(b) : other.histogram_offset + (b + 0.5) / other.histogram_scale;
+						AddToCoarseHistogram(std::min(other.max, std::max(other.min, center)), other.histogram[b]);
+					}
+				}
+			}
+		}
+
+		// Adds offset to all values that were added
+		void Shift(double offset)
+		{
+			if (count == 0)
+			{
+				return;
+			}
+
+			sum_sq += 2.0 * offset * sum + count * offset * offset;
+			sum += count * offset;
+			min += offset;
+			max += offset;
+
+			if (exact)
+			{
+				// offset is a whole number of values
+				size_t const size = histogram.size();
+				size_t const shift = std::min(static_cast<size_t>(std::abs(offset)), size);
+				if (offset < 0)
+				{
+					std::copy(histogram.begin() + shift, histogram.end(), histogram.begin());
+					std::fill(histogram.end() - shift, histogram.end(), 0);
+				}
+				else
+				{
+					std::copy_backward(histogram.begin(), histogram.end() - shift, histogram.end());
+					std::fill(histogram.begin(), histogram.begin() + shift, 0);
+				}
+			}
+			else
+			{
+				histogram_offset += offset;
+			}
+		}
+
+		double mean() const
+		{
+			return count > 0 ? sum / count : 0.0;
+		}
+
+		double stddev() const
+		{
+			if (count == 0)
+			{
+				return 0.0;
+			}
+			double const m = mean();
+			return std::sqrt(std::max(0.0, sum_sq / count - m * m));
+		}
+
+	private:
+		void AddToCoarseHistogram(double v, uint32_t n)
+		{
+			double bin = (v - histogram_offset) * histogram_scale;
+			if (!(bin >= 0.0 && bin < static_cast<double>(histogram.size())))
+			{
+				Grow(v);
+				bin = (v - histogram_offset) * histogram_scale;
+			}
+			histogram[std::min(static_cast<size_t>(bin), histogram.size() - 1)] += n;
+		}
+
+		// Doubles the range of the coarse histogram towards v until it covers v
+		void Grow(double v)
+		{
+			size_t const size = histogram.size();
+			size_t const half = size / 2;
+			while (!((v - histogram_offset) * histogram_scale < static_cast<double>(size)))
+			{
+				// the range grows upwards, bins 2i and 2i + 1 become bin i
+				for (size_t i = 0; i < half; ++i)
+				{
+					histogram[i] = histogram[2 * i] + histogram[2 * i + 1];
+				}
+				std::fill(histogram.begin() + half, histogram.end(), 0);
+				histogram_scale *= 0.5;
+			}
+			while (v < histogram_offset)
+			{
+				// the range grows downwards, bins 2i and 2i + 1 become bin half + i
+				for (size_t i = size; i-- > half;)
+				{
+					histogram[i] = histogram[2 * (i - half)] + histogram[2 * (i - half) + 1];
+				}
+				std::fill(histogram.begin(), histogram.begin() + half, 0);
+				histogram_offset -= static_cast<double>(size) / histogram_scale;
+				histogram_scale *= 0.5;
+			}
+		}
+	};
+
+	// Statistics of the decoded image, collected while
+	// the output pixels are written
+	struct ImageStatistics
+	{
+		bool valid = false;
+
+		// whether the input data contained negative values, in
+		// which case the signed to unsigned offset was applied
+		bool negative = false;
+
+		int nc = 0;
+		std::array<ChannelStatistics, 3> channels;
+
+		// An exact histogram has histogram_size bins, one per value. Otherwise
+		// a coarse histogram over [lo, hi), which grows as needed, is collected.
+		void Reset(int num_channels, bool exact, size_t histogram_size, double lo = 0.0, double hi = 1.0)
+		{
+			valid = false;
+			negative = false;
+			nc = num_channels;
+			for (int c = 0; c < static_cast<int>(channels.size()); ++c)
+			{
+				ChannelStatistics& channel = channels[c];
+				channel.min = std::numeric_limits<double>::max();
+				channel.max = std::numeric_limits<double>::lowest();
+				channel.sum = 0;
+				channel.sum_sq = 0;
+				channel.count = 0;
+				channel.exact = exact;
+				channel.histogram_offset = exact ? 0.0 : lo;
+				channel.histogram_scale = exact || !(hi > lo) ? 1.0 : histogram_size / (hi - lo);
+				// assign keeps the capacity of a previous load
+				channel.histogram.assign(c < nc ? histogram_size : 0, 0);
+			}
+		}
+
+		double min() const
+		{
+			double v = std::numeric_limits<double>::max();
+			for (int c = 0; c < nc; ++c)
+			{
+				v = std::min(v, channels[c].min);
+			}
+			return v;
+		}
+
+		double max() const
+		{
+			double v = std::numeric_limits<double>::lowest();
+			for (int c = 0; c < nc; ++c)
+			{
+				v = std::max(v, channels[c].max);
+			}
+			return v;
+		}
+	};
+
+}
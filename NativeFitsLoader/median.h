@@ -0,0 +1,562 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "histogram.h"
+#include "imagestatistics.h"
+
+namespace Processing
+{
+
+	// Number of bins used to locate a value before refinement
+	size_t const median_histogram_size = 65536;
+
+	struct MedianStatistics
+	{
+		float median = 0.0f;
+
+		// median absolute deviation from the median, unscaled
+		float mad = 0.0f;
+
+		float min = 0.0f;
+		float max = 0.0f;
+	};
+
+	// Returns the bin that contains the k-th smallest value and
+	// stores the rank of that value within the bin in rank
+	inline size_t FindHistogramRank(uint32_t const* histogram, size_t histogram_size, size_t k, size_t* rank)
+	{
+		size_t cumulative = 0;
+		for (size_t i = 0; i < histogram_size; ++i)
+		{
+			if (cumulative + histogram[i] > k)
+			{
+				*rank = k - cumulative;
+				return i;
+			}
+			cumulative += histogram[i];
+		}
+		*rank = 0;
+		return histogram_size - 1;
+	}
+
+	// Range and number of the values of data[0, n) that are not NaN or infinite,
+	// count is optional. If there are none, min is above max.
+	template<typename T>
+	void ComputeMinMax(T const* data, size_t n, T* min, T* max, size_t* count = nullptr)
+	{
+		size_t const num_blocks = GetBlockCount(n);
+
+		// seeded from the limits instead of the first value, which may be NaN
+		T const initial_min = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+		T const initial_max = std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+
+		std::vector<T> block_min(num_blocks, initial_min);
+		std::vector<T> block_max(num_blocks, initial_max);
+		std::vector<size_t> block_count(num_blocks, 0);
+
+		ParallelForBlocks(n, num_blocks, [&](size_t block, size_t start, size_t end)
+			{
+				T lo = initial_min;
+				T hi = initial_max;
+				size_t finite = 0;
+				for (size_t i = start; i < end; ++i)
+				{
+					T const v = data[i];
+					if (std::is_floating_point<T>::value && !std::isfinite(static_cast<double>(v)))
+					{
+						continue;
+					}
+					lo = v < lo ? v : lo;
+					hi = v > hi ? v : hi;
+					++finite;
+				}
+				block_min[block] = lo;
+				block_max[block] = hi;
+				block_count[block] = finite;
+			});
+
+		*min = *std::min_element(block_min.begin(), block_min.end());
+		*max = *std::max_element(block_max.begin(), block_max.end());
+
+		if (count != nullptr)
+		{
+			*count = 0;
+			for (size_t const block : block_count)
+			{
+				*count += block;
+			}
+		}
+	}
+
+	// Number of values up to which a selection collects the values
+	// of its range and selects from those, instead of refining further
+	size_t const median_collect_limit = 65536;
+
+	// Exact k-th smallest of the values in [lo, hi] and beyond, where k counts
+	// from the smallest of all values. The values are read in batches through
+	// fetch(start, count, buffer), which returns a pointer to the batch and
+	// may use buffer as storage. Values that are NaN or infinite are ignored,
+	// as in the decoder statistics, and k must only count the other values.
+	//
+	// Each pass counts the values below the range and looks at those inside.
+	// Once the range holds few enough values, these are collected and the
+	// value selected from them. Otherwise they are binned into a histogram and
+	// the range narrowed to the smallest and largest value of the bin that
+	// holds the k-th value, so that a bin of many equal values ends the search
+	// with the next pass instead of being collected. The rank always follows
+	// from the counts, so a range that misses the k-th value due to rounding
+	// is widened and the pass repeated. expected is the number of values the
+	// range is thought to hold.
+	template<typename V, typename Fetch>
+	V SelectKth(size_t n, size_t k, double lo, double hi, size_t expected, Fetch const& fetch)
+	{
+		size_t const num_blocks = GetBlockCount(n);
+
+		std::vector<size_t> block_below(num_blocks);
+		std::vector<size_t> block_inside(num_blocks);
+		std::vector<double> block_min(num_blocks);
+		std::vector<double> block_max(num_blocks);
+		std::vector<std::vector<V>> block_values(num_blocks);
+		std::vector<uint32_t> histogram(median_histogram_size);
+
+		for (;;)
+		{
+			bool const collect = expected <= median_collect_limit;
+			double const scale = hi > lo ? median_histogram_size / (hi - lo) : 0.0;
+			int32_t const max_bin = static_cast<int32_t>(median_histogram_size - 1);
+
+			// a block with more values than expected for the whole range
+			// stops collecting, the range is then binned instead
+			size_t const block_limit = 2 * median_collect_limit;
+
+			std::vector<HistogramAccumulator> accumulators;
+			if (!collect)
+			{
+				accumulators.assign(num_blocks, HistogramAccumulator(median_histogram_size));
+			}
+
+			ParallelForBlocks(n, num_blocks, [&](size_t block, size_t start, size_t end)
+				{
+					V buffer[histogram_batch_size];
+					int32_t bins[histogram_batch_size];
+					std::vector<V>& values = block_values[block];
+					values.clear();
+					size_t below = 0;
+					size_t inside = 0;
+					double min = std::numeric_limits<double>::infinity();
+					double max = -std::numeric_limits<double>::infinity();
+					for (size_t i = start; i < end; i += histogram_batch_size)
+					{
+						size_t const count = std::min(histogram_batch_size, end - i);
+						V const* batch = fetch(i, count, buffer);
+						size_t num_bins = 0;
+						for (size_t j = 0; j < count; ++j)
+						{
+							double const v = static_cast<double>(batch[j]);
+							if (!std::isfinite(v))
+							{
+								continue;
+							}
+							if (v < lo)
+							{
+								++below;
+							}
+							else if (v <= hi)
+							{
+								++inside;
+								min = std::min(min, v);
+								max = std::max(max, v);
+								if (collect)
+								{
+									if (values.size() < block_limit)
+									{
+										values.push_back(batch[j]);
+									}
+								}
+								else
+								{
+									bins[num_bins++] = std::min(max_bin, static_cast<int32_t>((v - lo) * scale));
+								}
+							}
+						}
+						if (num_bins != 0)
+						{
+							accumulators[block].Add(bins, num_bins);
+						}
+					}
+					block_below[block] = below;
+					block_inside[block] = inside;
+					block_min[block] = min;
+					block_max[block] = max;
+				});
+
+			size_t below = 0;
+			size_t inside = 0;
+			double min = std::numeric_limits<double>::infinity();
+			double max = -std::numeric_limits<double>::infinity();
+			for (size_t block = 0; block < num_blocks; ++block)
+			{
+				below += block_below[block];
+				inside += block_inside[block];
+				min = std::min(min, block_min[block]);
+				max = std::max(max, block_max[block]);
+			}
+
+			double const width = hi > lo ? hi - lo : 1.0;
+			if (k < below)
+			{
+				lo -= width;
+				expected = std::numeric_limits<size_t>::max();
+				continue;
+			}
+			if (k >= below + inside)
+			{
+				hi += width;
+				expected = std::numeric_limits<size_t>::max();
+				continue;
+			}
+
+			size_t const rank = k - below;
+
+			if (min == max)
+			{
+				// every value of the range is the k-th value
+				return static_cast<V>(min);
+			}
+
+			if (collect && inside <= block_limit)
+			{
+				std::vector<V> values;
+				values.reserve(inside);
+				for (auto const& block : block_values)
+				{
+					values.insert(values.end(), block.begin(), block.end());
+				}
+
+				std::nth_element(values.begin(), values.begin() + rank, values.end());
+				return values[rank];
+			}
+
+			if (collect)
+			{
+				// more values than expected, bin them instead
+				lo = min;
+				hi = max;
+				expected = inside;
+				continue;
+			}
+
+			std::fill(histogram.begin(), histogram.end(), 0);
+			for (auto const& accumulator : accumulators)
+			{
+				accumulator.MergeInto(histogram.data());
+			}
+
+			size_t bin_rank;
+			size_t const bin = FindHistogramRank(histogram.data(), median_histogram_size, rank, &bin_rank);
+
+			// the values of the bin lie within its bounds, clamped to those of the
+			// range, and the bin of the largest value is the last one
+			double const bin_lo = std::max(min, lo + bin / scale);
+			double const bin_hi = bin == median_histogram_size - 1 ? max : std::min(max, lo + (bin + 1) / scale);
+
+			lo = bin_lo;
+			hi = bin_hi;
+			expected = histogram[bin];
+		}
+	}
+
+	// Exact k-th smallest of the values, which are in [lo, hi]
+	template<typename V, typename Fetch>
+	V SelectKth(size_t n, size_t k, double lo, double hi, Fetch const& fetch)
+	{
+		return SelectKth<V>(n, k, lo, hi, n, fetch);
+	}
+
+	// Exact k-th smallest of the values that were counted by the coarse histogram
+	// of statistics, whose bin of the value gives the range to start from
+	template<typename V, typename Fetch>
+	V SelectKth(size_t n, size_t k, Loader::ChannelStatistics const& statistics, Fetch const& fetch)
+	{
+		std::vector<uint32_t> const& histogram = statistics.histogram;
+
+		size_t rank;
+		size_t const bin = FindHistogramRank(histogram.data(), histogram.size(), k, &rank);
+
+		double const bin_width = 1.0 / statistics.histogram_scale;
+		double const lo = statistics.histogram_offset + bin * bin_width;
+
+		return SelectKth<V>(n, k, std::max(statistics.min, lo), std::min(statistics.max, lo + bin_width), histogram[bin], fetch);
+	}
+
+	// Exact median and MAD of integer values given their histogram
+	// with one bin per value, i.e. histogram[v] is the count of v
+	inline MedianStatistics ComputeMedianStatistics(uint32_t const* histogram, size_t histogram_size)
+	{
+		MedianStatistics result;
+
+		size_t n = 0;
+		size_t min = histogram_size;
+		size_t max = 0;
+		for (size_t v = 0; v < histogram_size; ++v)
+		{
+			if (histogram[v] != 0)
+			{
+				n += histogram[v];
+				min = std::min(min, v);
+				max = v;
+			}
+		}
+
+		if (n == 0)
+		{
+			return result;
+		}
+
+		size_t const middle = n / 2;
+
+		size_t rank;
+		size_t const median = FindHistogramRank(histogram, histogram_size, middle, &rank);
+
+		std::vector<uint32_t> deviations(histogram_size, 0);
+		for (size_t v = min; v <= max; ++v)
+		{
+			deviations[v > median ? v - median : median - v] += histogram[v];
+		}
+
+		result.median = static_cast<float>(median);
+		result.mad = static_cast<float>(FindHistogramRank(deviations.data(), histogram_size, middle, &rank));
+		result.min = static_cast<float>(min);
+		result.max = static_cast<float>(max);
+		return result;
+	}
+
+	// Exact median and MAD of all n values. The median is the upper median,
+	// i.e. the (n / 2)-th smallest value, and likewise for the MAD. statistics
+	// is optional and must have been collected from the values by the decoder,
+	// its histogram and range then replace the passes that would find them.
+	template<typename T>
+	MedianStatistics ComputeMedianStatistics(T const* data, size_t n, Loader::ChannelStatistics const* statistics = nullptr)
+	{
+		MedianStatistics result;
+
+		// the decoder only counts finite values
+		size_t const count = statistics != nullptr ? static_cast<size_t>(statistics->count) : n;
+		if (count == 0)
+		{
+			return result;
+		}
+
+		size_t middle = count / 2;
+
+		if (statistics != nullptr && statistics->exact)
+		{
+			return ComputeMedianStatistics(statistics->histogram.data(), statistics->histogram.size());
+		}
+
+		if (std::is_integral<T>::value && sizeof(T) <= 2)
+		{
+			// Every value has its own bin, so median, MAD
+			// and range all follow from a single histogram
+			std::vector<uint32_t> histogram(median_histogram_size, 0);
+			ComputeHistogram(data, n, 0.0f, 1.0f, histogram.data(), median_histogram_size);
+			return ComputeMedianStatistics(histogram.data(), median_histogram_size);
+		}
+
+		T median;
+		if (statistics != nullptr && !statistics->histogram.empty())
+		{
+			result.min = static_cast<float>(statistics->min);
+			result.max = static_cast<float>(statistics->max);
+
+			median = SelectKth<T>(n, middle, *statistics, [data](size_t start, size_t, T*) { return data + start; });
+		}
+		else
+		{
+			T min, max;
+			size_t finite;
+			ComputeMinMax(data, n, &min, &max, &finite);
+			if (finite == 0)
+			{
+				return result;
+			}
+
+			result.min = static_cast<float>(min);
+			result.max = static_cast<float>(max);
+
+			middle = finite / 2;
+			median = SelectKth<T>(n, middle, min, max, [data](size_t start, size_t, T*) { return data + start; });
+		}
+		result.median = static_cast<float>(median);
+
+		float const m = result.median;
+		float const max_deviation = std::max(result.max - m, m - result.min);
+
+		result.mad = SelectKth<float>(n, middle, 0.0, max_deviation, [data, m](size_t start, size_t count, float* buffer)
+			{
+				for (size_t j = 0; j < count; ++j)
+				{
+					buffer[j] = std::abs(static_cast<float>(data[start + j]) - m);
+				}
+				return static_cast<float const*>(buffer);
+			});
+
+		return result;
+	}
+
+	// Mean of |x - center| over integer values given their histogram
+	// with one bin per value, i.e. histogram[v] is the count of v
+	inline double ComputeMeanAbsoluteDeviation(uint32_t const* histogram, size_t histogram_size, double center)
+	{
+		double sum = 0.0;
+		uint64_t n = 0;
+		for (size_t v = 0; v < histogram_size; ++v)
+		{
+			if (histogram[v] != 0)
+			{
+				sum += histogram[v] * std::abs(center - static_cast<double>(v));
+				n += histogram[v];
+			}
+		}
+		return n != 0 ? sum / n : 0.0;
+	}
+
+	// Mean of |x - center| over all n values
+	template<typename T>
+	double ComputeMeanAbsoluteDeviation(T const* data, size_t n, double center)
+	{
+		if (n == 0)
+		{
+			return 0.0;
+		}
+
+		size_t const num_blocks = GetBlockCount(n);
+		std::vector<double> block_sums(num_blocks, 0.0);
+
+		ParallelForBlocks(n, num_blocks, [&](size_t block, size_t start, size_t end)
+			{
+				double sum = 0.0;
+				for (size_t i = start; i < end; ++i)
+				{
+					sum += std::abs(center - static_cast<double>(data[i]));
+				}
+				block_sums[block] = sum;
+			});
+
+		double sum = 0.0;
+		for (double const block_sum : block_sums)
+		{
+			sum += block_sum;
+		}
+		return sum / n;
+	}
+
+
+	// Sum of the squares and number of the values with |x| < threshold in
+	// data[0, n). Values outside are masked out instead of branched over.
+	inline double AddClippedSquares(float const* data, size_t n, float threshold, size_t* count)
+	{
+		double sum = 0.0;
+		size_t inside_count = 0;
+
+		size_t i = 0;
+#ifdef PROCESSING_SSE2
+		__m128 const abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		__m128 const limit = _mm_set1_ps(threshold);
+		__m128d sum_lo = _mm_setzero_pd();
+		__m128d sum_hi = _mm_setzero_pd();
+		__m128i counts = _mm_setzero_si128();
+		for (; i + 4 <= n; i += 4)
+		{
+			__m128 const v = _mm_loadu_ps(data + i);
+			__m128 const inside = _mm_cmplt_ps(_mm_and_ps(v, abs_mask), limit);
+			__m128 const squares = _mm_and_ps(_mm_mul_ps(v, v), inside);
+			sum_lo = _mm_add_pd(sum_lo, _mm_cvtps_pd(squares));
+			sum_hi = _mm_add_pd(sum_hi, _mm_cvtps_pd(_mm_movehl_ps(squares, squares)));
+
+			// the mask is -1 in every lane that is inside
+			counts = _mm_sub_epi32(counts, _mm_castps_si128(inside));
+		}
+
+		double sums[2];
+		_mm_storeu_pd(sums, _mm_add_pd(sum_lo, sum_hi));
+		sum = sums[0] + sums[1];
+
+		uint32_t lane_counts[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(lane_counts), counts);
+		inside_count = static_cast<size_t>(lane_counts[0]) + lane_counts[1] + lane_counts[2] + lane_counts[3];
+#endif
+		for (; i < n; ++i)
+		{
+			float const value = data[i];
+			if (std::abs(value) < threshold)
+			{
+				++inside_count;
+				sum += value * value;
+			}
+		}
+
+		*count = inside_count;
+		return sum;
+	}
+
+	// Sum of the squares and number of the values with |x| < threshold,
+	// computed in parallel blocks whose results are added in order
+	inline double ComputeClippedSumOfSquares(float const* data, size_t n, double threshold, size_t* count)
+	{
+		// smallest float that is not below the threshold, so that the
+		// float comparison selects exactly the values below threshold
+		float limit = std::numeric_limits<float>::infinity();
+		if (threshold <= std::numeric_limits<float>::max())
+		{
+			limit = static_cast<float>(threshold);
+			if (static_cast<double>(limit) < threshold)
+			{
+				limit = std::nextafter(limit, std::numeric_limits<float>::infinity());
+			}
+		}
+
+		size_t const num_blocks = GetBlockCount(n);
+		std::vector<double> block_sums(num_blocks, 0.0);
+		std::vector<size_t> block_counts(num_blocks, 0);
+
+		ParallelForBlocks(n, num_blocks, [&](size_t block, size_t start, size_t end)
+			{
+				block_sums[block] = AddClippedSquares(data + start, end - start, limit, &block_counts[block]);
+			});
+
+		double sum = 0.0;
+		*count = 0;
+		for (size_t block = 0; block < num_blocks; ++block)
+		{
+			sum += block_sums[block];
+			*count += block_counts[block];
+		}
+		return sum;
+	}
+
+}
@@ -0,0 +1,535 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include "photometry.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define PHOTOMETRY_AVX
+#define PHOTOMETRY_AVX_CPUID
+#elif defined(__AVX__)
+#include <immintrin.h>
+#define PHOTOMETRY_AVX
+#endif
+
+namespace Photometry
+{
+
+	template<int exponent>
+	inline double IntegerPower(double value)
+	{
+		double result = 1.0;
+		for (int i = 0; i < exponent; ++i)
+		{
+			result *= value;
+		}
+		return result;
+	}
+
+	// d^-beta of the Moffat profile for beta = beta_x2 / 2, without std::pow
+	template<int beta_x2>
+	inline double MoffatProfile(double d)
+	{
+		double power = IntegerPower<beta_x2 / 2>(d);
+		if (beta_x2 % 2 != 0)
+		{
+			power *= std::sqrt(d);
+		}
+		return 1.0 / power;
+	}
+
+	// Elliptical Moffat profile S0 + S1 * d^-beta with
+	// d = 1 + A * dx^2 + B * dy^2 + C * dx * dy
+	struct MoffatShape
+	{
+		double S0, S1;
+		double x0;
+		double A, B, C;
+	};
+
+	// Residuals data - S0 - S1 * d^-beta of one row of the fitted crop, starting at x_start
+	template<int beta_x2>
+	inline void ComputeMoffatResidualsScalar(double const* data, int w, int x_start, double dy, MoffatShape const& shape, double* residuals)
+	{
+		double bdy = shape.B * dy * dy;
+		double cdy = shape.C * dy;
+
+		for (int x = x_start; x < w; ++x)
+		{
+			double dx = x - shape.x0;
+			residuals[x] = data[x] - shape.S0 - shape.S1 * MoffatProfile<beta_x2>(1.0 + shape.A * dx * dx + bdy + cdy * dx);
+		}
+	}
+
+#ifdef PHOTOMETRY_AVX
+	inline bool IsAVXSupported()
+	{
+#ifdef PHOTOMETRY_AVX_CPUID
+		static bool const supported = []()
+		{
+			int info[4];
+			__cpuid(info, 1);
+			bool const osxsave = (info[2] & (1 << 27)) != 0;
+			bool const avx = (info[2] & (1 << 28)) != 0;
+
+			// the OS must also save the YMM registers
+			return osxsave && avx && (_xgetbv(0) & 6) == 6;
+		}();
+		return supported;
+#else
+		return true;
+#endif
+	}
+
+	template<int exponent>
+	inline __m256d IntegerPower(__m256d value)
+	{
+		__m256d result = _mm256_set1_pd(1.0);
+		for (int i = 0; i < exponent; ++i)
+		{
+			result = _mm256_mul_pd(result, value);
+		}
+		return result;
+	}
+
+	template<int beta_x2>
+	inline __m256d MoffatProfile(__m256d d)
+	{
+		__m256d power = IntegerPower<beta_x2 / 2>(d);
+		if (beta_x2 % 2 != 0)
+		{
+			power = _mm256_mul_pd(power, _mm256_sqrt_pd(d));
+		}
+		return _mm256_div_pd(_mm256_set1_pd(1.0), power);
+	}
+
+	// Four pixels at a time with the same operations in the same order as the
+	// scalar version and without fused multiply-adds, so both give identical results
+	template<int beta_x2>
+	inline void ComputeMoffatResidualsAVX(double const* data, int w, double dy, MoffatShape const& shape, double* residuals)
+	{
+		__m256d const one = _mm256_set1_pd(1.0);
+		__m256d const S0 = _mm256_set1_pd(shape.S0);
+		__m256d const S1 = _mm256_set1_pd(shape.S1);
+		__m256d const A = _mm256_set1_pd(shape.A);
+		__m256d const bdy = _mm256_set1_pd(shape.B * dy * dy);
+		__m256d const cdy = _mm256_set1_pd(shape.C * dy);
+		__m256d const x0 = _mm256_set1_pd(shape.x0);
+
+		int x = 0;
+		for (; x + 4 <= w; x += 4)
+		{
+			__m256d const dx = _mm256_sub_pd(_mm256_set_pd(x + 3.0, x + 2.0, x + 1.0, x), x0);
+
+			__m256d d = _mm256_add_pd(one, _mm256_mul_pd(_mm256_mul_pd(A, dx), dx));
+			d = _mm256_add_pd(_mm256_add_pd(d, bdy), _mm256_mul_pd(cdy, dx));
+
+			__m256d const model = _mm256_mul_pd(S1, MoffatProfile<beta_x2>(d));
+			_mm256_storeu_pd(residuals + x, _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(data + x), S0), model));
+		}
+
+		ComputeMoffatResidualsScalar<beta_x2>(data, w, x, dy, shape, residuals);
+	}
+#endif
+
+	// Residuals of one row of the fitted crop, vectorized if the CPU supports it
+	template<int beta_x2>
+	inline void ComputeMoffatResiduals(double const* data, int w, double dy, MoffatShape const& shape, double* residuals)
+	{
+#ifdef PHOTOMETRY_AVX
+		if (IsAVXSupported())
+		{
+			ComputeMoffatResidualsAVX<beta_x2>(data, w, dy, shape, residuals);
+			return;
+		}
+#endif
+		ComputeMoffatResidualsScalar<beta_x2>(data, w, 0, dy, shape, residuals);
+	}
+
+	// Number of stars that are fitted together by FitMoffatBatch, one per lane
+	int const moffat_batch_lanes = 4;
+
+	// Crops of up to moffat_batch_lanes stars, padded to a common size and
+	// interleaved so that the same pixel of all stars is adjacent in memory
+	struct MoffatBatch
+	{
+		int w = 0;
+		int h = 0;
+
+		// (y * w + x) * moffat_batch_lanes + lane, padding has weight 0
+		std::vector<double> data;
+		std::vector<double> weight;
+
+		// Center of each star's own crop, which x0 and y0 are relative to
+		double center_x[moffat_batch_lanes]{};
+		double center_y[moffat_batch_lanes]{};
+
+		// parameters[j][lane] is parameter j of MoffatParameters
+		double parameters[MoffatParameters::count][moffat_batch_lanes]{};
+
+		bool used[moffat_batch_lanes]{};
+		bool converged[moffat_batch_lanes]{};
+
+		void Resize(int width, int height)
+		{
+			w = width;
+			h = height;
+			data.assign(static_cast<size_t>(w) * h * moffat_batch_lanes, 0.0);
+			weight.assign(static_cast<size_t>(w) * h * moffat_batch_lanes, 0.0);
+			std::fill_n(used, moffat_batch_lanes, false);
+			std::fill_n(converged, moffat_batch_lanes, false);
+		}
+
+		void SetLane(int lane, double const* crop, int crop_w, int crop_h, double const* initial)
+		{
+			for (int y = 0; y < crop_h; ++y)
+			{
+				for (int x = 0; x < crop_w; ++x)
+				{
+					size_t const i = (static_cast<size_t>(y) * w + x) * moffat_batch_lanes + lane;
+					data[i] = crop[y * crop_w + x];
+					weight[i] = 1.0;
+				}
+			}
+
+			center_x[lane] = crop_w >> 1;
+			center_y[lane] = crop_h >> 1;
+
+			for (int j = 0; j < MoffatParameters::count; ++j)
+			{
+				parameters[j][lane] = initial[j];
+			}
+
+			used[lane] = true;
+		}
+	};
+
+	// Sum of squared residuals and the normal equations J^T J (upper triangle,
+	// row by row) and J^T r of all lanes, computed in one pass over the pixels.
+	// The loops over the lanes are independent so that they are vectorized.
+	template<int beta_x2>
+	inline void AccumulateMoffatBatch(MoffatBatch const& batch, double const (&parameters)[MoffatParameters::count][moffat_batch_lanes],
+		double (&chi2)[moffat_batch_lanes], double (&jtj)[MoffatParameters::count * (MoffatParameters::count + 1) / 2][moffat_batch_lanes], double (&jtr)[MoffatParameters::count][moffat_batch_lanes])
+	{
+		int const n = MoffatParameters::count;
+		int const lanes = moffat_batch_lanes;
+
+		double S0[lanes], S1[lanes], x0[lanes], y0[lanes];
+		double s[lanes], c[lanes], A[lanes], B[lanes], C[lanes];
+		double dax[lanes], day[lanes], dtheta[lanes];
+
+		for (int l = 0; l < lanes; ++l)
+		{
+			S0[l] = parameters[0][l];
+			S1[l] = parameters[1][l];
+			x0[l] = batch.center_x[l] + parameters[2][l];
+			y0[l] = batch.center_y[l] + parameters[3][l];
+
+			double const alpha_x = parameters[4][l];
+			double const alpha_y = parameters[5][l];
+			double const ix2 = 1.0 / (alpha_x * alpha_x);
+			double const iy2 = 1.0 / (alpha_y * alpha_y);
+
+			s[l] = std::sin(parameters[6][l]);
+			c[l] = std::cos(parameters[6][l]);
+
+			A[l] = c[l] * c[l] * ix2 + s[l] * s[l] * iy2;
+			B[l] = s[l] * s[l] * ix2 + c[l] * c[l] * iy2;
+			C[l] = 2 * s[l] * c[l] * (ix2 - iy2);
+
+			dax[l] = -2.0 * ix2 / alpha_x;
+			day[l] = -2.0 * iy2 / alpha_y;
+			dtheta[l] = 2.0 * (ix2 - iy2);
+		}
+
+		std::fill_n(chi2, lanes, 0.0);
+		std::fill_n(&jtj[0][0], n * (n + 1) / 2 * lanes, 0.0);
+		std::fill_n(&jtr[0][0], n * lanes, 0.0);
+
+		double const beta = beta_x2 * 0.5;
+
+		double const* data_ptr = batch.data.data();
+		double const* weight_ptr = batch.weight.data();
+
+		double r[lanes];
+		double J[n][lanes];
+
+		for (int y = 0; y < batch.h; ++y)
+		{
+			for (int x = 0; x < batch.w; ++x, data_ptr += lanes, weight_ptr += lanes)
+			{
+				// Same derivatives as Extractor::FitMoffat, weighted so that padding does not count
+				for (int l = 0; l < lanes; ++l)
+				{
+					double const dx = x - x0[l];
+					double const dy = y - y0[l];
+					double const d = 1.0 + A[l] * dx * dx + B[l] * dy * dy + C[l] * dx * dy;
+					double const z = MoffatProfile<beta_x2>(d);
+					double const g = beta * S1[l] * z / d * weight_ptr[l];
+
+					double const u = c[l] * dx + s[l] * dy;
+					double const v = s[l] * dx - c[l] * dy;
+
+					r[l] = (data_ptr[l] - S0[l] - S1[l] * z) * weight_ptr[l];
+
+					J[0][l] = -weight_ptr[l];
+					J[1][l] = -z * weight_ptr[l];
+					J[2][l] = -g * (2.0 * A[l] * dx + C[l] * dy);
+					J[3][l] = -g * (2.0 * B[l] * dy + C[l] * dx);
+					J[4][l] = g * dax[l] * u * u;
+					J[5][l] = g * day[l] * v * v;
+					J[6][l] = g * dtheta[l] * (s[l] * c[l] * (dy * dy - dx * dx) + (c[l] * c[l] - s[l] * s[l]) * dx * dy);
+				}
+
+				for (int l = 0; l < lanes; ++l)
+				{
+					chi2[l] += r[l] * r[l];
+				}
+
+				for (int a = 0; a < n; ++a)
+				{
+					for (int l = 0; l < lanes; ++l)
+					{
+						jtr[a][l] += J[a][l] * r[l];
+					}
+				}
+
+				int k = 0;
+				for (int a = 0; a < n; ++a)
+				{
+					for (int b = a; b < n; ++b, ++k)
+					{
+						for (int l = 0; l < lanes; ++l)
+						{
+							jtj[k][l] += J[a][l] * J[b][l];
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Solves (J^T J + lambda * diag(J^T J)) delta = -J^T r of one lane by
+	// Cholesky decomposition, false if the system is not positive definite
+	inline bool SolveMoffatBatchStep(double const (&jtj)[MoffatParameters::count * (MoffatParameters::count + 1) / 2][moffat_batch_lanes], double const (&jtr)[MoffatParameters::count][moffat_batch_lanes],
+		int lane, double lambda, double* delta)
+	{
+		int const n = MoffatParameters::count;
+
+		double a[n][n];
+		double max_diagonal = 0.0;
+
+		int index = 0;
+		for (int i = 0; i < n; ++i)
+		{
+			for (int j = i; j < n; ++j, ++index)
+			{
+				a[i][j] = a[j][i] = jtj[index][lane];
+			}
+			max_diagonal = std::max(max_diagonal, a[i][i]);
+		}
+
+		// parameters the residuals do not depend on are still damped
+		double const min_diagonal = 1e-12 * max_diagonal;
+		for (int i = 0; i < n; ++i)
+		{
+			a[i][i] += lambda * std::max(a[i][i], min_diagonal);
+		}
+
+		// a = L * L^T, L is stored in the lower triangle of a
+		for (int j = 0; j < n; ++j)
+		{
+			double diagonal = a[j][j];
+			for (int k = 0; k < j; ++k)
+			{
+				diagonal -= a[j][k] * a[j][k];
+			}
+			if (!(diagonal > 0.0))
+			{
+				return false;
+			}
+			a[j][j] = std::sqrt(diagonal);
+
+			for (int i = j + 1; i < n; ++i)
+			{
+				double value = a[i][j];
+				for (int k = 0; k < j; ++k)
+				{
+					value -= a[i][k] * a[j][k];
+				}
+				a[i][j] = value / a[j][j];
+			}
+		}
+
+		double z[n];
+		for (int i = 0; i < n; ++i)
+		{
+			double value = -jtr[i][lane];
+			for (int k = 0; k < i; ++k)
+			{
+				value -= a[i][k] * z[k];
+			}
+			z[i] = value / a[i][i];
+		}
+
+		for (int i = n - 1; i >= 0; --i)
+		{
+			double value = z[i];
+			for (int k = i + 1; k < n; ++k)
+			{
+				value -= a[k][i] * delta[k];
+			}
+			delta[i] = value / a[i][i];
+		}
+
+		return true;
+	}
+
+	// Levenberg-Marquardt fit of the Moffat profiles of all stars in the batch at once.
+	// Every lane has its own damping and is masked out once it has converged, the
+	// fit ends when no lane is left. Like lmder, a lane converges once a step reduces
+	// the residuals or changes the parameters by no more than the relative tolerance.
+	// Lanes that stall or run out of iterations before that are not converged.
+	template<int beta_x2>
+	inline void FitMoffatBatch(MoffatBatch& batch, double tolerance, int max_iterations)
+	{
+		int const n = MoffatParameters::count;
+		int const lanes = moffat_batch_lanes;
+		int const nn = n * (n + 1) / 2;
+
+		double const max_lambda = 1e16;
+
+		// unused lanes repeat the first star with no weight so that they stay finite
+		for (int l = 1; l < lanes; ++l)
+		{
+			if (!batch.used[l])
+			{
+				batch.center_x[l] = batch.center_x[0];
+				batch.center_y[l] = batch.center_y[0];
+				for (int j = 0; j < n; ++j)
+				{
+					batch.parameters[j][l] = batch.parameters[j][0];
+				}
+			}
+		}
+
+		double chi2[lanes], jtj[nn][lanes], jtr[n][lanes];
+		double trial[n][lanes], trial_chi2[lanes], trial_jtj[nn][lanes], trial_jtr[n][lanes];
+
+		AccumulateMoffatBatch<beta_x2>(batch, batch.parameters, chi2, jtj, jtr);
+
+		double lambda[lanes];
+		bool active[lanes];
+		for (int l = 0; l < lanes; ++l)
+		{
+			lambda[l] = 1e-3;
+			active[l] = batch.used[l] && std::isfinite(chi2[l]);
+			batch.converged[l] = false;
+		}
+
+		for (int iteration = 0; iteration < max_iterations; ++iteration)
+		{
+			bool any_active = false;
+			for (int l = 0; l < lanes; ++l)
+			{
+				for (int j = 0; j < n; ++j)
+				{
+					trial[j][l] = batch.parameters[j][l];
+				}
+
+				if (!active[l])
+				{
+					continue;
+				}
+				any_active = true;
+
+				double delta[n];
+				if (!SolveMoffatBatchStep(jtj, jtr, l, lambda[l], delta))
+				{
+					// retried with more damping next iteration
+					continue;
+				}
+
+				for (int j = 0; j < n; ++j)
+				{
+					trial[j][l] += delta[j];
+				}
+			}
+
+			if (!any_active)
+			{
+				break;
+			}
+
+			AccumulateMoffatBatch<beta_x2>(batch, trial, trial_chi2, trial_jtj, trial_jtr);
+
+			for (int l = 0; l < lanes; ++l)
+			{
+				if (!active[l])
+				{
+					continue;
+				}
+
+				bool const valid = trial[0][l] >= 0 && trial[1][l] >= 0 && std::isfinite(trial_chi2[l]);
+				if (valid && trial_chi2[l] < chi2[l])
+				{
+					bool small_step = true;
+					for (int j = 0; j < n; ++j)
+					{
+						small_step &= std::abs(trial[j][l] - batch.parameters[j][l]) <= tolerance * (std::abs(trial[j][l]) + tolerance);
+						batch.parameters[j][l] = trial[j][l];
+						jtr[j][l] = trial_jtr[j][l];
+					}
+					for (int k = 0; k < nn; ++k)
+					{
+						jtj[k][l] = trial_jtj[k][l];
+					}
+
+					bool const small_reduction = chi2[l] - trial_chi2[l] <= tolerance * chi2[l];
+					chi2[l] = trial_chi2[l];
+					lambda[l] = std::max(lambda[l] * 0.1, 1e-12);
+
+					if (small_step || small_reduction)
+					{
+						batch.converged[l] = true;
+						active[l] = false;
+					}
+				}
+				else
+				{
+					lambda[l] *= 10.0;
+					if (lambda[l] > max_lambda)
+					{
+						// No step along the gradient reduces the residuals any further. Like
+						// lmder's statuses 4 and 6 to 8 this is not counted as converged.
+						active[l] = false;
+					}
+				}
+			}
+		}
+	}
+
+}
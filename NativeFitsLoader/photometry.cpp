@@ -20,151 +20,234 @@
 // See /GuiApp/Resources/LICENSE_PCL.txt for the PCL license.
 
 #include "photometry.h"
+#include "median.h"
+#include "scratcharena.h"
+#include "moffat.h"
 
 #include <numeric>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <type_traits>
 
 namespace Photometry
 {
 
-	void Extractor::Winsorize(std::vector<double>& values, double fraction)
+	// Buffers for the background subtracted image of Extract
+	static Processing::ScratchPool<float> work_image_pool(2);
+
+	// Mean of the values with the lowest and highest fraction of them replaced
+	// by the median. Only the tails are partitioned off instead of sorting all
+	// values, so their order is changed.
+	double Extractor::WinsorizedMean(double* values, size_t count, double fraction)
 	{
-		size_t lo = (size_t)floor(fraction * values.size());
-		size_t hi = values.size() - lo;
-		double m = SortedMedian(values);
-		for (size_t i = 0; i < lo; ++i)
-		{
-			values[i] = m;
-		}
-		for (size_t i = hi; i < values.size(); ++i)
+		size_t lo = (size_t)floor(fraction * count);
+		size_t hi = count - lo;
+		size_t middle = count / 2;
+
+		std::nth_element(values, values + middle, values + count);
+		double m = values[middle];
+		if (count % 2 == 0)
 		{
-			values[i] = m;
+			m = (m + *std::max_element(values, values + middle)) * 0.5;
 		}
-		/*for (int i = 0; i < lo; ++i)
+
+		if (lo > 0)
 		{
-			values[i] = values[lo];
+			std::nth_element(values, values + lo, values + middle);
+			std::nth_element(values + middle, values + hi, values + count);
 		}
-		for (int i = hi; i < values.size(); ++i)
-		{
-			values[i] = values[hi - 1];
-		}*/
+
+		return (std::accumulate(values + lo, values + hi, 0.0) + 2 * lo * m) / count;
+	}
+
+	int Extractor::MoffatBetaX2() const
+	{
+		return std::min(10, std::max(3, static_cast<int>(std::lround(m_parameters.psf_beta * 2))));
 	}
 
-	void Extractor::FitError(double* crop, size_t w, size_t h, FitParameters& fit, double* star_residual, double* mean_signal)
+	// Residual and mean signal of the fit for each of the given angles,
+	// all evaluated in a single pass over the crop
+	template<int beta_x2, int count>
+	void Extractor::FitError(FitParameters& fit, double const* thetas, double* star_residuals, double* mean_signals)
 	{
 		MoffatParameters& moffat = fit.moffat;
 
-		std::vector<double> adev(w * h);
-		double* adev_ptr = adev.data();
+		size_t n = static_cast<size_t>(fit.w) * fit.h;
+
+		// Deviations of each angle, reused by all stars measured on the same thread
+		thread_local std::vector<double> adev;
+		if (adev.size() < n * count)
+		{
+			adev.resize(n * count);
+		}
 
 		double x0 = (fit.w >> 1) + moffat.x0;
 		double y0 = (fit.h >> 1) + moffat.y0;
 
-		double s = std::sin(moffat.theta);
-		double c = std::cos(moffat.theta);
+		double A[count], B[count], C[count];
+		for (int k = 0; k < count; ++k)
+		{
+			double s = std::sin(thetas[k]);
+			double c = std::cos(thetas[k]);
 
-		double sx = s / moffat.alpha_x;
-		double cx = c / moffat.alpha_x;
-		double sy = s / moffat.alpha_y;
-		double cy = c / moffat.alpha_y;
+			double sx = s / moffat.alpha_x;
+			double cx = c / moffat.alpha_x;
+			double sy = s / moffat.alpha_y;
+			double cy = c / moffat.alpha_y;
 
-		double A = cx * cx + sy * sy;
-		double B = sx * sx + cy * cy;
-		double C = 2 * s * c * (1.0 / (moffat.alpha_x * moffat.alpha_x) - 1.0 / (moffat.alpha_y * moffat.alpha_y));
+			A[k] = cx * cx + sy * sy;
+			B[k] = sx * sx + cy * cy;
+			C[k] = 2 * s * c * (1.0 / (moffat.alpha_x * moffat.alpha_x) - 1.0 / (moffat.alpha_y * moffat.alpha_y));
+		}
 
 		const double* data_ptr = fit.data_ptr;
 
-		double flux = 0.0;
-		double zsum = 0.0;
+		double flux[count]{};
+		double zsum[count]{};
 
+		size_t i = 0;
 		for (int y = 0; y < fit.h; ++y)
 		{
 			double dy = y - y0;
-			double bdy = B * dy * dy;
-			double cdy = C * dy;
 
-			for (int x = 0; x < fit.w; ++x)
+			double bdy[count], cdy[count];
+			for (int k = 0; k < count; ++k)
+			{
+				bdy[k] = B[k] * dy * dy;
+				cdy[k] = C[k] * dy;
+			}
+
+			for (int x = 0; x < fit.w; ++x, ++i)
 			{
 				double dx = x - x0;
-				double data = *data_ptr++;
-				double z = 1.0 / std::pow(1 + A * dx * dx + bdy + cdy * dx, 4);
-				*adev_ptr++ = std::abs(data - moffat.S0 - moffat.S1 * z);
-				if (data > moffat.S0)
+				double data = data_ptr[i];
+
+				for (int k = 0; k < count; ++k)
 				{
-					flux += (data - moffat.S0) * z;
-					zsum += z;
+					double z = MoffatProfile<beta_x2>(1 + A[k] * dx * dx + bdy[k] + cdy[k] * dx);
+					adev[k * n + i] = std::abs(data - moffat.S0 - moffat.S1 * z);
+					if (data > moffat.S0)
+					{
+						flux[k] += (data - moffat.S0) * z;
+						zsum[k] += z;
+					}
 				}
 			}
 		}
 
-		std::sort(adev.begin(), adev.end(), std::greater<double>());
-		Winsorize(adev, 0.1);
-
-		*star_residual = std::accumulate(adev.begin(), adev.end(), 0.0) / adev.size();
-		*mean_signal = flux / zsum;
+		for (int k = 0; k < count; ++k)
+		{
+			star_residuals[k] = WinsorizedMean(&adev[k * n], n, 0.1);
+			mean_signals[k] = flux[k] / zsum[k];
+		}
 	}
 
-	int Extractor::FitMoffat(void* p, int m, int n, const double* parameters, double* fvec, int iflag)
+	template<int beta_x2>
+	int Extractor::FitMoffat(void* p, int m, int n, const double* parameters, double* fvec, double* fjac, int ldfjac, int iflag)
 	{
 		if (MoffatParameters::_S0(parameters) < 0 || MoffatParameters::_S1(parameters) < 0)
 		{
-			std::fill_n(fvec, m, std::numeric_limits<double>::max());
+			if (iflag == 1)
+			{
+				std::fill_n(fvec, m, std::numeric_limits<double>::max());
+			}
+			else
+			{
+				for (int j = 0; j < n; ++j)
+				{
+					std::fill_n(fjac + j * ldfjac, m, 0.0);
+				}
+			}
 			return 0;
 		}
 
 		FitParameters* fit = reinterpret_cast<FitParameters*>(p);
 
+		double S0 = MoffatParameters::_S0(parameters);
+		double S1 = MoffatParameters::_S1(parameters);
+
 		double x0 = (fit->w >> 1) + MoffatParameters::_x0(parameters);
 		double y0 = (fit->h >> 1) + MoffatParameters::_y0(parameters);
 
+		double alpha_x = MoffatParameters::_alpha_x(parameters);
+		double alpha_y = MoffatParameters::_alpha_y(parameters);
+
 		double s = std::sin(MoffatParameters::_theta(parameters));
 		double c = std::cos(MoffatParameters::_theta(parameters));
 
-		double sx = s / MoffatParameters::_alpha_x(parameters);
-		double cx = c / MoffatParameters::_alpha_x(parameters);
-		double sy = s / MoffatParameters::_alpha_y(parameters);
-		double cy = c / MoffatParameters::_alpha_y(parameters);
+		double sx = s / alpha_x;
+		double cx = c / alpha_x;
+		double sy = s / alpha_y;
+		double cy = c / alpha_y;
+
+		double ix2 = 1.0 / (alpha_x * alpha_x);
+		double iy2 = 1.0 / (alpha_y * alpha_y);
 
 		double A = cx * cx + sy * sy;
 		double B = sx * sx + cy * cy;
-		double C = 2 * s * c * (1.0 / (MoffatParameters::_alpha_x(parameters) * MoffatParameters::_alpha_x(parameters)) - 1.0 / (MoffatParameters::_alpha_y(parameters) * MoffatParameters::_alpha_y(parameters)));
+		double C = 2 * s * c * (ix2 - iy2);
 
 		const double* data_ptr = fit->data_ptr;
 
+		if (iflag == 1)
+		{
+			MoffatShape const shape{ S0, S1, x0, A, B, C };
+			for (int y = 0; y < fit->h; ++y)
+			{
+				ComputeMoffatResiduals<beta_x2>(data_ptr + y * fit->w, fit->w, y - y0, shape, fvec + y * fit->w);
+			}
+			return 0;
+		}
+
+		// Derivatives of the residual data - S0 - S1 * d^-beta where
+		// d = 1 + A * dx^2 + B * dy^2 + C * dx * dy. The derivatives of d
+		// with respect to the widths and the angle simplify to squares of
+		// the rotated coordinates.
+		double dax = -2.0 * ix2 / alpha_x;
+		double day = -2.0 * iy2 / alpha_y;
+		double dtheta = 2.0 * (ix2 - iy2);
+
+		double* jac_S0 = fjac;
+		double* jac_S1 = fjac + ldfjac;
+		double* jac_x0 = fjac + 2 * ldfjac;
+		double* jac_y0 = fjac + 3 * ldfjac;
+		double* jac_alpha_x = fjac + 4 * ldfjac;
+		double* jac_alpha_y = fjac + 5 * ldfjac;
+		double* jac_theta = fjac + 6 * ldfjac;
+
+		double beta = beta_x2 * 0.5;
+
+		int i = 0;
 		for (int y = 0; y < fit->h; ++y)
 		{
 			double dy = y - y0;
-			double bdy = B * dy * dy;
-			double cdy = C * dy;
 
-			for (int x = 0; x < fit->w; ++x)
+			for (int x = 0; x < fit->w; ++x, ++i)
 			{
 				double dx = x - x0;
-				*fvec++ = std::abs(*data_ptr++ - MoffatParameters::_S0(parameters) - MoffatParameters::_S1(parameters) / std::pow(1.0 + A * dx * dx + bdy + cdy * dx, 4));
+				double d = 1.0 + A * dx * dx + B * dy * dy + C * dx * dy;
+				double z = MoffatProfile<beta_x2>(d);
+
+				// derivative of the residual with respect to d
+				double g = beta * S1 * z / d;
+
+				double u = c * dx + s * dy;
+				double v = s * dx - c * dy;
+
+				jac_S0[i] = -1.0;
+				jac_S1[i] = -z;
+				jac_x0[i] = -g * (2.0 * A * dx + C * dy);
+				jac_y0[i] = -g * (2.0 * B * dy + C * dx);
+				jac_alpha_x[i] = g * dax * u * u;
+				jac_alpha_y[i] = g * day * v * v;
+				jac_theta[i] = g * dtheta * (s * c * (dy * dy - dx * dx) + (c * c - s * s) * dx * dy);
 			}
 		}
 
 		return 0;
 	}
 
-	template<typename T>
-	double Extractor::SortedMedian(std::vector<T>& sorted_values)
-	{
-		size_t count = sorted_values.size();
-		if (count <= 1)
-		{
-			return sorted_values[0];
-		}
-		else if (count % 2 == 0)
-		{
-			size_t half = count / 2 - 1;
-			return (sorted_values[half] + sorted_values[half + 1]) * 0.5;
-		}
-		else
-		{
-			return sorted_values[(count - 1) / 2];
-		}
-	}
-
 	template<typename T>
 	double Extractor::Median(std::vector<T>& values)
 	{
@@ -182,7 +265,42 @@ namespace Photometry
 		return begin[middle];
 	}
 
-	bool Extractor::FitPSF(std::valarray<float>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSF* psf, int* status)
+	// Calls f with std::integral_constant<int, beta_x2> for the Moffat models that are instantiated
+	template<typename F>
+	static bool DispatchMoffatBeta(int beta_x2, F&& f)
+	{
+		switch (beta_x2)
+		{
+		case 3:
+			return f(std::integral_constant<int, 3>());
+		case 4:
+			return f(std::integral_constant<int, 4>());
+		case 5:
+			return f(std::integral_constant<int, 5>());
+		case 6:
+			return f(std::integral_constant<int, 6>());
+		case 7:
+			return f(std::integral_constant<int, 7>());
+		case 9:
+			return f(std::integral_constant<int, 9>());
+		case 10:
+			return f(std::integral_constant<int, 10>());
+		default:
+			return f(std::integral_constant<int, 8>());
+		}
+	}
+
+	template<typename T>
+	bool Extractor::FitPSF(std::valarray<T>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSF* psf, int* status)
+	{
+		return DispatchMoffatBeta(MoffatBetaX2(), [&](auto beta_x2)
+			{
+				return FitMoffatPSF<decltype(beta_x2)::value>(image, image_width, x, y, xmin, ymin, xmax, ymax, psf, status);
+			});
+	}
+
+	template<typename T>
+	void Extractor::CropPSF(std::valarray<T>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSFCrop* psf_crop)
 	{
 		size_t x1 = static_cast<size_t>(floor(xmin));
 		size_t y1 = static_cast<size_t>(floor(ymin));
@@ -192,7 +310,8 @@ namespace Photometry
 		size_t w = x2 - x1;
 		size_t h = y2 - y1;
 
-		std::valarray<double> crop(w * h);
+		std::vector<double>& crop = psf_crop->data;
+		crop.resize(w * h);
 
 		{
 			double* crop_ptr = &crop[0];
@@ -256,33 +375,35 @@ namespace Photometry
 
 		background *= 0.25f;
 
+		psf_crop->x1 = x1;
+		psf_crop->y1 = y1;
+		psf_crop->w = w;
+		psf_crop->h = h;
+
+		MoffatParameters initial;
+		initial.S0 = background;
+		initial.S1 = *std::max_element(crop.begin(), crop.end()) - background;
+		initial.x0 = x - (x1 + x2) * 0.5;
+		initial.y0 = y - (y1 + y2) * 0.5;
+		initial.alpha_x = initial.alpha_y = 0.15 * 0.5 * ((xmax - xmin) + (ymax - ymin));
+		initial.theta = 0;
+		std::copy_n(initial.parameters, MoffatParameters::count, psf_crop->parameters);
+	}
+
+	template<int beta_x2>
+	bool Extractor::FinishPSF(PSFCrop& crop, double const* fitted, PSF* psf)
+	{
+		size_t w = crop.w;
+		size_t h = crop.h;
+
 		FitParameters parameters;
-		parameters.data_ptr = &crop[0];
+		parameters.data_ptr = crop.data.data();
 		parameters.w = static_cast<int>(w);
 		parameters.h = static_cast<int>(h);
-		parameters.moffat.S0 = background;
-		parameters.moffat.S1 = crop.max() - background;
-		parameters.moffat.x0 = x - (x1 + x2) * 0.5;
-		parameters.moffat.y0 = y - (y1 + y2) * 0.5;
-		parameters.moffat.alpha_x = parameters.moffat.alpha_y = 0.15 * 0.5 * ((xmax - xmin) + (ymax - ymin));
-		parameters.moffat.theta = 0;
-		parameters.moffat.beta = 4;
-
-		int m = static_cast<int>(crop.size());
-		int n = 8;
-
-		std::valarray<double> fvec(m);
-		std::valarray<int> iwa(n);
-		std::valarray<double> wa(m * n + 5 * n + m);
-
-		*status = lmdif1(Extractor::FitMoffat, &parameters, m, n, parameters.moffat.parameters, &fvec[0], 1.0e-08, &iwa[0], &wa[0], static_cast<int>(wa.size()));
-		if (*status != 1 && *status != 2 && *status != 3)
-		{
-			return false;
-		}
+		std::copy_n(fitted, MoffatParameters::count, parameters.moffat.parameters);
 
-		psf->x = x1 + (w >> 1) + parameters.moffat.x0;
-		psf->y = y1 + (h >> 1) + parameters.moffat.y0;
+		psf->x = crop.x1 + (w >> 1) + parameters.moffat.x0;
+		psf->y = crop.y1 + (h >> 1) + parameters.moffat.y0;
 
 		parameters.moffat.alpha_x = std::abs(parameters.moffat.alpha_x);
 		parameters.moffat.alpha_y = std::abs(parameters.moffat.alpha_y);
@@ -292,7 +413,7 @@ namespace Photometry
 			std::swap(parameters.moffat.alpha_x, parameters.moffat.alpha_y);
 		}
 
-		if (MoffatParameters::FWHM(parameters.moffat.alpha_x) > std::min(x2 - x1, y2 - y1))
+		if (MoffatParameters::FWHM(parameters.moffat.alpha_x, beta_x2 * 0.5) > std::min(w, h))
 		{
 			// FWHM larger than crop
 			return false;
@@ -307,64 +428,764 @@ namespace Photometry
 
 		if (std::abs(psf->alpha_x - psf->alpha_y) < 0.01)
 		{
-			FitError(&crop[0], w, h, parameters, &psf->residual, &mean_signal);
+			double theta = parameters.moffat.theta;
+			FitError<beta_x2, 1>(parameters, &theta, &psf->residual, &mean_signal);
 			psf->theta = parameters.moffat.theta = 0.0;
 		}
 		else
 		{
-			double theta = parameters.moffat.theta;
-
-			double residual, best_theta;
+			double thetas[4], residuals[4], mean_signals[4];
 			for (int i = 0; i < 4; i++)
 			{
-				parameters.moffat.theta = theta + i * 1.570795;
-				double tmp_mean_signal;
-				FitError(&crop[0], w, h, parameters, &residual, &tmp_mean_signal);
-				if (i == 0 || residual < psf->residual)
+				thetas[i] = parameters.moffat.theta + i * 1.570795;
+			}
+			FitError<beta_x2, 4>(parameters, thetas, residuals, mean_signals);
+
+			int best = 0;
+			for (int i = 1; i < 4; i++)
+			{
+				if (residuals[i] < residuals[best])
+				{
+					best = i;
+				}
+			}
+
+			psf->residual = residuals[best];
+			mean_signal = mean_signals[best];
+			psf->theta = parameters.moffat.theta = std::atan2(std::sin(thetas[best]), std::cos(thetas[best]));
+		}
+
+		psf->residual /= mean_signal;
+		psf->method = PSFMethod::Moffat;
+
+		return true;
+	}
+
+	template<int beta_x2, typename T>
+	bool Extractor::FitMoffatPSF(std::valarray<T>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSF* psf, int* status)
+	{
+		PSFCrop crop;
+		CropPSF(image, image_width, x, y, xmin, ymin, xmax, ymax, &crop);
+		return FitCroppedPSF<beta_x2>(crop, psf, status);
+	}
+
+	template<int beta_x2>
+	bool Extractor::FitCroppedPSF(PSFCrop& crop, PSF* psf, int* status)
+	{
+		FitParameters parameters;
+		parameters.data_ptr = crop.data.data();
+		parameters.w = static_cast<int>(crop.w);
+		parameters.h = static_cast<int>(crop.h);
+		std::copy_n(crop.parameters, MoffatParameters::count, parameters.moffat.parameters);
+
+		int m = static_cast<int>(crop.data.size());
+		int n = MoffatParameters::count;
+
+		std::valarray<double> fvec(m);
+		std::valarray<double> fjac(m * n);
+		std::valarray<int> iwa(n);
+		std::valarray<double> wa(5 * n + m);
+
+		*status = lmder1(Extractor::FitMoffat<beta_x2>, &parameters, m, n, parameters.moffat.parameters, &fvec[0], &fjac[0], m, 1.0e-08, &iwa[0], &wa[0], static_cast<int>(wa.size()));
+		if (*status != 1 && *status != 2 && *status != 3)
+		{
+			return false;
+		}
+
+		return FinishPSF<beta_x2>(crop, parameters.moffat.parameters, psf);
+	}
+
+	// Width that the adaptive moments of EstimatePSF measure for a circular Moffat
+	// profile with alpha = 1. The widths of an elliptical profile scale with its
+	// alphas, so this converts the moments of a star to Moffat parameters.
+	template<int beta_x2>
+	static double GetMomentsWidth()
+	{
+		static double const width = []()
+		{
+			// Same fixed point as in EstimatePSF, on the radial profile
+			double const beta = beta_x2 * 0.5;
+			double s2 = 1.0;
+			for (int iteration = 0; iteration < 200; ++iteration)
+			{
+				double const r_max = 20.0 * std::sqrt(s2);
+				int const steps = 4000;
+				double const dr = r_max / steps;
+
+				double sum = 0.0, sum_rr = 0.0;
+				for (int i = 1; i <= steps; ++i)
+				{
+					double const r = i * dr;
+					double const value = std::pow(1.0 + r * r, -beta) * std::exp(-0.5 * r * r / s2) * r;
+					sum += value;
+					sum_rr += value * r * r;
+				}
+
+				// the second moment along one axis is half the radial one
+				double const next = sum_rr / sum;
+				if (std::abs(next - s2) < 1e-12 * s2)
+				{
+					break;
+				}
+				s2 = next;
+			}
+			return std::sqrt(s2);
+		}();
+		return width;
+	}
+
+	// Estimates the PSF of a star from the adaptive second moments of its crop.
+	// The Moffat profile with the same FWHM and shape gives the residual.
+	template<int beta_x2>
+	bool Extractor::EstimatePSF(PSFCrop& crop, PSF* psf)
+	{
+		int const w = static_cast<int>(crop.w);
+		int const h = static_cast<int>(crop.h);
+
+		double const background = MoffatParameters::_S0(crop.parameters);
+		double const* data = crop.data.data();
+
+		double cx = (w >> 1) + MoffatParameters::_x0(crop.parameters);
+		double cy = (h >> 1) + MoffatParameters::_y0(crop.parameters);
+
+		// The moments are weighted by a Gaussian with the covariance of the star
+		// so far. For a Gaussian star the weighted moments are half its covariance.
+		double sigma = MoffatParameters::_alpha_x(crop.parameters);
+		double mxx = sigma * sigma, myy = sigma * sigma, mxy = 0.0;
+
+		bool converged = false;
+		for (int iteration = 0; iteration < 50 && !converged; ++iteration)
+		{
+			double det = mxx * myy - mxy * mxy;
+			if (!(det > 0.0))
+			{
+				return false;
+			}
+
+			double ixx = myy / det;
+			double iyy = mxx / det;
+			double ixy = -mxy / det;
+
+			double sum = 0.0, sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_yy = 0.0, sum_xy = 0.0;
+			for (int y = 0; y < h; ++y)
+			{
+				double dy = y - cy;
+				for (int x = 0; x < w; ++x)
 				{
-					psf->residual = residual;
-					mean_signal = tmp_mean_signal;
-					best_theta = parameters.moffat.theta;
+					double dx = x - cx;
+					double weight = std::exp(-0.5 * (ixx * dx * dx + iyy * dy * dy + 2.0 * ixy * dx * dy));
+					double value = (data[y * w + x] - background) * weight;
+					sum += value;
+					sum_x += value * dx;
+					sum_y += value * dy;
+					sum_xx += value * dx * dx;
+					sum_yy += value * dy * dy;
+					sum_xy += value * dx * dy;
 				}
 			}
 
-			psf->theta = parameters.moffat.theta = std::atan2(std::sin(best_theta), std::cos(best_theta));
+			if (!(sum > 0.0))
+			{
+				return false;
+			}
+
+			double ox = sum_x / sum;
+			double oy = sum_y / sum;
+
+			double nxx = 2.0 * (sum_xx / sum - ox * ox);
+			double nyy = 2.0 * (sum_yy / sum - oy * oy);
+			double nxy = 2.0 * (sum_xy / sum - ox * oy);
+
+			converged = std::abs(ox) < 1e-3 && std::abs(oy) < 1e-3 && std::abs(nxx - mxx) + std::abs(nyy - myy) + std::abs(nxy - mxy) < 1e-3 * (mxx + myy);
+
+			cx += ox;
+			cy += oy;
+			mxx = nxx;
+			myy = nyy;
+			mxy = nxy;
+
+			if (cx < 0 || cy < 0 || cx >= w || cy >= h)
+			{
+				return false;
+			}
+		}
+
+		// Axes of the covariance ellipse
+		double mean = 0.5 * (mxx + myy);
+		double spread = std::sqrt(0.25 * (mxx - myy) * (mxx - myy) + mxy * mxy);
+		double major = mean + spread;
+		double minor = mean - spread;
+
+		if (!converged || !(minor > 0.0))
+		{
+			return false;
 		}
 
+		double const beta = beta_x2 * 0.5;
+
+		FitParameters parameters;
+		parameters.data_ptr = crop.data.data();
+		parameters.w = w;
+		parameters.h = h;
+		parameters.moffat.S0 = background;
+		parameters.moffat.x0 = cx - (w >> 1);
+		parameters.moffat.y0 = cy - (h >> 1);
+		parameters.moffat.alpha_x = std::sqrt(major) / GetMomentsWidth<beta_x2>();
+		parameters.moffat.alpha_y = std::sqrt(minor) / GetMomentsWidth<beta_x2>();
+		parameters.moffat.theta = 0.5 * std::atan2(2.0 * mxy, mxx - myy);
+
+		if (MoffatParameters::FWHM(parameters.moffat.alpha_x, beta) > std::min(w, h))
+		{
+			// FWHM larger than crop
+			return false;
+		}
+
+		// Least squares amplitude of the profile
+		{
+			double s = std::sin(parameters.moffat.theta);
+			double c = std::cos(parameters.moffat.theta);
+
+			double ix2 = 1.0 / (parameters.moffat.alpha_x * parameters.moffat.alpha_x);
+			double iy2 = 1.0 / (parameters.moffat.alpha_y * parameters.moffat.alpha_y);
+
+			double A = c * c * ix2 + s * s * iy2;
+			double B = s * s * ix2 + c * c * iy2;
+			double C = 2 * s * c * (ix2 - iy2);
+
+			double zd = 0.0, zz = 0.0;
+			for (int y = 0; y < h; ++y)
+			{
+				double dy = y - cy;
+				for (int x = 0; x < w; ++x)
+				{
+					double dx = x - cx;
+					double z = MoffatProfile<beta_x2>(1.0 + A * dx * dx + B * dy * dy + C * dx * dy);
+					zd += z * (data[y * w + x] - background);
+					zz += z * z;
+				}
+			}
+			parameters.moffat.S1 = std::max(0.0, zd / zz);
+		}
+
+		double mean_signal;
+		double theta = parameters.moffat.theta;
+		FitError<beta_x2, 1>(parameters, &theta, &psf->residual, &mean_signal);
+
+		psf->x = crop.x1 + cx;
+		psf->y = crop.y1 + cy;
+		psf->alpha_x = parameters.moffat.alpha_x;
+		psf->alpha_y = parameters.moffat.alpha_y;
+		psf->theta = parameters.moffat.theta;
+		psf->eccentricity = std::sqrt(1 - minor / major);
 		psf->residual /= mean_signal;
+		psf->method = PSFMethod::Moments;
+
+		return std::isfinite(psf->residual);
+	}
+
+	// Determines the PSFs of the given objects and removes the objects for which that fails.
+	// Depending on the parameters, the PSFs are first estimated from the moments of the stars
+	// and only fitted for outliers, and the fits are done in batches of similarly sized stars.
+	// If limits is given, the objects have already been estimated with EstimateMoffatPSFs and
+	// the outliers are those beyond limits, otherwise they are found among the given objects.
+	template<typename T>
+	bool Extractor::FitPSFs(std::valarray<T>& image, int image_width, sep_catalog const* sep_objects, std::vector<Object>& objects, PSFOutlierLimits const* limits, Callback callback)
+	{
+		return DispatchMoffatBeta(MoffatBetaX2(), [&](auto beta_x2)
+			{
+				return FitMoffatPSFs<decltype(beta_x2)::value>(image, image_width, sep_objects, objects, limits, callback);
+			});
+	}
+
+	// Determines the PSFs of a subsample of the stars, spread evenly over the image, and marks
+	// all other objects as unsampled. The brightest stars of each grid cell are taken first, one
+	// cell after another, until the medians of the FWHM, HFR and eccentricity are known precisely
+	// enough. Sampled stars whose PSF cannot be determined are removed like with FitPSFs.
+	// Estimated PSFs are outliers with respect to all stars, not just to those sampled so far.
+	template<typename T>
+	bool Extractor::SubsamplePSFs(std::valarray<T>& image, int image_width, int image_height, sep_catalog const* sep_objects, std::vector<Object>& objects, Callback callback)
+	{
+		PSFOutlierLimits limits;
+		if (m_parameters.psf_fast)
+		{
+			DispatchMoffatBeta(MoffatBetaX2(), [&](auto beta_x2)
+				{
+					EstimateMoffatPSFs<decltype(beta_x2)::value>(image, image_width, sep_objects, objects);
+					return true;
+				});
+			limits = ComputeOutlierLimits(objects);
+		}
+
+		int const grid = std::max(1, m_parameters.psf_subsample_grid);
+
+		std::vector<std::vector<int>> cells(grid * grid);
+		for (int i = 0; i < objects.size(); ++i)
+		{
+			int const index = objects[i].catalog_index;
+			int const cx = std::min(grid - 1, std::max(0, static_cast<int>(sep_objects->x[index] * grid / image_width)));
+			int const cy = std::min(grid - 1, std::max(0, static_cast<int>(sep_objects->y[index] * grid / image_height)));
+			cells[cx + cy * grid].push_back(i);
+		}
+
+		size_t rounds = 0;
+		for (std::vector<int>& cell : cells)
+		{
+			std::stable_sort(cell.begin(), cell.end(), [&](int a, int b) { return objects[a].snr > objects[b].snr; });
+			rounds = std::max(rounds, cell.size());
+		}
+
+		// Every prefix of the round-robin order covers the image evenly
+		std::vector<int> order;
+		order.reserve(objects.size());
+		for (size_t round = 0; round < rounds; ++round)
+		{
+			for (std::vector<int> const& cell : cells)
+			{
+				if (round < cell.size())
+				{
+					order.push_back(cell[round]);
+				}
+			}
+		}
+
+		size_t const min_stars = static_cast<size_t>(std::max(1, m_parameters.psf_subsample_min_stars));
+		size_t const step = static_cast<size_t>(std::max(1, m_parameters.psf_subsample_step));
+		double const beta = MoffatBetaX2() * 0.5;
+
+		std::vector<Object> used;
+		std::vector<Object> chunk;
+		size_t next = 0;
+		while (next < order.size())
+		{
+			size_t const end = std::min(order.size(), next + (used.size() < min_stars ? min_stars - used.size() : step));
+
+			chunk.clear();
+			for (; next < end; ++next)
+			{
+				chunk.push_back(objects[order[next]]);
+			}
+
+			if (!FitPSFs(image, image_width, sep_objects, chunk, m_parameters.psf_fast ? &limits : nullptr, callback))
+			{
+				return false;
+			}
+
+			used.insert(used.end(), chunk.begin(), chunk.end());
+
+			if (used.size() >= min_stars && IsSubsampleSettled(used, beta))
+			{
+				break;
+			}
+		}
+
+		// The remaining stars are kept for the SNR and HFR statistics
+		for (; next < order.size(); ++next)
+		{
+			Object obj = objects[order[next]];
+			int const index = obj.catalog_index;
+			obj.psf = PSF{};
+			obj.psf.x = sep_objects->x[index];
+			obj.psf.y = sep_objects->y[index];
+			obj.psf.method = PSFMethod::Unsampled;
+			used.push_back(obj);
+		}
+
+		std::sort(used.begin(), used.end(), [](Object const& a, Object const& b) { return a.catalog_index < b.catalog_index; });
+		objects.swap(used);
+
+		return true;
+	}
+
+	// Whether the 95% confidence intervals of the FWHM, HFR and eccentricity medians
+	// of the given stars are within the subsampling tolerance
+	bool Extractor::IsSubsampleSettled(std::vector<Object> const& objects, double beta)
+	{
+		size_t const count = objects.size();
+
+		std::vector<double> fwhms(count), hfrs(count), eccentricities(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			fwhms[i] = MoffatParameters::FWHM(sqrt(objects[i].psf.alpha_x * objects[i].psf.alpha_y), beta);
+			hfrs[i] = objects[i].hfr;
+			eccentricities[i] = objects[i].psf.eccentricity;
+		}
+
+		// The standard error of the median is ~1.2533 sigma / sqrt(n), with sigma ~1.4826 MAD
+		double const scale = 1.96 * 1.2533 * 1.4826 / std::sqrt(static_cast<double>(count));
+		auto half_width = [&](std::vector<double>& values, double* median)
+		{
+			*median = Median(values);
+			for (double& value : values)
+			{
+				value = std::abs(value - *median);
+			}
+			return scale * Median(values);
+		};
+
+		double fwhm_median, hfr_median, eccentricity_median;
+		double const fwhm_half_width = half_width(fwhms, &fwhm_median);
+		double const hfr_half_width = half_width(hfrs, &hfr_median);
+		double const eccentricity_half_width = half_width(eccentricities, &eccentricity_median);
+
+		double const tolerance = m_parameters.psf_subsample_tolerance;
+		return fwhm_half_width <= tolerance * fwhm_median && hfr_half_width <= tolerance * hfr_median && eccentricity_half_width <= tolerance;
+	}
+
+	// Limits beyond which the estimated PSFs of the given objects are outliers, from the
+	// medians and MADs of their residuals and eccentricities. Objects whose PSF was not
+	// estimated from the moments are skipped.
+	PSFOutlierLimits Extractor::ComputeOutlierLimits(std::vector<Object> const& objects)
+	{
+		PSFOutlierLimits limits;
+
+		std::vector<double> residuals, eccentricities;
+		for (Object const& obj : objects)
+		{
+			if (obj.psf.method == PSFMethod::Moments)
+			{
+				residuals.push_back(obj.psf.residual);
+				eccentricities.push_back(obj.psf.eccentricity);
+			}
+		}
+
+		if (!residuals.empty())
+		{
+			double const k = m_parameters.psf_fast_outlier_sigma * 1.4826;
+
+			double const residual_median = Median(residuals);
+			for (double& residual : residuals)
+			{
+				residual = std::abs(residual - residual_median);
+			}
+			limits.residual = residual_median + k * Median(residuals);
+
+			double const eccentricity_median = Median(eccentricities);
+			for (double& eccentricity : eccentricities)
+			{
+				eccentricity = std::abs(eccentricity - eccentricity_median);
+			}
+			limits.eccentricity = eccentricity_median + k * Median(eccentricities);
+		}
+
+		return limits;
+	}
+
+	// Estimates the PSFs of all objects from their moments. The PSF of an
+	// object whose estimate fails is reset, so its method is not Moments.
+	template<int beta_x2, typename T>
+	void Extractor::EstimateMoffatPSFs(std::valarray<T>& image, int image_width, sep_catalog const* sep_objects, std::vector<Object>& objects)
+	{
+		concurrency::parallel_for(0, static_cast<int>(objects.size()), [&](int i)
+			{
+				Object& obj = objects[i];
+				int const index = obj.catalog_index;
+
+				PSFCrop crop;
+				CropPSF(image, image_width, sep_objects->x[index], sep_objects->y[index], obj.x_min, obj.y_min, obj.x_max, obj.y_max, &crop);
+
+				if (!EstimatePSF<beta_x2>(crop, &obj.psf))
+				{
+					obj.psf = PSF{};
+				}
+			});
+	}
+
+	template<int beta_x2, typename T>
+	bool Extractor::FitMoffatPSFs(std::valarray<T>& image, int image_width, sep_catalog const* sep_objects, std::vector<Object>& objects, PSFOutlierLimits const* limits, Callback callback)
+	{
+		int const count = static_cast<int>(objects.size());
+
+		std::vector<PSFCrop> crops(count);
+		concurrency::parallel_for(0, count, [&](int i)
+			{
+				int const index = objects[i].catalog_index;
+				CropPSF(image, image_width, sep_objects->x[index], sep_objects->y[index], objects[i].x_min, objects[i].y_min, objects[i].x_max, objects[i].y_max, &crops[i]);
+			});
+
+		std::vector<char> determined(count, 0);
+
+		if (m_parameters.psf_fast)
+		{
+			PSFOutlierLimits own_limits;
+			if (limits == nullptr)
+			{
+				concurrency::parallel_for(0, count, [&](int i)
+					{
+						if (!EstimatePSF<beta_x2>(crops[i], &objects[i].psf))
+						{
+							objects[i].psf = PSF{};
+						}
+					});
+				own_limits = ComputeOutlierLimits(objects);
+				limits = &own_limits;
+			}
+
+			// Estimates whose residual or eccentricity stands out from the
+			// other stars are not trusted and those stars are fitted instead
+			for (int i = 0; i < count; ++i)
+			{
+				PSF const& psf = objects[i].psf;
+				determined[i] = psf.method == PSFMethod::Moments && psf.residual <= limits->residual && psf.eccentricity <= limits->eccentricity;
+			}
+		}
+
+		std::vector<int> indices;
+		for (int i = 0; i < count; ++i)
+		{
+			if (!determined[i])
+			{
+				indices.push_back(i);
+			}
+		}
+
+		if (!FitCroppedPSFs<beta_x2>(crops, indices, objects, determined, callback))
+		{
+			return false;
+		}
+
+		int kept = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			if (determined[i])
+			{
+				objects[kept++] = objects[i];
+			}
+		}
+		objects.resize(kept);
+
+		return true;
+	}
+
+	// Fits the PSFs of the objects with the given indices and marks them as determined if successful.
+	// If enabled, stars with similar crops are fitted together in batches.
+	template<int beta_x2>
+	bool Extractor::FitCroppedPSFs(std::vector<PSFCrop>& crops, std::vector<int> indices, std::vector<Object>& objects, std::vector<char>& determined, Callback callback)
+	{
+		int const count = static_cast<int>(indices.size());
+		int const group_size = m_parameters.psf_batch_fit ? moffat_batch_lanes : 1;
+
+		// Stars with similar crops share a batch so that there is little padding
+		if (m_parameters.psf_batch_fit)
+		{
+			std::sort(indices.begin(), indices.end(), [&](int a, int b)
+				{
+					return crops[a].h != crops[b].h ? crops[a].h < crops[b].h : crops[a].w < crops[b].w;
+				});
+		}
+
+		int const groups = (count + group_size - 1) / group_size;
+
+		std::atomic<int> done(0);
+		std::atomic<int> accepted(0);
+		std::atomic<bool> cancelled(false);
+		std::mutex callback_mutex;
+
+		concurrency::parallel_for(0, groups, [&](int g)
+			{
+				if (cancelled)
+				{
+					return;
+				}
+
+				if (callback != nullptr)
+				{
+					std::unique_lock<std::mutex> lock(callback_mutex, std::try_to_lock);
+					if (lock.owns_lock() && !callback(Phase::Object, count, done, accepted))
+					{
+						cancelled = true;
+						return;
+					}
+				}
+
+				int const first = g * group_size;
+				int const lanes = std::min(group_size, count - first);
+
+				if (!m_parameters.psf_batch_fit)
+				{
+					int const i = indices[first];
+					int status = 0;
+					if (FitCroppedPSF<beta_x2>(crops[i], &objects[i].psf, &status))
+					{
+						determined[i] = 1;
+						++accepted;
+					}
+					++done;
+					return;
+				}
+
+				size_t w = 0, h = 0;
+				for (int l = 0; l < lanes; ++l)
+				{
+					w = std::max(w, crops[indices[first + l]].w);
+					h = std::max(h, crops[indices[first + l]].h);
+				}
+
+				MoffatBatch batch;
+				batch.Resize(static_cast<int>(w), static_cast<int>(h));
+				for (int l = 0; l < lanes; ++l)
+				{
+					PSFCrop const& crop = crops[indices[first + l]];
+					batch.SetLane(l, crop.data.data(), static_cast<int>(crop.w), static_cast<int>(crop.h), crop.parameters);
+				}
+
+				FitMoffatBatch<beta_x2>(batch, 1.0e-08, 200);
+
+				for (int l = 0; l < lanes; ++l)
+				{
+					int const i = indices[first + l];
+					if (!batch.converged[l])
+					{
+						continue;
+					}
+
+					double parameters[MoffatParameters::count];
+					for (int j = 0; j < MoffatParameters::count; ++j)
+					{
+						parameters[j] = batch.parameters[j][l];
+					}
+
+					if (FinishPSF<beta_x2>(crops[i], parameters, &objects[i].psf))
+					{
+						determined[i] = 1;
+						++accepted;
+					}
+				}
+				done += lanes;
+			});
+
+		return !cancelled;
+	}
+
+	// Measures object i of the SEP catalog, false if it is not a usable star.
+	// The PSF is left to the caller if it is to be fitted. Called for many
+	// objects in parallel, so it must not modify any state.
+	bool Extractor::MeasureObject(sep_image const& simage, sep_catalog const* sep_objects, int i, Object* obj_out)
+	{
+		double a = sep_objects->a[i];
+		double b = sep_objects->b[i];
+		double rab = sqrt(a * a + b * b);
+
+		if (!(rab > 0.8 && rab < 10))
+		{
+			return false;
+		}
+
+		Object& obj = *obj_out;
+		obj.catalog_index = i;
+
+		double x = sep_objects->x[i];
+		double y = sep_objects->y[i];
+
+		double x_min = sep_objects->xmin[i];
+		double y_min = sep_objects->ymin[i];
+		double x_max = sep_objects->xmax[i];
+		double y_max = sep_objects->ymax[i];
+
+		obj.x_min = x_min;
+		obj.y_min = y_min;
+		obj.x_max = x_max;
+		obj.y_max = y_max;
+
+		double theta = sep_objects->theta[i];
+
+		double cxx = sep_objects->cxx[i];
+		double cyy = sep_objects->cyy[i];
+		double cxy = sep_objects->cxy[i];
+
+		// Calculate kron radius to figure out how large the aperture must be to include most of the flux
+		if (sep_kron_radius(&simage, x, y, cxx, cyy, cxy, 6.0, 0, &obj.kron_radius, &obj.kron_flag))
+		{
+			return false;
+		}
+
+		double area;
+
+		// Calculate flux
+		if (sep_sum_ellipse(&simage, x, y, a, b, theta, m_parameters.photometry_kron_radius_multiple * obj.kron_radius, 0, 1, 0, &obj.ellipse_sum, &obj.ellipse_sum_err, &area, &obj.ellipse_sum_flag))
+		{
+			return false;
+		}
+
+		double geometric_mean = sqrt(a * b); // radius of circle with area equal to that of the ellipse
+		if (obj.kron_radius * geometric_mean < 1.75)
+		{
+			sep_sum_circle(&simage, x, y, 1.75, 0, 1, 0, &obj.circle_sum, &obj.circle_sum_err, &area, &obj.circle_sum_flag);
+			obj.flux = obj.circle_sum;
+			obj.flux_err = obj.circle_sum_err;
+			obj.flux_flag = obj.circle_sum_flag;
+		}
+		else
+		{
+			obj.circle_sum = obj.circle_sum_err = obj.circle_sum_flag = 0;
+			obj.flux = obj.ellipse_sum;
+			obj.flux_err = obj.ellipse_sum_err;
+			obj.flux_flag = obj.ellipse_sum_flag;
+		}
+
+		// Calculate HFR
+		double const flux_fraction = 0.5;
+		if (sep_flux_radius(&simage, x, y, 6.0 * a, 0, 5, 0, &obj.flux, &flux_fraction, 1, &obj.hfr, &obj.hfr_flag))
+		{
+			return false;
+		}
+
+		// Calculate SNR by treating the flux as signal and aperture area * background stddev as noise
+		obj.snr = obj.flux / sqrt(obj.flux + area * area * 3.14159 * simage.noiseval /*stddev*/);
+		// TODO Needs to consider e-/ADU gain
+		// TODO SNR fails when image is float and not counts
+		if (obj.snr < m_parameters.photometry_min_snr || obj.hfr > m_parameters.photometry_max_hfr)
+		{
+			return false;
+		}
+
+		if (!m_parameters.psf_fit)
+		{
+			// Approximate PSF from SEP moments
+			obj.psf.x = x;
+			obj.psf.y = y;
+			obj.psf.alpha_x = obj.psf.alpha_y = obj.psf.theta = obj.psf.fwhm_x = obj.psf.fwhm_y = obj.psf.residual = 0;
+			obj.psf.fwhm = 2.0 * sqrt(log(2) * (a * a + b * b));
+			obj.psf.eccentricity = std::sqrt(1 - b * b / (a * a));
+		}
 
 		return true;
 	}
 
-	bool Extractor::Extract(Loader::FITSInfo& fit, std::valarray<float>& image, Catalog** catalog_out, int* status, Callback callback)
+	template<typename T>
+	bool Extractor::Extract(Loader::FITSInfo& fit, std::valarray<T>& image, Loader::ImageStatistics const* statistics, Catalog** catalog_out, int* status, Callback callback)
 	{
 		if (callback != nullptr && !callback(Phase::Median, 0, 0, 0))
 		{
 			return false;
 		}
 
-		float* data = &image[0];
+		T* data = &image[0];
 
 		int n = (fit.attributes().data.out_dim.nx * fit.attributes().data.out_dim.ny);
 
-		std::vector<float> work_image(data, data + n);
+		// Get median as first background estimate, computed exactly on the
+		// native pixel type without a copy. The first channel statistics of
+		// the decoder, if any, spare the passes over the image.
+		Loader::ChannelStatistics const* channel_statistics = statistics != nullptr && statistics->valid ? &statistics->channels[0] : nullptr;
 
-		// Get median as first background estimate
-		double median = Median(work_image);
+		double median = Processing::ComputeMedianStatistics(data, static_cast<size_t>(n), channel_statistics).median;
 
 		*catalog_out = new Catalog();
 		Catalog* catalog = *catalog_out;
 
 		catalog->statistics.median = median;
-		for (int i = 0; i < work_image.size(); ++i)
-		{
-			catalog->statistics.median_mad += std::abs(median - work_image[i]);
-		}
-		catalog->statistics.median_mad /= work_image.size();
+		catalog->statistics.median_mad = channel_statistics != nullptr && channel_statistics->exact
+			? Processing::ComputeMeanAbsoluteDeviation(channel_statistics->histogram.data(), channel_statistics->histogram.size(), median)
+			: Processing::ComputeMeanAbsoluteDeviation(data, static_cast<size_t>(n), median);
+
+		int const width = fit.attributes().data.out_dim.nx;
+		int const height = fit.attributes().data.out_dim.ny;
 
-		work_image.assign(data, data + n);
+		// SEP works on float data. The background subtracted image is the only
+		// copy of the image that is made and its buffer is shared between calls.
+		Processing::ScratchPool<float>::Lease work_image = work_image_pool.Acquire(static_cast<size_t>(n));
 
-		float* work_image_ptr = &work_image[0];
+		float* work_image_ptr = work_image.data();
 
 		if (callback != nullptr && !callback(Phase::Background, 0, 0, 0))
 		{
@@ -380,15 +1201,35 @@ namespace Photometry
 		simage.dtype = SEP_TFLOAT;
 		simage.ndtype = 0;
 		simage.sdtype = 0;
-		simage.w = fit.attributes().data.out_dim.nx;
-		simage.h = fit.attributes().data.out_dim.ny;
+		simage.w = width;
+		simage.h = height;
 		simage.noiseval = 0.0;
 		simage.noise_type = SEP_NOISE_NONE;
 		simage.gain = 0.0;
 		simage.maskthresh = 0.0;
 
+		// Float images are modelled as they are, other
+		// types are converted into the work image first
+		bool const is_float = std::is_same<T, float>::value;
+
+		sep_image background_image = simage;
+		if (is_float)
+		{
+			background_image.data = data;
+		}
+		else
+		{
+			Processing::ParallelForBlocks(static_cast<size_t>(n), Processing::GetBlockCount(static_cast<size_t>(n)), [&](size_t, size_t start, size_t end)
+				{
+					for (size_t i = start; i < end; ++i)
+					{
+						work_image_ptr[i] = static_cast<float>(data[i]);
+					}
+				});
+		}
+
 		// Create background model
-		if (*status = sep_background(&simage, m_parameters.background_tile_size, m_parameters.background_tile_size, m_parameters.background_filter_size, m_parameters.background_filter_size, median, &catalog->sep_background))
+		if (*status = sep_background(&background_image, m_parameters.background_tile_size, m_parameters.background_tile_size, m_parameters.background_filter_size, m_parameters.background_filter_size, median, &catalog->sep_background))
 		{
 			if (catalog->sep_background != nullptr)
 			{
@@ -398,8 +1239,39 @@ namespace Photometry
 			return false;
 		}
 
-		// Subtract background model from work image
-		if (*status = sep_bkg_subarray(catalog->sep_background, work_image_ptr, SEP_TFLOAT))
+		// Subtract background model, for float images directly into the
+		// work image so that every pixel is only written once
+		std::atomic<int> subtract_status(0);
+		Processing::ParallelForRowTiles(height, Processing::GetRowTileCount(width, height), [&](size_t, size_t row_start, size_t row_end)
+			{
+				std::vector<float> background_line(is_float ? width : 0);
+				for (size_t y = row_start; y < row_end; ++y)
+				{
+					float* row = work_image_ptr + y * width;
+					int line_status;
+					if (is_float)
+					{
+						T const* data_row = data + y * width;
+						line_status = sep_bkg_line(catalog->sep_background, static_cast<int>(y), background_line.data(), SEP_TFLOAT);
+						for (int x = 0; x < width; ++x)
+						{
+							row[x] = static_cast<float>(data_row[x]) - background_line[x];
+						}
+					}
+					else
+					{
+						line_status = sep_bkg_subline(catalog->sep_background, static_cast<int>(y), row, SEP_TFLOAT);
+					}
+
+					if (line_status != 0)
+					{
+						subtract_status = line_status;
+						return;
+					}
+				}
+			});
+
+		if (*status = subtract_status)
 		{
 			if (catalog->sep_background != nullptr)
 			{
@@ -413,27 +1285,21 @@ namespace Photometry
 		simage.noise_type = SEP_NOISE_STDDEV;
 		simage.noiseval = sep_bkg_globalrms(catalog->sep_background);
 
-		// Iteratively estimate noise from background subtracted image
-		std::vector<float> noise_work_image(work_image_ptr, work_image_ptr + n);
+		// Iteratively estimate noise from background subtracted image. Clipping
+		// at the smallest threshold so far selects the same pixels as clipping
+		// the remaining pixels of the previous iteration again, so each
+		// iteration is a parallel masked reduction over the whole image.
 		double sigma = simage.noiseval; // Use SEP's noise value as initial estimate
+		double threshold = std::numeric_limits<double>::max();
 		int noise_pixels = n;
 		for (int i = 0; i < m_parameters.noise_i; ++i)
 		{
-			double ksigma = m_parameters.noise_k * sigma;
-			int count = 0;
+			threshold = std::min(threshold, m_parameters.noise_k * sigma);
 			double prevSigma = sigma;
-			sigma = 0.0;
-			for (int j = 0; j < noise_pixels; ++j)
-			{
-				float value = noise_work_image[j];
-				if (std::abs(value) < ksigma)
-				{
-					noise_work_image[count++] = value;
-					sigma += value * value;
-				}
-			}
-			noise_pixels = count;
-			sigma = std::sqrt(sigma / (double)noise_pixels);
+			size_t count;
+			double sum_of_squares = Processing::ComputeClippedSumOfSquares(work_image_ptr, static_cast<size_t>(n), threshold, &count);
+			noise_pixels = static_cast<int>(count);
+			sigma = std::sqrt(sum_of_squares / (double)noise_pixels);
 			if (i >= 1 && std::abs(prevSigma - sigma) / prevSigma < m_parameters.noise_eps)
 			{
 				break;
@@ -509,108 +1375,86 @@ namespace Photometry
 
 		int nobj = catalog->sep_catalog->nobj;
 
-		for (int i = 0; i < nobj; i++)
-		{
-			if (callback != nullptr && !callback(Phase::Object, nobj, i, static_cast<int>(catalog->objects.size())))
+		// PSFs that are estimated, fitted in batches or subsampled are determined once all objects are measured
+		bool const deferred_psf_fit = m_parameters.psf_fit && (m_parameters.psf_batch_fit || m_parameters.psf_fast || m_parameters.psf_subsample);
+
+		// Objects are measured in parallel into per-thread lists, which are merged
+		// in catalog order so that the result does not depend on the scheduling.
+		// Progress is reported by whichever thread is free to do so, one at a time.
+		// Stars are available once they pass the SNR and HFR cuts, on every path
+		// before their PSF is determined.
+		concurrency::combinable<std::vector<Object>> thread_objects;
+		std::atomic<int> measured(0);
+		std::atomic<int> available(0);
+		std::atomic<int> accepted(0);
+		std::atomic<bool> cancelled(false);
+		std::mutex callback_mutex;
+
+		concurrency::parallel_for(0, nobj, [&](int i)
 			{
-				return false;
-			}
-
-			double a = catalog->sep_catalog->a[i];
-			double b = catalog->sep_catalog->b[i];
-			double rab = sqrt(a * a + b * b);
-
-			if (rab > 0.8 && rab < 10)
-			{
-				Object obj;
-				obj.catalog_index = i;
-
-				double x = catalog->sep_catalog->x[i];
-				double y = catalog->sep_catalog->y[i];
-
-				double x_min = catalog->sep_catalog->xmin[i];
-				double y_min = catalog->sep_catalog->ymin[i];
-				double x_max = catalog->sep_catalog->xmax[i];
-				double y_max = catalog->sep_catalog->ymax[i];
-
-				obj.x_min = x_min;
-				obj.y_min = y_min;
-				obj.x_max = x_max;
-				obj.y_max = y_max;
-
-				double theta = catalog->sep_catalog->theta[i];
-
-				double cxx = catalog->sep_catalog->cxx[i];
-				double cyy = catalog->sep_catalog->cyy[i];
-				double cxy = catalog->sep_catalog->cxy[i];
-
-				// Calculate kron radius to figure out how large the aperture must be to include most of the flux
-				if (*status = sep_kron_radius(&simage, x, y, cxx, cyy, cxy, 6.0, 0, &obj.kron_radius, &obj.kron_flag))
+				if (cancelled)
 				{
-					continue;
+					return;
 				}
 
-				double area;
-
-				// Calculate flux
-				if (*status = sep_sum_ellipse(&simage, x, y, a, b, theta, m_parameters.photometry_kron_radius_multiple * obj.kron_radius, 0, 1, 0, &obj.ellipse_sum, &obj.ellipse_sum_err, &area, &obj.ellipse_sum_flag))
-				{
-					continue;
-				}
-
-				double geometric_mean = sqrt(a * b); // radius of circle with area equal to that of the ellipse
-				if (obj.kron_radius * geometric_mean < 1.75)
+				if (callback != nullptr)
 				{
-					sep_sum_circle(&simage, x, y, 1.75, 0, 1, 0, &obj.circle_sum, &obj.circle_sum_err, &area, &obj.circle_sum_flag);
-					obj.flux = obj.circle_sum;
-					obj.flux_err = obj.circle_sum_err;
-					obj.flux_flag = obj.circle_sum_flag;
-				}
-				else
-				{
-					obj.circle_sum = obj.circle_sum_err = obj.circle_sum_flag = 0;
-					obj.flux = obj.ellipse_sum;
-					obj.flux_err = obj.ellipse_sum_err;
-					obj.flux_flag = obj.ellipse_sum_flag;
-				}
-
-				// Calculate HFR
-				double const flux_fraction = 0.5;
-				if (*status = sep_flux_radius(&simage, x, y, 6.0 * a, 0, 5, 0, &obj.flux, &flux_fraction, 1, &obj.hfr, &obj.hfr_flag))
-				{
-					continue;
+					std::unique_lock<std::mutex> lock(callback_mutex, std::try_to_lock);
+					if (lock.owns_lock() && !callback(Phase::Object, nobj, measured, accepted))
+					{
+						cancelled = true;
+						return;
+					}
 				}
 
-				// Calculate SNR by treating the flux as signal and aperture area * background stddev as noise
-				obj.snr = obj.flux / sqrt(obj.flux + area * area * 3.14159 * simage.noiseval /*stddev*/);
-				// TODO Needs to consider e-/ADU gain
-				// TODO SNR fails when image is float and not counts
-				if (obj.snr < m_parameters.photometry_min_snr || obj.hfr > m_parameters.photometry_max_hfr)
+				Object obj;
+				if (MeasureObject(simage, catalog->sep_catalog, i, &obj))
 				{
-					continue;
-				}
+					++available;
 
-				if (m_parameters.psf_fit)
-				{
-					// Fit Moffat PSF
-					if (!FitPSF(image, fit.attributes().data.out_dim.nx, catalog->sep_catalog->x[i], catalog->sep_catalog->y[i], x_min, y_min, x_max, y_max, &obj.psf, status))
+					// Fit Moffat PSF right away unless it is determined later
+					int psf_status = 0;
+					if (!m_parameters.psf_fit || deferred_psf_fit || FitPSF(image, width, catalog->sep_catalog->x[i], catalog->sep_catalog->y[i], obj.x_min, obj.y_min, obj.x_max, obj.y_max, &obj.psf, &psf_status))
 					{
-						continue;
+						thread_objects.local().push_back(obj);
+						++accepted;
 					}
 				}
-				else
-				{
-					// Approximate PSF from SEP moments
-					obj.psf.x = x;
-					obj.psf.y = y;
-					obj.psf.alpha_x = obj.psf.alpha_y = obj.psf.theta = obj.psf.fwhm_x = obj.psf.fwhm_y = obj.psf.residual = 0;
-					obj.psf.fwhm = 2.0 * sqrt(log(2) * (a * a + b * b));
-					obj.psf.eccentricity = std::sqrt(1 - b * b / (a * a));
-				}
+				++measured;
+			});
 
-				catalog->statistics.residual_min = std::min(catalog->statistics.residual_min, obj.psf.residual);
+		if (cancelled)
+		{
+			return false;
+		}
+
+		thread_objects.combine_each([&](std::vector<Object> const& objects)
+			{
+				catalog->objects.insert(catalog->objects.end(), objects.begin(), objects.end());
+			});
+		std::sort(catalog->objects.begin(), catalog->objects.end(), [](Object const& a, Object const& b) { return a.catalog_index < b.catalog_index; });
 
-				catalog->objects.emplace_back(obj);
+		catalog->statistics.stars_available = available;
+
+		if (deferred_psf_fit)
+		{
+			bool const success = m_parameters.psf_subsample
+				? SubsamplePSFs(image, width, height, catalog->sep_catalog, catalog->objects, callback)
+				: FitPSFs(image, width, catalog->sep_catalog, catalog->objects, nullptr, callback);
+			if (!success)
+			{
+				return false;
+			}
+		}
+
+		catalog->statistics.stars_used = 0;
+
+		for (Object const& obj : catalog->objects)
+		{
+			if (obj.psf.method != PSFMethod::Unsampled)
+			{
+				++catalog->statistics.stars_used;
+				catalog->statistics.residual_min = std::min(catalog->statistics.residual_min, obj.psf.residual);
 			}
 		}
 
@@ -619,117 +1463,135 @@ namespace Photometry
 			return false;
 		}
 
-		double weight_sum = 0.0;
+		double psf_weight_sum = 0.0;
+		double star_weight_sum = 0.0;
+		double const beta = MoffatBetaX2() * 0.5;
 
-		// Calculate image statistics
+		// Calculate image statistics. Stars outside of the PSF subsample
+		// only contribute to the SNR and HFR statistics.
 		for (int i = 0; i < catalog->objects.size(); ++i)
 		{
 			Object& p = catalog->objects[i];
 			PSF& psf = p.psf;
 
-			psf.fwhm_x = MoffatParameters::FWHM(psf.alpha_x);
-			psf.fwhm_y = MoffatParameters::FWHM(psf.alpha_y);
-			psf.fwhm = MoffatParameters::FWHM(sqrt(psf.alpha_x * psf.alpha_y));
-
-			psf.weight = m_parameters.psf_fit ? catalog->statistics.residual_min / psf.residual : 1.0;
-			weight_sum += psf.weight;
-
-			fwhms.push_back(psf.fwhm);
-			catalog->statistics.fwhm_max = std::max(catalog->statistics.fwhm_max, psf.fwhm);
-			catalog->statistics.fwhm_min = std::min(catalog->statistics.fwhm_min, psf.fwhm);
-			catalog->statistics.fwhm_mean += psf.fwhm * psf.weight;
+			if (psf.method != PSFMethod::Unsampled)
+			{
+				psf.fwhm_x = MoffatParameters::FWHM(psf.alpha_x, beta);
+				psf.fwhm_y = MoffatParameters::FWHM(psf.alpha_y, beta);
+				psf.fwhm = MoffatParameters::FWHM(sqrt(psf.alpha_x * psf.alpha_y), beta);
+
+				psf.weight = m_parameters.psf_fit ? catalog->statistics.residual_min / psf.residual : 1.0;
+				psf_weight_sum += psf.weight;
+
+				fwhms.push_back(psf.fwhm);
+				catalog->statistics.fwhm_max = std::max(catalog->statistics.fwhm_max, psf.fwhm);
+				catalog->statistics.fwhm_min = std::min(catalog->statistics.fwhm_min, psf.fwhm);
+				catalog->statistics.fwhm_mean += psf.fwhm * psf.weight;
+
+				eccentricities.push_back(psf.eccentricity);
+				catalog->statistics.eccentricity_max = std::max(catalog->statistics.eccentricity_max, psf.eccentricity);
+				catalog->statistics.eccentricity_min = std::min(catalog->statistics.eccentricity_min, psf.eccentricity);
+				catalog->statistics.eccentricity_mean += psf.eccentricity * psf.weight;
+
+				residuals.push_back(psf.residual);
+				catalog->statistics.residual_max = std::max(catalog->statistics.residual_max, psf.residual);
+				catalog->statistics.residual_mean += psf.residual * psf.weight;
+			}
 
-			eccentricities.push_back(psf.eccentricity);
-			catalog->statistics.eccentricity_max = std::max(catalog->statistics.eccentricity_max, psf.eccentricity);
-			catalog->statistics.eccentricity_min = std::min(catalog->statistics.eccentricity_min, psf.eccentricity);
-			catalog->statistics.eccentricity_mean += psf.eccentricity * psf.weight;
+			// Only the stars of the subsample have a residual to weight by
+			double const star_weight = m_parameters.psf_subsample ? 1.0 : psf.weight;
+			star_weight_sum += star_weight;
 
 			snrs.push_back(p.snr);
 			catalog->statistics.snr_max = std::max(catalog->statistics.snr_max, p.snr);
 			catalog->statistics.snr_min = std::min(catalog->statistics.snr_min, p.snr);
-			catalog->statistics.snr_mean += p.snr * psf.weight;
+			catalog->statistics.snr_mean += p.snr * star_weight;
 
 			hfrs.push_back(p.hfr);
 			catalog->statistics.hfr_max = std::max(catalog->statistics.hfr_max, p.hfr);
 			catalog->statistics.hfr_min = std::min(catalog->statistics.hfr_min, p.hfr);
-			catalog->statistics.hfr_mean += p.hfr * psf.weight;
-
-			residuals.push_back(psf.residual);
-			catalog->statistics.residual_max = std::max(catalog->statistics.residual_max, psf.residual);
-			catalog->statistics.residual_mean += psf.residual * psf.weight;
+			catalog->statistics.hfr_mean += p.hfr * star_weight;
 		}
 
 		if (fwhms.size() > 0)
 		{
 			catalog->statistics.fwhm_median = Median(fwhms);
+			catalog->statistics.eccentricity_median = Median(eccentricities);
+			catalog->statistics.residual_median = Median(residuals);
+
+			for (int i = 0; i < fwhms.size(); ++i)
+			{
+				catalog->statistics.fwhm_mad += std::abs(catalog->statistics.fwhm_median - fwhms[i]);
+				catalog->statistics.eccentricity_mad += std::abs(catalog->statistics.eccentricity_median - eccentricities[i]);
+				catalog->statistics.residual_mad += std::abs(catalog->statistics.residual_median - residuals[i]);
+			}
+
+			catalog->statistics.fwhm_mad /= fwhms.size();
+			catalog->statistics.eccentricity_mad /= fwhms.size();
+			catalog->statistics.residual_mad /= fwhms.size();
 		}
-		if (eccentricities.size() > 0)
+		else
 		{
-			catalog->statistics.eccentricity_median = Median(eccentricities);
+			catalog->statistics.eccentricity_min = 0;
+			catalog->statistics.fwhm_min = 0;
+			catalog->statistics.residual_min = 0;
+
+			catalog->statistics.fwhm_mad = 0;
+			catalog->statistics.eccentricity_mad = 0;
+			catalog->statistics.residual_mad = 0;
 		}
+
 		if (snrs.size() > 0)
 		{
 			catalog->statistics.snr_median = Median(snrs);
-		}
-		if (hfrs.size() > 0)
-		{
 			catalog->statistics.hfr_median = Median(hfrs);
+
+			for (int i = 0; i < snrs.size(); ++i)
+			{
+				catalog->statistics.snr_mad += std::abs(catalog->statistics.snr_median - snrs[i]);
+				catalog->statistics.hfr_mad += std::abs(catalog->statistics.hfr_median - hfrs[i]);
+			}
+
+			catalog->statistics.snr_mad /= snrs.size();
+			catalog->statistics.hfr_mad /= snrs.size();
 		}
-		if (residuals.size() > 0)
+		else
 		{
-			catalog->statistics.residual_median = Median(residuals);
-		}
+			catalog->statistics.snr_min = 0;
+			catalog->statistics.hfr_min = 0;
 
-		for (int i = 0; i < catalog->objects.size(); ++i)
-		{
-			catalog->statistics.fwhm_mad += std::abs(catalog->statistics.fwhm_median - fwhms[i]);
-			catalog->statistics.eccentricity_mad += std::abs(catalog->statistics.eccentricity_median - eccentricities[i]);
-			catalog->statistics.snr_mad += std::abs(catalog->statistics.snr_median - snrs[i]);
-			catalog->statistics.hfr_mad += std::abs(catalog->statistics.hfr_median - hfrs[i]);
-			catalog->statistics.residual_mad += std::abs(catalog->statistics.residual_median - residuals[i]);
+			catalog->statistics.snr_mad = 0;
+			catalog->statistics.hfr_mad = 0;
 		}
 
-		if (weight_sum > 0)
+		if (psf_weight_sum > 0)
 		{
-			catalog->statistics.eccentricity_mean /= weight_sum;
-			catalog->statistics.snr_mean /= weight_sum;
-			catalog->statistics.fwhm_mean /= weight_sum;
-			catalog->statistics.hfr_mean /= weight_sum;
-			catalog->statistics.residual_mean /= weight_sum;
+			catalog->statistics.eccentricity_mean /= psf_weight_sum;
+			catalog->statistics.fwhm_mean /= psf_weight_sum;
+			catalog->statistics.residual_mean /= psf_weight_sum;
 		}
 		else
 		{
 			catalog->statistics.eccentricity_mean = 0;
-			catalog->statistics.snr_mean = 0;
 			catalog->statistics.fwhm_mean = 0;
-			catalog->statistics.hfr_mean = 0;
 			catalog->statistics.residual_mean = 0;
 		}
 
-		if (catalog->objects.size() > 0)
+		if (star_weight_sum > 0)
 		{
-			catalog->statistics.fwhm_mad /= catalog->objects.size();
-			catalog->statistics.eccentricity_mad /= catalog->objects.size();
-			catalog->statistics.snr_mad /= catalog->objects.size();
-			catalog->statistics.hfr_mad /= catalog->objects.size();
-			catalog->statistics.residual_mad /= catalog->objects.size();
+			catalog->statistics.snr_mean /= star_weight_sum;
+			catalog->statistics.hfr_mean /= star_weight_sum;
 		}
 		else
 		{
-			catalog->statistics.eccentricity_min = 0;
-			catalog->statistics.snr_min = 0;
-			catalog->statistics.fwhm_min = 0;
-			catalog->statistics.hfr_min = 0;
-			catalog->statistics.residual_min = 0;
-
-			catalog->statistics.fwhm_mad = 0;
-			catalog->statistics.eccentricity_mad = 0;
-			catalog->statistics.snr_mad = 0;
-			catalog->statistics.hfr_mad = 0;
-			catalog->statistics.residual_mad = 0;
+			catalog->statistics.snr_mean = 0;
+			catalog->statistics.hfr_mean = 0;
 		}
 
 		return true;
 	}
 
+	template bool Extractor::Extract(Loader::FITSInfo& fit, std::valarray<uint16_t>& image, Loader::ImageStatistics const* statistics, Catalog** catalog_out, int* status, Callback callback);
+	template bool Extractor::Extract(Loader::FITSInfo& fit, std::valarray<float>& image, Loader::ImageStatistics const* statistics, Catalog** catalog_out, int* status, Callback callback);
+
 }
\ No newline at end of file
@@ -21,6 +21,8 @@
 #include <sep.h>
 #include <cminpack.h>
 #include <vector>
+#include <cmath>
+#include <limits>
 
 #include "fitsloader.h"
 
@@ -67,6 +69,56 @@ namespace Photometry
 
 		// Whether the PSF should be fitted
 		bool psf_fit = true;
+		// Moffat beta of the fitted PSF, rounded to a multiple of 0.5 between 1.5 and 5
+		double psf_beta = 4;
+		// Whether the PSFs of similarly sized stars are fitted together in batches instead
+		// of one by one with lmder. Internal only until it is validated against lmder on
+		// real frames, so not part of PSFParameters.
+		bool psf_batch_fit = false;
+		// Whether PSFs are estimated from the moments of the stars and only fitted
+		// for stars whose estimate is an outlier
+		bool psf_fast = false;
+		// Number of standard deviations (estimated from the MAD) by which the residual or
+		// eccentricity of an estimated PSF must exceed the median to be an outlier
+		double psf_fast_outlier_sigma = 3;
+		// Whether only a subsample of the stars is used for the PSF statistics. Stars are taken
+		// round-robin from the cells of a grid over the image, brightest first, until the
+		// statistics have settled
+		bool psf_subsample = false;
+		// Number of grid cells along each axis of the image
+		int psf_subsample_grid = 8;
+		// Minimum number of stars before the statistics are checked
+		int psf_subsample_min_stars = 200;
+		// Number of stars that are added between two checks of the statistics
+		int psf_subsample_step = 50;
+		// Maximum half width of the 95% confidence interval of the FWHM and HFR medians relative to
+		// the median, and of the eccentricity median in absolute terms, at which the sampling stops
+		double psf_subsample_tolerance = 0.02;
+	};
+
+	// PSF settings of Parameters that are passed in through ComputeStatistics
+	struct PSFParameters
+	{
+		double fast_outlier_sigma;
+		double subsample_tolerance;
+		int subsample_grid;
+		int subsample_min_stars;
+		int subsample_step;
+		bool fast;
+		bool subsample;
+	};
+
+	// How the PSF of an object was determined
+	enum class PSFMethod : int32_t
+	{
+		// shape of the object as extracted, the PSF is not fitted
+		Catalog,
+		// adaptive second moments of the star
+		Moments,
+		// Moffat fit
+		Moffat,
+		// not part of the PSF subsample, only the position is known
+		Unsampled
 	};
 
 	struct PSF
@@ -82,18 +134,22 @@ namespace Photometry
 		double fwhm_y = 0;
 		double fwhm = 0;
 		double eccentricity = 0;
+		PSFMethod method = PSFMethod::Catalog;
 	};
 
 	struct MoffatParameters
 	{
-		double parameters[8]{};
-		double& S0, & S1, & x0, & y0, & alpha_x, & alpha_y, & theta, & beta;
+		// beta is fixed per fit and not part of the fitted parameters
+		static constexpr int count = 7;
+
+		double parameters[count]{};
+		double& S0, & S1, & x0, & y0, & alpha_x, & alpha_y, & theta;
 
 		MoffatParameters() : parameters(),
 			S0(parameters[0]), S1(parameters[1]),
 			x0(parameters[2]), y0(parameters[3]),
 			alpha_x(parameters[4]), alpha_y(parameters[5]),
-			theta(parameters[6]), beta(parameters[7]) {}
+			theta(parameters[6]) {}
 
 		static inline double _S0(const double* parameters) { return parameters[0]; }
 		static inline double _S1(const double* parameters) { return parameters[1]; }
@@ -102,10 +158,9 @@ namespace Photometry
 		static inline double _alpha_x(const double* parameters) { return parameters[4]; }
 		static inline double _alpha_y(const double* parameters) { return parameters[5]; }
 		static inline double _theta(const double* parameters) { return parameters[6]; }
-		static inline double _beta(const double* parameters) { return parameters[7]; }
 
 		// http://www.aspylib.com/doc/aspylib_fitting.html#circular-moffat-psf
-		static inline double FWHM(const double alpha) { return 0.869958884 * alpha; }
+		static inline double FWHM(const double alpha, const double beta) { return 2.0 * alpha * std::sqrt(std::pow(2.0, 1.0 / beta) - 1.0); }
 	};
 
 	struct FitParameters
@@ -115,6 +170,22 @@ namespace Photometry
 		MoffatParameters moffat{};
 	};
 
+	// Crop around a star and the initial estimate of its Moffat parameters
+	struct PSFCrop
+	{
+		std::vector<double> data;
+		size_t x1 = 0, y1 = 0;
+		size_t w = 0, h = 0;
+		double parameters[MoffatParameters::count]{};
+	};
+
+	// Residual and eccentricity above which a PSF estimated from the moments is an outlier
+	struct PSFOutlierLimits
+	{
+		double residual = std::numeric_limits<double>::infinity();
+		double eccentricity = std::numeric_limits<double>::infinity();
+	};
+
 	struct Object
 	{
 		int catalog_index = 0;
@@ -184,6 +255,11 @@ namespace Photometry
 		double residual_mean = 0;
 		double residual_median = 0;
 		double residual_mad = 0;
+
+		// Number of stars the PSF statistics are based on
+		int stars_used = 0;
+		// Number of stars that passed the SNR and HFR cuts
+		int stars_available = 0;
 	};
 
 	struct Catalog
@@ -223,27 +299,67 @@ namespace Photometry
 		{
 		}
 
-		bool Extract(Loader::FITSInfo& fit, std::valarray<float>& image, Catalog** catalog, int* status, Callback callback);
+		// statistics is optional and must have been collected from image by the decoder
+		template<typename T>
+		bool Extract(Loader::FITSInfo& fit, std::valarray<T>& image, Loader::ImageStatistics const* statistics, Catalog** catalog, int* status, Callback callback);
 
 	private:
 		Parameters m_parameters;
 
-		template<typename T>
-		double SortedMedian(std::vector<T>& sorted_values);
-
 		template<typename T>
 		double Median(std::vector<T>& values);
 
 		template<typename T>
 		double Median(typename std::vector<T>::iterator begin, typename std::vector<T>::iterator end);
 
-		void Winsorize(std::vector<double>& sorted_values, double fraction);
+		double WinsorizedMean(double* values, size_t count, double fraction);
+
+		bool MeasureObject(sep_image const& simage, sep_catalog const* sep_objects, int i, Object* obj);
+
+		int MoffatBetaX2() const;
+
+		template<typename T>
+		bool FitPSF(std::valarray<T>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSF* psf, int* status);
+
+		template<int beta_x2, typename T>
+		bool FitMoffatPSF(std::valarray<T>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSF* psf, int* status);
+
+		template<int beta_x2>
+		bool FitCroppedPSF(PSFCrop& crop, PSF* psf, int* status);
+
+		template<typename T>
+		bool FitPSFs(std::valarray<T>& image, int image_width, sep_catalog const* sep_objects, std::vector<Object>& objects, PSFOutlierLimits const* limits, Callback callback);
+
+		template<typename T>
+		bool SubsamplePSFs(std::valarray<T>& image, int image_width, int image_height, sep_catalog const* sep_objects, std::vector<Object>& objects, Callback callback);
+
+		bool IsSubsampleSettled(std::vector<Object> const& objects, double beta);
+
+		PSFOutlierLimits ComputeOutlierLimits(std::vector<Object> const& objects);
+
+		template<int beta_x2, typename T>
+		void EstimateMoffatPSFs(std::valarray<T>& image, int image_width, sep_catalog const* sep_objects, std::vector<Object>& objects);
+
+		template<int beta_x2, typename T>
+		bool FitMoffatPSFs(std::valarray<T>& image, int image_width, sep_catalog const* sep_objects, std::vector<Object>& objects, PSFOutlierLimits const* limits, Callback callback);
+
+		template<int beta_x2>
+		bool FitCroppedPSFs(std::vector<PSFCrop>& crops, std::vector<int> indices, std::vector<Object>& objects, std::vector<char>& determined, Callback callback);
+
+		template<int beta_x2>
+		bool EstimatePSF(PSFCrop& crop, PSF* psf);
+
+		template<typename T>
+		void CropPSF(std::valarray<T>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSFCrop* crop);
 
-		bool FitPSF(std::valarray<float>& image, int image_width, double x, double y, double xmin, double ymin, double xmax, double ymax, PSF* psf, int* status);
+		template<int beta_x2>
+		bool FinishPSF(PSFCrop& crop, double const* fitted, PSF* psf);
 
-		void FitError(double* crop, size_t w, size_t h, FitParameters& fit, double* star_residual, double* mean_signal);
+		template<int beta_x2, int count>
+		void FitError(FitParameters& fit, double const* thetas, double* star_residuals, double* mean_signals);
 
-		static int FitMoffat(void* p, int m, int n, const double* a, double* fvec, int iflag);
+		template<int beta_x2>
+		static int FitMoffat(void* p, int m, int n, const double* a, double* fvec, double* fjac, int ldfjac, int iflag);
 	};
 
 }
\ No newline at end of file
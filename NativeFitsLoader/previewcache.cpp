@@ -0,0 +1,267 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include "framework.h"
+#include "previewcache.h"
+#include "cachekey.h"
+#include "qoi.h"
+
+namespace Cache
+{
+
+	uint32_t const preview_magic = 0x50545246; // "FRTP"
+	uint32_t const preview_version = 1;
+
+	// Layout of a cache file: the header, histogram_size uint32_t
+	// histogram bins and then encoded_size bytes of QOI chunks
+	struct PreviewHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t key;
+		FileIdentity identity;
+		int32_t nx;
+		int32_t ny;
+		int32_t nc;
+		uint32_t histogram_size;
+		uint32_t encoded_size;
+	};
+
+	// Read-only view of a whole file
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(std::string const& path)
+		{
+			m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE)
+			{
+				return;
+			}
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+			{
+				return;
+			}
+
+			m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (m_mapping == nullptr)
+			{
+				return;
+			}
+
+			m_data = static_cast<unsigned char const*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+			if (m_data != nullptr)
+			{
+				m_size = static_cast<size_t>(size.QuadPart);
+			}
+		}
+
+		~MappedFile()
+		{
+			if (m_data != nullptr)
+			{
+				UnmapViewOfFile(m_data);
+			}
+			if (m_mapping != nullptr)
+			{
+				CloseHandle(m_mapping);
+			}
+			if (m_file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(m_file);
+			}
+		}
+
+		MappedFile(MappedFile const&) = delete;
+		MappedFile& operator=(MappedFile const&) = delete;
+
+		unsigned char const* data() const { return m_data; }
+		size_t size() const { return m_size; }
+
+	private:
+		HANDLE m_file = INVALID_HANDLE_VALUE;
+		HANDLE m_mapping = nullptr;
+		unsigned char const* m_data = nullptr;
+		size_t m_size = 0;
+	};
+
+	bool GetFileIdentity(std::string const& file, FileIdentity* identity)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA attributes;
+		if (!GetFileAttributesExA(file.c_str(), GetFileExInfoStandard, &attributes))
+		{
+			return false;
+		}
+
+		identity->size = (static_cast<uint64_t>(attributes.nFileSizeHigh) << 32) | attributes.nFileSizeLow;
+		identity->write_time = (static_cast<uint64_t>(attributes.ftLastWriteTime.dwHighDateTime) << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+		return true;
+	}
+
+	uint64_t GetPreviewKey(std::string const& file, int max_size, Loader::FITSImageLoaderParameters const& props)
+	{
+		KeyHash hash;
+		hash.Add(file.data(), file.size());
+		hash.Add(max_size);
+		hash.Add(props);
+		return hash.value();
+	}
+
+	std::string GetPreviewPath(std::string const& directory, uint64_t key)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "%016llx.frtp", static_cast<unsigned long long>(key));
+
+		std::string path = directory;
+		if (!path.empty() && path.back() != '\\' && path.back() != '/')
+		{
+			path += '\\';
+		}
+		return path + name;
+	}
+
+	bool StorePreview(std::string const& directory, std::string const& file, int max_size, Loader::FITSImageLoaderParameters const& props,
+		unsigned char const* data, Loader::FITSImageDim const& dim, size_t row_pitch, uint32_t const* histogram, size_t histogram_size)
+	{
+		if (data == nullptr || dim.nx <= 0 || dim.ny <= 0 || (histogram == nullptr && histogram_size > 0))
+		{
+			return false;
+		}
+
+		PreviewHeader header{};
+		header.magic = preview_magic;
+		header.version = preview_version;
+		header.key = GetPreviewKey(file, max_size, props);
+		header.nx = dim.nx;
+		header.ny = dim.ny;
+		header.nc = dim.nc;
+		header.histogram_size = static_cast<uint32_t>(histogram_size);
+
+		if (!GetFileIdentity(file, &header.identity))
+		{
+			return false;
+		}
+
+		std::vector<unsigned char> encoded;
+		EncodeQOI(data, dim.nx, dim.ny, row_pitch == 0 ? static_cast<size_t>(dim.nx) * 4 : row_pitch, encoded);
+		header.encoded_size = static_cast<uint32_t>(encoded.size());
+
+		CreateDirectoryA(directory.c_str(), nullptr);
+
+		// written to a file of its own first and then moved over the
+		// entry, so that readers see either the old or the new entry
+		std::string const path = GetPreviewPath(directory, header.key);
+		std::string const temp_path = path + "." + std::to_string(GetCurrentThreadId()) + ".tmp";
+
+		HANDLE temp_file = CreateFileA(temp_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (temp_file == INVALID_HANDLE_VALUE)
+		{
+			return false;
+		}
+
+		auto write = [&](void const* buffer, size_t size)
+		{
+			DWORD written = 0;
+			return WriteFile(temp_file, buffer, static_cast<DWORD>(size), &written, nullptr) && written == size;
+		};
+
+		bool success = write(&header, sizeof(header))
+			&& (histogram_size == 0 || write(histogram, histogram_size * sizeof(uint32_t)))
+			&& write(encoded.data(), encoded.size());
+
+		CloseHandle(temp_file);
+
+		success = success && MoveFileExA(temp_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+		if (!success)
+		{
+			DeleteFileA(temp_path.c_str());
+		}
+
+		return success;
+	}
+
+	bool LoadPreview(std::string const& directory, std::string const& file, int max_size, Loader::FITSImageLoaderParameters const& props,
+		unsigned char* data, size_t data_size, size_t row_pitch, uint32_t* histogram, size_t histogram_size, Loader::FITSImageDim* dim)
+	{
+		FileIdentity identity;
+		if (!GetFileIdentity(file, &identity))
+		{
+			return false;
+		}
+
+		uint64_t const key = GetPreviewKey(file, max_size, props);
+
+		MappedFile mapped(GetPreviewPath(directory, key));
+		if (mapped.data() == nullptr || mapped.size() < sizeof(PreviewHeader))
+		{
+			return false;
+		}
+
+		PreviewHeader header;
+		memcpy(&header, mapped.data(), sizeof(header));
+
+		if (header.magic != preview_magic || header.version != preview_version || header.key != key ||
+			header.identity.size != identity.size || header.identity.write_time != identity.write_time ||
+			header.nx <= 0 || header.ny <= 0 ||
+			mapped.size() < sizeof(PreviewHeader) + header.histogram_size * sizeof(uint32_t) + header.encoded_size)
+		{
+			return false;
+		}
+
+		if (dim)
+		{
+			dim->nx = header.nx;
+			dim->ny = header.ny;
+			dim->nc = header.nc;
+			dim->n = static_cast<uint32_t>(header.nx) * static_cast<uint32_t>(header.ny) * static_cast<uint32_t>(header.nc);
+		}
+
+		size_t const row_size = static_cast<size_t>(header.nx) * 4;
+		if (row_pitch == 0)
+		{
+			row_pitch = row_size;
+		}
+
+		if (data == nullptr || row_pitch < row_size || data_size < row_pitch * (header.ny - 1) + row_size)
+		{
+			return false;
+		}
+
+		unsigned char const* const histogram_data = mapped.data() + sizeof(PreviewHeader);
+		if (histogram != nullptr && histogram_size > 0)
+		{
+			// a histogram of a different size can't be used
+			if (histogram_size != header.histogram_size)
+			{
+				return false;
+			}
+			memcpy(histogram, histogram_data, histogram_size * sizeof(uint32_t));
+		}
+
+		unsigned char const* const encoded = histogram_data + header.histogram_size * sizeof(uint32_t);
+		return DecodeQOI(encoded, header.encoded_size, header.nx, header.ny, data, row_pitch);
+	}
+
+}
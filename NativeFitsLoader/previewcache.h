@@ -0,0 +1,58 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "fitsattributes.h"
+#include "fitsloader.h"
+
+namespace Cache
+{
+
+	// Identifies the contents of a file without reading it,
+	// a cached preview is only used while this matches
+	struct FileIdentity
+	{
+		uint64_t size = 0;
+		uint64_t write_time = 0;
+	};
+
+	bool GetFileIdentity(std::string const& file, FileIdentity* identity);
+
+	// Key of the preview of a file rendered with the given parameters
+	uint64_t GetPreviewKey(std::string const& file, int max_size, Loader::FITSImageLoaderParameters const& props);
+
+	std::string GetPreviewPath(std::string const& directory, uint64_t key);
+
+	// Stores an already stretched BGRA32 preview and its histogram. The pixels
+	// are compressed losslessly and the file is replaced atomically, so that
+	// concurrent readers never see a partially written entry.
+	bool StorePreview(std::string const& directory, std::string const& file, int max_size, Loader::FITSImageLoaderParameters const& props,
+		unsigned char const* data, Loader::FITSImageDim const& dim, size_t row_pitch, uint32_t const* histogram, size_t histogram_size);
+
+	// Loads a preview stored by StorePreview with a single mapping of the cache
+	// file. Returns false if there is no entry or the file has changed since.
+	// The dimensions are written before the pixels, so a call with no data
+	// can be used to size the buffer. Rows of data are row_pitch bytes apart.
+	bool LoadPreview(std::string const& directory, std::string const& file, int max_size, Loader::FITSImageLoaderParameters const& props,
+		unsigned char* data, size_t data_size, size_t row_pitch, uint32_t* histogram, size_t histogram_size, Loader::FITSImageDim* dim);
+
+}
@@ -0,0 +1,99 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <valarray>
+#include <algorithm>
+#include <type_traits>
+
+#include "fitsattributes.h"
+#include "histogram.h"
+
+namespace Processing
+{
+
+	// Smallest integer factor by which an image must be
+	// shrunk so that neither side exceeds max_size
+	inline int GetPyramidFactor(Loader::FITSImageDim const& dim, int max_size)
+	{
+		int const size = std::max(dim.nx, dim.ny);
+		if (max_size <= 0 || size <= max_size)
+		{
+			return 1;
+		}
+		return (size + max_size - 1) / max_size;
+	}
+
+	// Shrinks every channel of in by averaging factor x factor blocks.
+	// Pixels that do not fill a whole block at the right and bottom
+	// edges are dropped.
+	template<typename T>
+	Loader::FITSImageDim DownsampleImage(std::valarray<T> const& in, Loader::FITSImageDim const& in_dim, int factor, std::valarray<T>& out)
+	{
+		Loader::FITSImageDim out_dim = in_dim;
+		out_dim.nx = std::max(1, in_dim.nx / factor);
+		out_dim.ny = std::max(1, in_dim.ny / factor);
+		out_dim.n = out_dim.nx * out_dim.ny * out_dim.nc;
+
+		if (out.size() != static_cast<size_t>(out_dim.n))
+		{
+			out.resize(out_dim.n);
+		}
+
+		int const block_width = std::min(factor, in_dim.nx);
+		int const block_height = std::min(factor, in_dim.ny);
+		float const normalization = 1.0f / (block_width * block_height);
+		float const rounding = std::is_integral<T>::value ? 0.5f : 0.0f;
+
+		size_t const in_pixels_per_channel = static_cast<size_t>(in_dim.nx) * in_dim.ny;
+		size_t const out_pixels_per_channel = static_cast<size_t>(out_dim.nx) * out_dim.ny;
+
+		T const* const in_data = &in[0];
+		T* const out_data = &out[0];
+
+		ParallelForRowTiles(out_dim.ny, GetRowTileCount(out_dim.nx * factor, out_dim.ny * factor), [&](size_t, size_t row_start, size_t row_end)
+			{
+				for (int c = 0; c < out_dim.nc; ++c)
+				{
+					T const* const in_channel = in_data + c * in_pixels_per_channel;
+					T* const out_channel = out_data + c * out_pixels_per_channel;
+
+					for (size_t y = row_start; y < row_end; ++y)
+					{
+						for (int x = 0; x < out_dim.nx; ++x)
+						{
+							float sum = 0.0f;
+							for (int by = 0; by < block_height; ++by)
+							{
+								T const* const in_row = in_channel + (y * factor + by) * in_dim.nx + x * factor;
+								for (int bx = 0; bx < block_width; ++bx)
+								{
+									sum += static_cast<float>(in_row[bx]);
+								}
+							}
+							out_channel[y * out_dim.nx + x] = static_cast<T>(sum * normalization + rounding);
+						}
+					}
+				}
+			});
+
+		return out_dim;
+	}
+
+}
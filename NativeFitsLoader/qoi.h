@@ -0,0 +1,251 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace Cache
+{
+
+	// Lossless codec for BGRA32 images using the chunk format of QOI, the
+	// "Quite OK Image" format. The bytes of a pixel are encoded in memory
+	// order, so the chunks hold B, G, R and A where QOI stores R, G, B and A.
+	// Only the chunks are written, the caller stores the image size.
+
+	enum QOIOp : unsigned char
+	{
+		QOI_OP_INDEX = 0x00,
+		QOI_OP_DIFF = 0x40,
+		QOI_OP_LUMA = 0x80,
+		QOI_OP_RUN = 0xc0,
+		QOI_OP_RGB = 0xfe,
+		QOI_OP_RGBA = 0xff,
+		QOI_MASK_2 = 0xc0
+	};
+
+	union QOIPixel
+	{
+		unsigned char v[4];
+		uint32_t value;
+	};
+
+	inline int QOIHash(QOIPixel const& px)
+	{
+		return (px.v[0] * 3 + px.v[1] * 5 + px.v[2] * 7 + px.v[3] * 11) % 64;
+	}
+
+	// Upper bound of the encoded size of an image with the given number of pixels
+	inline size_t GetQOIMaxEncodedSize(size_t pixels)
+	{
+		return pixels * 5;
+	}
+
+	// Encodes nx x ny BGRA32 pixels whose rows are row_pitch bytes apart
+	inline void EncodeQOI(unsigned char const* pixels, int nx, int ny, size_t row_pitch, std::vector<unsigned char>& out)
+	{
+		out.resize(GetQOIMaxEncodedSize(static_cast<size_t>(nx) * ny));
+		unsigned char* const begin = out.data();
+		unsigned char* p = begin;
+
+		QOIPixel index[64] = {};
+		QOIPixel prev;
+		prev.v[0] = prev.v[1] = prev.v[2] = 0;
+		prev.v[3] = 255;
+
+		int run = 0;
+
+		for (int y = 0; y < ny; ++y)
+		{
+			unsigned char const* row = pixels + y * row_pitch;
+			for (int x = 0; x < nx; ++x)
+			{
+				QOIPixel px;
+				px.v[0] = row[x * 4 + 0];
+				px.v[1] = row[x * 4 + 1];
+				px.v[2] = row[x * 4 + 2];
+				px.v[3] = row[x * 4 + 3];
+
+				if (px.value == prev.value)
+				{
+					if (++run == 62)
+					{
+						*p++ = QOI_OP_RUN | (run - 1);
+						run = 0;
+					}
+					continue;
+				}
+
+				if (run > 0)
+				{
+					*p++ = QOI_OP_RUN | (run - 1);
+					run = 0;
+				}
+
+				int const hash = QOIHash(px);
+				if (index[hash].value == px.value)
+				{
+					*p++ = QOI_OP_INDEX | hash;
+				}
+				else
+				{
+					index[hash] = px;
+
+					if (px.v[3] == prev.v[3])
+					{
+						int const d0 = static_cast<signed char>(px.v[0] - prev.v[0]);
+						int const d1 = static_cast<signed char>(px.v[1] - prev.v[1]);
+						int const d2 = static_cast<signed char>(px.v[2] - prev.v[2]);
+						int const d0_d1 = d0 - d1;
+						int const d2_d1 = d2 - d1;
+
+						if (d0 > -3 && d0 < 2 && d1 > -3 && d1 < 2 && d2 > -3 && d2 < 2)
+						{
+							*p++ = QOI_OP_DIFF | (d0 + 2) << 4 | (d1 + 2) << 2 | (d2 + 2);
+						}
+						else if (d0_d1 > -9 && d0_d1 < 8 && d1 > -33 && d1 < 32 && d2_d1 > -9 && d2_d1 < 8)
+						{
+							*p++ = QOI_OP_LUMA | (d1 + 32);
+							*p++ = static_cast<unsigned char>((d0_d1 + 8) << 4 | (d2_d1 + 8));
+						}
+						else
+						{
+							*p++ = QOI_OP_RGB;
+							*p++ = px.v[0];
+							*p++ = px.v[1];
+							*p++ = px.v[2];
+						}
+					}
+					else
+					{
+						*p++ = QOI_OP_RGBA;
+						*p++ = px.v[0];
+						*p++ = px.v[1];
+						*p++ = px.v[2];
+						*p++ = px.v[3];
+					}
+				}
+
+				prev = px;
+			}
+		}
+
+		if (run > 0)
+		{
+			*p++ = QOI_OP_RUN | (run - 1);
+		}
+
+		out.resize(p - begin);
+	}
+
+	// Decodes nx x ny BGRA32 pixels into rows that are row_pitch bytes apart.
+	// Returns false if the data ends before the image is complete.
+	inline bool DecodeQOI(unsigned char const* data, size_t size, int nx, int ny, unsigned char* pixels, size_t row_pitch)
+	{
+		unsigned char const* p = data;
+		unsigned char const* const end = data + size;
+
+		QOIPixel index[64] = {};
+		QOIPixel px;
+		px.v[0] = px.v[1] = px.v[2] = 0;
+		px.v[3] = 255;
+
+		int run = 0;
+
+		for (int y = 0; y < ny; ++y)
+		{
+			unsigned char* row = pixels + y * row_pitch;
+			for (int x = 0; x < nx; ++x)
+			{
+				if (run > 0)
+				{
+					--run;
+				}
+				else
+				{
+					if (p >= end)
+					{
+						return false;
+					}
+
+					unsigned char const b1 = *p++;
+
+					if (b1 == QOI_OP_RGB)
+					{
+						if (end - p < 3)
+						{
+							return false;
+						}
+						px.v[0] = *p++;
+						px.v[1] = *p++;
+						px.v[2] = *p++;
+					}
+					else if (b1 == QOI_OP_RGBA)
+					{
+						if (end - p < 4)
+						{
+							return false;
+						}
+						px.v[0] = *p++;
+						px.v[1] = *p++;
+						px.v[2] = *p++;
+						px.v[3] = *p++;
+					}
+					else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX)
+					{
+						px = index[b1];
+					}
+					else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF)
+					{
+						px.v[0] += ((b1 >> 4) & 0x03) - 2;
+						px.v[1] += ((b1 >> 2) & 0x03) - 2;
+						px.v[2] += (b1 & 0x03) - 2;
+					}
+					else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA)
+					{
+						if (p >= end)
+						{
+							return false;
+						}
+						unsigned char const b2 = *p++;
+						int const d1 = (b1 & 0x3f) - 32;
+						px.v[0] += d1 - 8 + ((b2 >> 4) & 0x0f);
+						px.v[1] += d1;
+						px.v[2] += d1 - 8 + (b2 & 0x0f);
+					}
+					else
+					{
+						run = b1 & 0x3f;
+					}
+
+					index[QOIHash(px)] = px;
+				}
+
+				row[x * 4 + 0] = px.v[0];
+				row[x * 4 + 1] = px.v[1];
+				row[x * 4 + 2] = px.v[2];
+				row[x * 4 + 3] = px.v[3];
+			}
+		}
+
+		return true;
+	}
+
+}
@@ -0,0 +1,401 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <valarray>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "fitsattributes.h"
+#include "imagestatistics.h"
+#include "histogram.h"
+#include "stretch.h"
+
+namespace Processing
+{
+
+	struct RenderParameters
+	{
+		// width of the outline drawn around mono images, 0 for none
+		int outline_border = 0;
+
+		// outline colour per BGR channel: value * scale + offset
+		float outline_scale[3] = { 0.0f, 0.0f, 0.0f };
+		float outline_offset[3] = { 0.0f, 0.0f, 0.0f };
+
+		float saturation = 1.0f;
+	};
+
+	// Stretches runs of values of one channel to 8 bits
+	template<typename T, bool lut = UseStretchLUT<T>::value>
+	class ChannelStretcher;
+
+	template<typename T>
+	class ChannelStretcher<T, true>
+	{
+	public:
+		// the histogram is computed up front from the input values
+		static bool const bins_per_pixel = false;
+
+		ChannelStretcher(ChannelStretchParameters const& channel_params) :
+			m_stretch(channel_params), m_lut(ComputeStretchLUT<T>(m_stretch))
+		{
+		}
+
+		void ComputeHistogram(T const* data, size_t n, std::vector<uint32_t> const* value_histogram, uint32_t* histogram, size_t histogram_size) const
+		{
+			ComputeStretchedHistogram(data, n, m_stretch, value_histogram, histogram, histogram_size);
+		}
+
+		inline void Stretch(T const* in, size_t count, uint8_t* out, float*) const
+		{
+			uint8_t const* const lut = m_lut.data();
+			for (size_t i = 0; i < count; ++i)
+			{
+				out[i] = lut[in[i]];
+			}
+		}
+
+	private:
+		StretchFunction m_stretch;
+		std::vector<uint8_t> m_lut;
+	};
+
+	template<typename T>
+	class ChannelStretcher<T, false>
+	{
+	public:
+		// the histogram is binned from the stretched values, see Stretch
+		static bool const bins_per_pixel = true;
+
+		ChannelStretcher(ChannelStretchParameters const& channel_params) :
+			m_stretch(channel_params)
+		{
+		}
+
+		void ComputeHistogram(T const*, size_t, std::vector<uint32_t> const*, uint32_t*, size_t) const
+		{
+		}
+
+		// stretched receives the unrounded output if it is not null
+		inline void Stretch(T const* in, size_t count, uint8_t* out, float* stretched) const
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				float const value = m_stretch(in[i]);
+				out[i] = static_cast<uint8_t>(value);
+				if (stretched)
+				{
+					stretched[i] = value;
+				}
+			}
+		}
+
+	private:
+		StretchFunction m_stretch;
+	};
+
+	inline void PackOutlineBGRA32(uint8_t v, RenderParameters const& render_params, unsigned char* out)
+	{
+		out[0] = static_cast<unsigned char>(v * render_params.outline_scale[0] + render_params.outline_offset[0]);
+		out[1] = static_cast<unsigned char>(v * render_params.outline_scale[1] + render_params.outline_offset[1]);
+		out[2] = static_cast<unsigned char>(v * render_params.outline_scale[2] + render_params.outline_offset[2]);
+		out[3] = 255;
+	}
+
+	inline void PackOutlineBGRA32(uint8_t const* values, int count, RenderParameters const& render_params, unsigned char* out)
+	{
+		for (int x = 0; x < count; ++x)
+		{
+			PackOutlineBGRA32(values[x], render_params, out + x * 4);
+		}
+	}
+
+	// Writes count grey pixels as BGRA
+	inline void PackGrayBGRA32(uint8_t const* values, int count, unsigned char* out)
+	{
+		int x = 0;
+#ifdef PROCESSING_SSE2
+		__m128i const alpha = _mm_set1_epi8(-1);
+		for (; x + 16 <= count; x += 16)
+		{
+			__m128i const v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(values + x));
+			__m128i const vv_lo = _mm_unpacklo_epi8(v, v);
+			__m128i const vv_hi = _mm_unpackhi_epi8(v, v);
+			__m128i const va_lo = _mm_unpacklo_epi8(v, alpha);
+			__m128i const va_hi = _mm_unpackhi_epi8(v, alpha);
+
+			__m128i* const out_ptr = reinterpret_cast<__m128i*>(out + x * 4);
+			_mm_storeu_si128(out_ptr + 0, _mm_unpacklo_epi16(vv_lo, va_lo));
+			_mm_storeu_si128(out_ptr + 1, _mm_unpackhi_epi16(vv_lo, va_lo));
+			_mm_storeu_si128(out_ptr + 2, _mm_unpacklo_epi16(vv_hi, va_hi));
+			_mm_storeu_si128(out_ptr + 3, _mm_unpackhi_epi16(vv_hi, va_hi));
+		}
+#endif
+		for (; x < count; ++x)
+		{
+			unsigned char* const pixel = out + x * 4;
+			pixel[0] = values[x];
+			pixel[1] = values[x];
+			pixel[2] = values[x];
+			pixel[3] = 255;
+		}
+	}
+
+	// The outline covers the first and last border + 1 rows and columns.
+	// Those are written separately so that the interior needs no checks.
+	inline void PackMonoRowBGRA32(uint8_t const* values, int y, Loader::FITSImageDim const& size, RenderParameters const& render_params, unsigned char* out_row)
+	{
+		int const border = render_params.outline_border;
+		if (border <= 0)
+		{
+			PackGrayBGRA32(values, size.nx, out_row);
+			return;
+		}
+
+		if (y <= border || y >= size.ny - 1 - border)
+		{
+			PackOutlineBGRA32(values, size.nx, render_params, out_row);
+			return;
+		}
+
+		int const interior_start = std::min(size.nx, border + 1);
+		int const interior_end = std::max(interior_start, size.nx - 1 - border);
+
+		PackOutlineBGRA32(values, interior_start, render_params, out_row);
+		PackGrayBGRA32(values + interior_start, interior_end - interior_start, out_row + interior_start * 4);
+		PackOutlineBGRA32(values + interior_end, size.nx - interior_end, render_params, out_row + interior_end * 4);
+	}
+
+	// Scales the HSV saturation of a pixel by saturation, keeping hue and value.
+	// In HSV a channel c equals v - s * (v - min) * f(hue), so scaling s amounts
+	// to c' = v - factor * (v - c), where factor is saturation limited such that
+	// the smallest channel stays non-negative. No conversion to HSV is needed.
+	inline void PackColorBGRA32(uint8_t r, uint8_t g, uint8_t b, float saturation, unsigned char* out)
+	{
+		float const v = static_cast<float>(std::max(r, std::max(g, b)));
+		float const range = v - static_cast<float>(std::min(r, std::min(g, b)));
+		float const factor = range > 0.0f ? std::min(v / range, saturation) : saturation;
+
+		auto saturate = [&](uint8_t c)
+		{
+			float const value = v - factor * (v - static_cast<float>(c));
+			return static_cast<unsigned char>(std::lrint(std::min(255.0f, std::max(0.0f, value))));
+		};
+
+		out[2] = saturate(r);
+		out[1] = saturate(g);
+		out[0] = saturate(b);
+		out[3] = 255;
+	}
+
+#ifdef PROCESSING_SSE2
+	inline void UnpackFloats(__m128i values, __m128* out)
+	{
+		__m128i const zero = _mm_setzero_si128();
+		__m128i const lo = _mm_unpacklo_epi8(values, zero);
+		__m128i const hi = _mm_unpackhi_epi8(values, zero);
+		out[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+		out[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+		out[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+		out[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+	}
+
+	inline __m128i PackFloats(__m128 const* values)
+	{
+		__m128i const lo = _mm_packs_epi32(_mm_cvtps_epi32(values[0]), _mm_cvtps_epi32(values[1]));
+		__m128i const hi = _mm_packs_epi32(_mm_cvtps_epi32(values[2]), _mm_cvtps_epi32(values[3]));
+		return _mm_packus_epi16(lo, hi);
+	}
+
+	// Same as PackColorBGRA32 for 16 pixels at once
+	inline void PackColorBGRA32x16(uint8_t const* r, uint8_t const* g, uint8_t const* b, float saturation, unsigned char* out)
+	{
+		__m128i r8 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(r));
+		__m128i g8 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(g));
+		__m128i b8 = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b));
+
+		if (saturation != 1.0f)
+		{
+			__m128i const v8 = _mm_max_epu8(r8, _mm_max_epu8(g8, b8));
+			__m128i const range8 = _mm_sub_epi8(v8, _mm_min_epu8(r8, _mm_min_epu8(g8, b8)));
+
+			__m128 v[4], range[4], rf[4], gf[4], bf[4];
+			UnpackFloats(v8, v);
+			UnpackFloats(range8, range);
+			UnpackFloats(r8, rf);
+			UnpackFloats(g8, gf);
+			UnpackFloats(b8, bf);
+
+			__m128 const saturation_ps = _mm_set1_ps(saturation);
+			__m128 const two = _mm_set1_ps(2.0f);
+
+			for (int i = 0; i < 4; ++i)
+			{
+				// reciprocal refined by one Newton step, a range of 0 yields NaN
+				// and minps then returns the second operand, i.e. saturation
+				__m128 reciprocal = _mm_rcp_ps(range[i]);
+				reciprocal = _mm_mul_ps(reciprocal, _mm_sub_ps(two, _mm_mul_ps(range[i], reciprocal)));
+				__m128 const factor = _mm_min_ps(_mm_mul_ps(v[i], reciprocal), saturation_ps);
+
+				rf[i] = _mm_sub_ps(v[i], _mm_mul_ps(factor, _mm_sub_ps(v[i], rf[i])));
+				gf[i] = _mm_sub_ps(v[i], _mm_mul_ps(factor, _mm_sub_ps(v[i], gf[i])));
+				bf[i] = _mm_sub_ps(v[i], _mm_mul_ps(factor, _mm_sub_ps(v[i], bf[i])));
+			}
+
+			r8 = PackFloats(rf);
+			g8 = PackFloats(gf);
+			b8 = PackFloats(bf);
+		}
+
+		__m128i const alpha = _mm_set1_epi8(-1);
+		__m128i const bg_lo = _mm_unpacklo_epi8(b8, g8);
+		__m128i const bg_hi = _mm_unpackhi_epi8(b8, g8);
+		__m128i const ra_lo = _mm_unpacklo_epi8(r8, alpha);
+		__m128i const ra_hi = _mm_unpackhi_epi8(r8, alpha);
+
+		__m128i* const out_ptr = reinterpret_cast<__m128i*>(out);
+		_mm_storeu_si128(out_ptr + 0, _mm_unpacklo_epi16(bg_lo, ra_lo));
+		_mm_storeu_si128(out_ptr + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+		_mm_storeu_si128(out_ptr + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+		_mm_storeu_si128(out_ptr + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+	}
+#endif
+
+	inline void PackColorRowBGRA32(uint8_t const* values, Loader::FITSImageDim const& size, RenderParameters const& render_params, unsigned char* out_row)
+	{
+		uint8_t const* const r = values;
+		uint8_t const* const g = values + size.nx;
+		uint8_t const* const b = values + size.nx * 2;
+
+		int x = 0;
+#ifdef PROCESSING_SSE2
+		for (; x + 16 <= size.nx; x += 16)
+		{
+			PackColorBGRA32x16(r + x, g + x, b + x, render_params.saturation, out_row + x * 4);
+		}
+
+		if (x < size.nx)
+		{
+			// the last pixels go through a padded copy so
+			// that all pixels of a row are computed alike
+			int const count = size.nx - x;
+			uint8_t tail[3][16] = {};
+			unsigned char tail_out[16 * 4];
+			std::copy(r + x, r + size.nx, tail[0]);
+			std::copy(g + x, g + size.nx, tail[1]);
+			std::copy(b + x, b + size.nx, tail[2]);
+			PackColorBGRA32x16(tail[0], tail[1], tail[2], render_params.saturation, tail_out);
+			std::copy(tail_out, tail_out + count * 4, out_row + x * 4);
+		}
+#else
+		for (; x < size.nx; ++x)
+		{
+			PackColorBGRA32(r[x], g[x], b[x], render_params.saturation, out_row + x * 4);
+		}
+#endif
+	}
+
+	// Stretches data and writes the final BGRA pixels to out_data in a single
+	// pass over row tiles, without an intermediate copy of the image. Rows of
+	// out_data are row_pitch bytes apart, 0 for rows without padding. histogram
+	// receives the stretched histogram of the first channel. statistics is
+	// optional and must have been collected from data.
+	// Returns false if the render was cancelled, out_data and histogram are
+	// incomplete then.
+	template<typename T>
+	bool RenderImageBGRA32(std::valarray<T> const& data, Loader::FITSImageDim const& size, ImageStretchParameters const& image_params, RenderParameters const& render_params, uint32_t* histogram, size_t histogram_size, Loader::ImageStatistics const* statistics, unsigned char* out_data, size_t row_pitch, CancellationFlag cancel = nullptr)
+	{
+		if (row_pitch == 0)
+		{
+			row_pitch = static_cast<size_t>(size.nx) * 4;
+		}
+
+		using Stretcher = ChannelStretcher<T>;
+
+		int const nc = size.nc == 1 ? 1 : 3;
+		size_t const pixels_per_channel = static_cast<size_t>(size.nx) * size.ny;
+		T const* const in_data = &data[0];
+
+		std::vector<Stretcher> stretchers;
+		for (int c = 0; c < nc; ++c)
+		{
+			stretchers.emplace_back(image_params[c]);
+		}
+
+		bool const bins_per_pixel = histogram != nullptr && Stretcher::bins_per_pixel;
+		if (histogram != nullptr && !Stretcher::bins_per_pixel)
+		{
+			stretchers[0].ComputeHistogram(in_data, pixels_per_channel, GetValueHistogram(statistics, 0), histogram, histogram_size);
+		}
+
+		float const histogram_scale = 1.0f / StretchFunction::max_output * (histogram_size - 1);
+		float const max_bin = static_cast<float>(histogram_size - 1);
+
+		size_t const num_tiles = GetRowTileCount(size.nx, size.ny);
+		std::vector<HistogramAccumulator> accumulators(bins_per_pixel ? num_tiles : 0, HistogramAccumulator(histogram_size));
+
+		ParallelForRowTiles(size.ny, num_tiles, [&](size_t tile, size_t row_start, size_t row_end)
+			{
+				std::vector<uint8_t> row(static_cast<size_t>(size.nx) * nc);
+				std::vector<float> stretched(bins_per_pixel ? size.nx : 0);
+				std::vector<int32_t> bins(bins_per_pixel ? size.nx : 0);
+
+				for (size_t y = row_start; y < row_end && !IsCancelled(cancel); ++y)
+				{
+					for (int c = 0; c < nc; ++c)
+					{
+						T const* const in_row = in_data + c * pixels_per_channel + y * size.nx;
+						stretchers[c].Stretch(in_row, size.nx, &row[c * size.nx], c == 0 && bins_per_pixel ? stretched.data() : nullptr);
+					}
+
+					if (bins_per_pixel)
+					{
+						ComputeHistogramBins(stretched.data(), size.nx, 0.0f, histogram_scale, max_bin, bins.data());
+						accumulators[tile].Add(bins.data(), size.nx);
+					}
+
+					unsigned char* const out_row = out_data + y * row_pitch;
+					if (nc == 1)
+					{
+						PackMonoRowBGRA32(row.data(), static_cast<int>(y), size, render_params, out_row);
+					}
+					else
+					{
+						PackColorRowBGRA32(row.data(), size, render_params, out_row);
+					}
+				}
+			});
+
+		if (IsCancelled(cancel))
+		{
+			return false;
+		}
+
+		for (auto const& accumulator : accumulators)
+		{
+			accumulator.MergeInto(histogram);
+		}
+
+		return true;
+	}
+
+}
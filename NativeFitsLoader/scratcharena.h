@@ -0,0 +1,168 @@
+/*
+	FITS Rating Tool
+	Copyright (C) 2022 TheCyberBrick
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <valarray>
+#include <array>
+#include <tuple>
+#include <vector>
+#include <mutex>
+#include <utility>
+#include <cstdint>
+
+namespace Processing
+{
+
+	enum class ScratchSlot
+	{
+		// decoded image data before it is stretched
+		Decoded = 0,
+
+		Count
+	};
+
+	// Image sized buffers that are kept around between calls.
+	// A buffer is only reallocated when the requested size
+	// changes, which for a given image never happens after
+	// the first call.
+	class ScratchArena
+	{
+	public:
+		template<typename T>
+		std::valarray<T>& Get(ScratchSlot slot, size_t size)
+		{
+			std::valarray<T>& buffer = std::get<Buffers<T>>(m_buffers)[static_cast<size_t>(slot)];
+			if (buffer.size() != size)
+			{
+				buffer.resize(size);
+			}
+			return buffer;
+		}
+
+	private:
+		template<typename T>
+		using Buffers = std::array<std::valarray<T>, static_cast<size_t>(ScratchSlot::Count)>;
+
+		std::tuple<Buffers<uint8_t>, Buffers<uint16_t>, Buffers<uint32_t>, Buffers<uint64_t>, Buffers<float>, Buffers<double>> m_buffers;
+	};
+
+	// Image sized buffers shared by all images, e.g. by concurrent statistics
+	// computations. A buffer is taken out of the pool while it is in use and
+	// put back afterwards. Buffers keep their size, so a buffer is only
+	// initialized when it first grows. At most max_idle buffers are kept
+	// around between calls.
+	template<typename T>
+	class ScratchPool
+	{
+	public:
+		class Lease
+		{
+		public:
+			Lease(ScratchPool* pool, std::vector<T>&& buffer) : m_pool(pool), m_buffer(std::move(buffer))
+			{
+			}
+
+			Lease(Lease&& other) : m_pool(other.m_pool), m_buffer(std::move(other.m_buffer))
+			{
+				other.m_pool = nullptr;
+			}
+
+			~Lease()
+			{
+				if (m_pool != nullptr)
+				{
+					m_pool->Release(std::move(m_buffer));
+				}
+			}
+
+			Lease(Lease const&) = delete;
+			Lease& operator=(Lease const&) = delete;
+			Lease& operator=(Lease&&) = delete;
+
+			T* data() { return m_buffer.data(); }
+
+		private:
+			ScratchPool* m_pool;
+			std::vector<T> m_buffer;
+		};
+
+		explicit ScratchPool(size_t max_idle) : m_max_idle(max_idle)
+		{
+		}
+
+		// Buffer of at least size elements with unspecified contents
+		Lease Acquire(size_t size)
+		{
+			std::vector<T> buffer;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+
+				size_t best = m_idle.size();
+				for (size_t i = 0; i < m_idle.size(); ++i)
+				{
+					if (best == m_idle.size() || IsBetterFit(m_idle[i].size(), m_idle[best].size(), size))
+					{
+						best = i;
+					}
+				}
+
+				if (best != m_idle.size())
+				{
+					buffer = std::move(m_idle[best]);
+					m_idle.erase(m_idle.begin() + best);
+				}
+			}
+
+			if (buffer.size() < size)
+			{
+				buffer.resize(size);
+			}
+
+			return Lease(this, std::move(buffer));
+		}
+
+	private:
+		// The smallest buffer that is large enough is preferred,
+		// otherwise the largest so that as little as possible is added
+		static bool IsBetterFit(size_t capacity, size_t best_capacity, size_t size)
+		{
+			bool const fits = capacity >= size;
+			if (fits != (best_capacity >= size))
+			{
+				return fits;
+			}
+			return fits ? capacity < best_capacity : capacity > best_capacity;
+		}
+
+		void Release(std::vector<T>&& buffer)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_idle.size() < m_max_idle)
+			{
+				m_idle.push_back(std::move(buffer));
+			}
+		}
+
+		size_t const m_max_idle;
+
+		std::mutex m_mutex;
+		std::vector<std::vector<T>> m_idle;
+	};
+
+}
@@ -23,10 +23,21 @@
 #include <ppl.h>
 
 #include "fitsattributes.h"
+#include "imagestatistics.h"
+#include "histogram.h"
+#include "median.h"
 
 namespace Processing
 {
 
+	// Set to non-zero by the caller to abandon a stretch that is still running
+	typedef int32_t const volatile* CancellationFlag;
+
+	inline bool IsCancelled(CancellationFlag cancel)
+	{
+		return cancel != nullptr && *cancel != 0;
+	}
+
 	struct ChannelStretchParameters
 	{
 		int max_input = 65535;
@@ -58,16 +69,7 @@ namespace Processing
 		}
 	};
 
-	template<typename T>
-	T Median(std::valarray<T>& values)
-	{
-		int const middle = static_cast<int>(values.size() / 2);
-		std::nth_element(std::begin(values), std::begin(values) + middle, std::end(values));
-		return values[middle];
-	}
-
-	template<typename T>
-	int EstimateMaximum(std::valarray<T>& data, int offset, int width, int height, int max)
+	inline int EstimateMaximum(int max)
 	{
 		int range = 1;
 		if (max > 255)
@@ -81,30 +83,37 @@ namespace Processing
 		return range;
 	}
 
-	template<typename T>
-	void ComputeChannelStretch(std::valarray<T>& data, int offset, int width, int height, ChannelStretchParameters* channel_params)
+	// Statistics the decoder collected for a channel, if any
+	inline Loader::ChannelStatistics const* GetChannelStatistics(Loader::ImageStatistics const* statistics, int channel)
 	{
-		int const max_samples = 262144;
-		int const slice_stride = std::max(1, width * height / max_samples);
-		std::valarray<T> samples = data[std::slice(offset, width * height / slice_stride, slice_stride)];
-
-		float M = Median(samples);
+		if (statistics == nullptr || !statistics->valid || channel >= statistics->nc)
+		{
+			return nullptr;
+		}
+		return &statistics->channels[channel];
+	}
 
-		T max = 0;
-		for (int i = 0; i < samples.size(); ++i)
+	// Histogram with one bin per value of a channel, if the decoder collected one
+	inline std::vector<uint32_t> const* GetValueHistogram(Loader::ImageStatistics const* statistics, int channel)
+	{
+		Loader::ChannelStatistics const* channel_statistics = GetChannelStatistics(statistics, channel);
+		if (channel_statistics == nullptr || !channel_statistics->exact)
 		{
-			T const s = samples[i];
-			max = std::max(max, s);
-			samples[i] = s > M ? s - M : M - s;
+			return nullptr;
 		}
+		return &channel_statistics->histogram;
+	}
 
-		channel_params->max_input = EstimateMaximum(data, offset, width, height, max);
+	// Auto-stretch of a channel with the given median statistics
+	inline void ComputeChannelStretch(MedianStatistics const& statistics, ChannelStretchParameters* channel_params)
+	{
+		channel_params->max_input = EstimateMaximum(static_cast<int>(statistics.max));
 
 		float const normalization_factor = 1.0f / static_cast<float>(channel_params->max_input);
 
-		M *= normalization_factor;
+		float const M = statistics.median * normalization_factor;
 
-		float const MADN = 1.4826f * Median(samples) * normalization_factor;
+		float const MADN = 1.4826f * statistics.mad * normalization_factor;
 
 		float const B = 0.25f;
 		float const C = -2.8f;
@@ -141,99 +150,153 @@ namespace Processing
 		channel_params->shadows = s;
 	}
 
+	// channel_statistics is optional and must have been collected from the channel
 	template<typename T>
-	void ComputeImageStretch(std::valarray<T>& data, Loader::FITSImageDim const& size, ImageStretchParameters* image_params)
+	void ComputeChannelStretch(std::valarray<T>& data, int offset, int width, int height, ChannelStretchParameters* channel_params, Loader::ChannelStatistics const* channel_statistics = nullptr)
 	{
-		int const pixels_per_channel = size.nx * size.ny;
-		concurrency::parallel_for(0, size.nc, [&](int c) { ComputeChannelStretch(data, pixels_per_channel * c, size.nx, size.ny, &(*image_params)[c]); });
+		MedianStatistics const statistics = ComputeMedianStatistics(&data[offset], static_cast<size_t>(width) * height, channel_statistics);
+
+		ComputeChannelStretch(statistics, channel_params);
 	}
 
+	// statistics is optional and must have been collected from data
 	template<typename T>
-	void StretchChannel(std::valarray<T>& data, int offset, int width, int height, ChannelStretchParameters const& channel_params, uint32_t* histogram, size_t histogram_size)
+	void ComputeImageStretch(std::valarray<T>& data, Loader::FITSImageDim const& size, ImageStretchParameters* image_params, Loader::ImageStatistics const* statistics = nullptr)
 	{
-		int const max_output = 255;
+		int const pixels_per_channel = size.nx * size.ny;
+		concurrency::parallel_for(0, size.nc, [&](int c) { ComputeChannelStretch(data, pixels_per_channel * c, size.nx, size.ny, &(*image_params)[c], GetChannelStatistics(statistics, c)); });
+	}
 
-		float const h = channel_params.highlights;
-		float const m = channel_params.midtones;
-		float const s = channel_params.shadows;
+	// Clip and MTF of a channel folded into a single rational function
+	struct StretchFunction
+	{
+		static int const max_output = 255;
 
-		float const h_scaled = h * channel_params.max_input;
-		float const m_scaled = m * channel_params.max_input;
-		float const s_scaled = s * channel_params.max_input;
+		float s_scaled, h_scaled;
+		float a1, a2, b1, b2;
 
-		float const clip_denominator = h_scaled - s_scaled;
-		float const clip_scale = std::abs(clip_denominator) > 0.0001f ? 1.0f / clip_denominator : 1.0f;
+		StretchFunction(ChannelStretchParameters const& channel_params)
+		{
+			float const h = channel_params.highlights;
+			float const m = channel_params.midtones;
+			float const s = channel_params.shadows;
 
-		float const mtf_numerator = (m_scaled - channel_params.max_input) * max_output;
-		float const mtf_denominator = (2 * m_scaled - channel_params.max_input);
+			h_scaled = h * channel_params.max_input;
+			s_scaled = s * channel_params.max_input;
+			float const m_scaled = m * channel_params.max_input;
 
-		float const a1 = mtf_numerator * clip_scale;
-		float const a2 = s_scaled * a1;
+			float const clip_denominator = h_scaled - s_scaled;
+			float const clip_scale = std::abs(clip_denominator) > 0.0001f ? 1.0f / clip_denominator : 1.0f;
 
-		float const b1 = mtf_denominator * clip_scale;
-		float const b2 = s_scaled * b1 + m_scaled;
+			float const mtf_numerator = (m_scaled - channel_params.max_input) * max_output;
+			float const mtf_denominator = (2 * m_scaled - channel_params.max_input);
 
-		//Clip: x = (x - s_scaled) * clip_scale;
-		//MTF:  x = (mtf_numerator * x) / (mtf_denominator * x - m_scaled);
-		//-->   x = (x * a1 - a2) / (x * b1 - b2);
+			a1 = mtf_numerator * clip_scale;
+			a2 = s_scaled * a1;
 
-		int const start = offset;
-		int const end = start + width * height;
+			b1 = mtf_denominator * clip_scale;
+			b2 = s_scaled * b1 + m_scaled;
 
-		if (histogram == nullptr)
+			//Clip: x = (x - s_scaled) * clip_scale;
+			//MTF:  x = (mtf_numerator * x) / (mtf_denominator * x - m_scaled);
+			//-->   x = (x * a1 - a2) / (x * b1 - b2);
+		}
+
+		template<typename T>
+		inline float operator()(T const x) const
 		{
-			for (int i = start; i < end; ++i)
+			if (x < s_scaled)
 			{
-				T const x = data[i];
-
-				if (x < s_scaled)
-				{
-					data[i] = 0;
-				}
-				else if (x > h_scaled)
-				{
-					data[i] = max_output;
-				}
-				else
-				{
-					data[i] = static_cast<T>((x * a1 - a2) / (x * b1 - b2));
-				}
+				return 0.0f;
+			}
+			else if (x > h_scaled)
+			{
+				return static_cast<float>(max_output);
 			}
+			return (x * a1 - a2) / (x * b1 - b2);
 		}
-		else
-		{
-			float const histogram_scale = 1.0f / max_output * (histogram_size - 1);
+	};
 
-			for (int i = start; i < end; ++i)
-			{
-				T const x = data[i];
+	// Integer data of up to 16 bits has few enough distinct
+	// values to be stretched through a lookup table
+	template<typename T>
+	struct UseStretchLUT : std::integral_constant<bool, std::is_integral<T>::value && sizeof(T) <= 2>
+	{
+	};
 
-				if (x < s_scaled)
-				{
-					data[i] = 0;
-					++histogram[0];
-				}
-				else if (x > h_scaled)
-				{
-					data[i] = max_output;
-					++histogram[histogram_size - 1];
-				}
-				else
+	// Smallest number of LUT entries worth handing to a separate worker. Evaluating
+	// the stretch costs far more than binning a value, so the blocks are smaller.
+	size_t const stretch_lut_min_block_size = 4096;
+
+	// Number of blocks the values of a LUT of lut_size entries are split into
+	inline size_t GetStretchLUTBlockCount(size_t lut_size)
+	{
+		size_t const workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+		return std::max<size_t>(1, std::min(workers, lut_size / stretch_lut_min_block_size));
+	}
+
+	// Output of the stretch for every input value of T
+	template<typename T>
+	std::vector<uint8_t> ComputeStretchLUT(StretchFunction const& stretch)
+	{
+		size_t const lut_size = size_t(1) << (8 * sizeof(T));
+
+		std::vector<uint8_t> lut(lut_size);
+		ParallelForBlocks(lut_size, GetStretchLUTBlockCount(lut_size), [&](size_t, size_t start, size_t end)
+			{
+				for (size_t v = start; v < end; ++v)
 				{
-					float const stretched = (x * a1 - a2) / (x * b1 - b2);
-					data[i] = static_cast<T>(stretched);
-					++histogram[std::max(std::min(static_cast<size_t>(stretched * histogram_scale), histogram_size - 1), size_t{ 0 })];
+					lut[v] = static_cast<uint8_t>(stretch(static_cast<T>(v)));
 				}
-			}
-		}
+			});
+		return lut;
 	}
 
+	// Adds the stretched histogram of n integer values of T to histogram. The
+	// stretched histogram follows from the histogram of the input values,
+	// which is counted here if value_histogram is null.
 	template<typename T>
-	void StretchImage(std::valarray<T>& data, Loader::FITSImageDim const& size, ImageStretchParameters const& image_params, uint32_t* histogram_rk, uint32_t* histogram_g, uint32_t* histogram_b, size_t histogram_size)
+	void ComputeStretchedHistogram(T const* data, size_t n, StretchFunction const& stretch, std::vector<uint32_t> const* value_histogram, uint32_t* histogram, size_t histogram_size)
 	{
-		int const pixels_per_channel = size.nx * size.ny;
-		uint32_t* const histograms[] = { histogram_rk, histogram_g, histogram_b };
-		concurrency::parallel_for(0, size.nc, [&](int c) { StretchChannel(data, pixels_per_channel * c, size.nx, size.ny, image_params[c], histograms[c == 0 || c > 2 ? 0 : c], histogram_size); });
+		size_t const lut_size = size_t(1) << (8 * sizeof(T));
+
+		std::vector<uint32_t> counted_histogram;
+		if (value_histogram == nullptr)
+		{
+			counted_histogram.assign(lut_size, 0);
+			ComputeHistogram(data, n, 0.0f, 1.0f, counted_histogram.data(), lut_size);
+			value_histogram = &counted_histogram;
+		}
+
+		float const histogram_scale = 1.0f / StretchFunction::max_output * (histogram_size - 1);
+		float const max_bin = static_cast<float>(histogram_size - 1);
+
+		// one histogram per block of values, added up in block order
+		size_t const num_values = std::min(lut_size, value_histogram->size());
+		size_t const num_blocks = GetStretchLUTBlockCount(num_values);
+		std::vector<std::vector<uint32_t>> block_histograms(num_blocks, std::vector<uint32_t>(histogram_size, 0));
+
+		ParallelForBlocks(num_values, num_blocks, [&](size_t block, size_t start, size_t end)
+			{
+				uint32_t* const block_histogram = block_histograms[block].data();
+				for (size_t v = start; v < end; ++v)
+				{
+					uint32_t const count = (*value_histogram)[v];
+					if (count != 0)
+					{
+						float const bin = stretch(static_cast<T>(v)) * histogram_scale;
+						block_histogram[static_cast<size_t>(std::min(max_bin, std::max(0.0f, bin)))] += count;
+					}
+				}
+			});
+
+		for (auto const& block_histogram : block_histograms)
+		{
+			for (size_t i = 0; i < histogram_size; ++i)
+			{
+				histogram[i] += block_histogram[i];
+			}
+		}
 	}
 
 }
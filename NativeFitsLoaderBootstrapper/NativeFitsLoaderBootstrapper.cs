@@ -37,6 +37,8 @@ public class NativeFitsLoaderBootstrapper : INativeFitsLoader
 
     public FitsImageDataHandle LoadImageData(FitsHandle handle, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize) => LoadImageDataNative(handle, parameters, histogram, histogramSize);
 
+    public FitsImageDataHandle ReloadImageData(FitsHandle handle, FitsImageDataHandle dataHandle, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize) => ReloadImageDataNative(handle, dataHandle, parameters, histogram, histogramSize);
+
     public bool UnloadImageData(FitsImageDataHandle handle) => UnloadImageDataNative(handle);
 
     public bool IsImageDataLoaded(FitsImageDataHandle handle) => IsImageDataLoadedNative(handle);
@@ -45,7 +47,7 @@ public class NativeFitsLoaderBootstrapper : INativeFitsLoader
 
 
 
-    public FitsStatisticsHandle ComputeStatistics(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, StatisticsProgressCallback? callback) => ComputeStatisticsNative(fitsHandle, dataHandle, callback);
+    public FitsStatisticsHandle ComputeStatistics(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, PhotometryPSFParameters psfParameters, StatisticsProgressCallback? callback) => ComputeStatisticsNative(fitsHandle, dataHandle, psfParameters, callback);
 
     public bool GetPhotometry(FitsStatisticsHandle handle, int src_start, int src_n, int dst_start, PhotometryObject[] photometry) => GetPhotometryNative(handle, src_start, src_n, dst_start, photometry);
 
@@ -55,9 +57,29 @@ public class NativeFitsLoaderBootstrapper : INativeFitsLoader
 
     public ImageStretchParameters ComputeStretch(FitsHandle fitsHandle, FitsImageDataHandle dataHandle) => ComputeStretchNative(fitsHandle, dataHandle);
 
+    public ImageStretchParameters ComputeGroupStretch(FitsHandle[] fitsHandles, FitsImageDataHandle[] dataHandles, uint numHandles) => ComputeGroupStretchNative(fitsHandles, dataHandles, numHandles);
+
+
+
+    public FitsImageHandle ProcessImage(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageHandle imgHandle, bool computeStrechParams, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize, IntPtr cancel) => ProcessImageNative(fitsHandle, dataHandle, imgHandle, computeStrechParams, parameters, histogram, histogramSize, cancel);
+
+    public bool ProcessImageInto(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, bool computeStrechParams, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize, IntPtr cancel) => ProcessImageIntoNative(fitsHandle, dataHandle, data, dataSize, rowPitch, computeStrechParams, parameters, histogram, histogramSize, cancel);
+
+    public bool ProcessImagePreviewInto(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, int maxSize, FitsImageLoaderParameters parameters, out FitsImageDim previewDim) => ProcessImagePreviewIntoNative(fitsHandle, dataHandle, data, dataSize, rowPitch, maxSize, parameters, out previewDim);
+
+    public bool ReadThumbnail(FitsHandle fitsHandle, IntPtr data, ulong dataSize, ulong rowPitch, int maxSize, FitsImageLoaderParameters parameters, out FitsImageDim thumbnailDim) => ReadThumbnailNative(fitsHandle, data, dataSize, rowPitch, maxSize, parameters, out thumbnailDim);
+
+    public void SetFrameCacheBudget(ulong budget) => SetFrameCacheBudgetNative(budget);
+
+    public void ClearFrameCache() => ClearFrameCacheNative();
+
+    public bool PrefetchFrame(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageLoaderParameters parameters) => PrefetchFrameNative(fitsHandle, dataHandle, parameters);
+
+    public bool ProcessCachedImageInto(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, FitsImageLoaderParameters parameters) => ProcessCachedImageIntoNative(fitsHandle, dataHandle, data, dataSize, rowPitch, parameters);
 
+    public bool StorePreview(string cacheDirectory, string file, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, FitsImageDim dim, ulong rowPitch, uint[]? histogram, uint histogramSize) => StorePreviewNative(cacheDirectory, file, maxSize, parameters, data, dim, rowPitch, histogram, histogramSize);
 
-    public FitsImageHandle ProcessImage(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageHandle imgHandle, bool computeStrechParams, FitsImageLoaderParameters parameters, uint[] histogram, uint histogramSize) => ProcessImageNative(fitsHandle, dataHandle, imgHandle, computeStrechParams, parameters, histogram, histogramSize);
+    public bool LoadPreview(string cacheDirectory, string file, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch, uint[]? histogram, uint histogramSize, out FitsImageDim previewDim) => LoadPreviewNative(cacheDirectory, file, maxSize, parameters, data, dataSize, rowPitch, histogram, histogramSize, out previewDim);
 
     public void FreeImage(FitsImageHandle imgHandle) => FreeImageNative(imgHandle);
     #endregion
@@ -80,6 +102,9 @@ public class NativeFitsLoaderBootstrapper : INativeFitsLoader
     [DllImport(@"NativeFitsLoader", EntryPoint = "LoadImageData", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
     private static extern FitsImageDataHandle LoadImageDataNative(FitsHandle handle, FitsImageLoaderParameters parameters, [In, Out] uint[] histogram, uint histogramSize);
 
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ReloadImageData", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern FitsImageDataHandle ReloadImageDataNative(FitsHandle handle, FitsImageDataHandle dataHandle, FitsImageLoaderParameters parameters, [In, Out] uint[] histogram, uint histogramSize);
+
     [DllImport(@"NativeFitsLoader", EntryPoint = "UnloadImageData", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
     private static extern bool UnloadImageDataNative(FitsImageDataHandle handle);
 
@@ -92,7 +117,7 @@ public class NativeFitsLoaderBootstrapper : INativeFitsLoader
 
 
     [DllImport(@"NativeFitsLoader", EntryPoint = "ComputeStatistics", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
-    private static extern FitsStatisticsHandle ComputeStatisticsNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, StatisticsProgressCallback? callback);
+    private static extern FitsStatisticsHandle ComputeStatisticsNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, PhotometryPSFParameters psfParameters, StatisticsProgressCallback? callback);
 
     [DllImport(@"NativeFitsLoader", EntryPoint = "GetPhotometry", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
     private static extern bool GetPhotometryNative(FitsStatisticsHandle handle, int src_start, int src_n, int dst_start, [MarshalAs(UnmanagedType.LPArray, ArraySubType = UnmanagedType.Struct)][In, Out] PhotometryObject[] photometry);
@@ -105,10 +130,40 @@ public class NativeFitsLoaderBootstrapper : INativeFitsLoader
     [DllImport(@"NativeFitsLoader", EntryPoint = "ComputeStretch", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
     private static extern ImageStretchParameters ComputeStretchNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle);
 
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ComputeGroupStretch", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern ImageStretchParameters ComputeGroupStretchNative([In] FitsHandle[] fitsHandles, [In] FitsImageDataHandle[] dataHandles, uint numHandles);
+
 
 
     [DllImport(@"NativeFitsLoader", EntryPoint = "ProcessImage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
-    private static extern FitsImageHandle ProcessImageNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageHandle imgHandle, bool computeStrechParams, FitsImageLoaderParameters parameters, [In, Out] uint[] histogram, uint histogramSize);
+    private static extern FitsImageHandle ProcessImageNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageHandle imgHandle, bool computeStrechParams, FitsImageLoaderParameters parameters, [In, Out] uint[] histogram, uint histogramSize, IntPtr cancel);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ProcessImageInto", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool ProcessImageIntoNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, bool computeStrechParams, FitsImageLoaderParameters parameters, [In, Out] uint[] histogram, uint histogramSize, IntPtr cancel);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ProcessImagePreviewInto", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool ProcessImagePreviewIntoNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, int maxSize, FitsImageLoaderParameters parameters, out FitsImageDim previewDim);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ReadThumbnail", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool ReadThumbnailNative(FitsHandle fitsHandle, IntPtr data, ulong dataSize, ulong rowPitch, int maxSize, FitsImageLoaderParameters parameters, out FitsImageDim thumbnailDim);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "SetFrameCacheBudget", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern void SetFrameCacheBudgetNative(ulong budget);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ClearFrameCache", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern void ClearFrameCacheNative();
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "PrefetchFrame", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool PrefetchFrameNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, FitsImageLoaderParameters parameters);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "ProcessCachedImageInto", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool ProcessCachedImageIntoNative(FitsHandle fitsHandle, FitsImageDataHandle dataHandle, IntPtr data, ulong dataSize, ulong rowPitch, FitsImageLoaderParameters parameters);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "StorePreview", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool StorePreviewNative([MarshalAs(UnmanagedType.LPStr)] string cacheDirectory, [MarshalAs(UnmanagedType.LPStr)] string file, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, FitsImageDim dim, ulong rowPitch, [In] uint[]? histogram, uint histogramSize);
+
+    [DllImport(@"NativeFitsLoader", EntryPoint = "LoadPreview", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
+    private static extern bool LoadPreviewNative([MarshalAs(UnmanagedType.LPStr)] string cacheDirectory, [MarshalAs(UnmanagedType.LPStr)] string file, int maxSize, FitsImageLoaderParameters parameters, IntPtr data, ulong dataSize, ulong rowPitch, [In, Out] uint[]? histogram, uint histogramSize, out FitsImageDim previewDim);
 
     [DllImport(@"NativeFitsLoader", EntryPoint = "FreeImage", CallingConvention = CallingConvention.Cdecl, CharSet = CharSet.Unicode)]
     private static extern void FreeImageNative(FitsImageHandle imgHandle);